@@ -0,0 +1,248 @@
+#include "workloads.hpp"
+#include <libgbc/machine.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+// Runs every workload in every mode and prints the results as JSON. A stored
+// result can be given to --compare, which marks every workload and mode that
+// got slower by more than the threshold, and then fails.
+static const char* USAGE = R"(usage: bench [options]
+  --frames N       timed frames per run (600)
+  --warmup N       frames to run before timing (60)
+  --repeat N       runs per workload and mode, the fastest counts (3)
+  --workload NAME  only run workloads with NAME in their name
+  --mode MODE      only run headless, render or watch
+  --roms DIR       where the bundled test ROMs are
+  --compare FILE   compare against an earlier result
+  --threshold PCT  how much slower counts as a regression (10)
+)";
+
+enum bench_mode_t
+{
+    HEADLESS, // no rendering, only what the CPU can see
+    RENDER,   // every scanline is rendered
+    WATCH,    // headless, with watchpoints on work and cartridge RAM
+    NUM_MODES
+};
+static const char* const mode_names[NUM_MODES] = {"headless", "render", "watch"};
+
+struct options_t
+{
+    int frames = 600;
+    int warmup = 60;
+    int repeat = 3;
+    std::string workload;
+    std::string mode;
+    std::string roms = BENCH_ROM_DIR;
+    std::string compare;
+    double threshold = 10.0;
+};
+
+static std::vector<uint8_t> load_file(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+static std::unique_ptr<gbc::Machine> create_machine(const std::shared_ptr<const gbc::ROM>& rom,
+                                                    const bench_mode_t mode)
+{
+    auto machine = std::make_unique<gbc::Machine>(rom);
+    machine->gpu.set_headless(mode != RENDER);
+    if (mode == WATCH)
+    {
+        static uint64_t hits = 0;
+        auto count = [](gbc::Memory&, uint16_t, uint8_t) { hits++; };
+        machine->memory.watchpoint(gbc::Memory::READ, {0xC000, 0xC0FF}, count);
+        machine->memory.watchpoint(gbc::Memory::WRITE, {0xC000, 0xC0FF}, count);
+        machine->memory.watchpoint(gbc::Memory::WRITE, {0xA000, 0xA0FF}, count);
+    }
+    return machine;
+}
+
+// instructions the guest executes during the timed frames, counted by stepping
+// through them one by one, so that it does not depend on how the emulator
+// gets there (block cache, idle skipping or counters compiled in)
+static uint64_t count_instructions(const std::shared_ptr<const gbc::ROM>& rom,
+                                   const options_t& opts)
+{
+    // every mode runs the same frames, so they end where this run ends
+    auto timed = create_machine(rom, HEADLESS);
+    timed->run_frames(opts.warmup + opts.frames);
+    const uint64_t end = timed->now();
+
+    auto machine = create_machine(rom, HEADLESS);
+    machine->run_frames(opts.warmup);
+
+    uint64_t count = 0;
+    while (machine->now() < end && machine->is_running())
+    {
+        if (!machine->cpu.is_halting() && !machine->cpu.is_stopping()) count++;
+        machine->simulate();
+    }
+    return count;
+}
+
+static double time_run(const std::shared_ptr<const gbc::ROM>& rom, const bench_mode_t mode,
+                       const options_t& opts)
+{
+    auto machine = create_machine(rom, mode);
+    machine->run_frames(opts.warmup);
+    const auto t0 = std::chrono::steady_clock::now();
+    machine->run_frames(opts.frames);
+    const auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+// the value of "key": in a line of our own output
+static std::string json_field(const std::string& line, const std::string& key)
+{
+    const std::string pattern = "\"" + key + "\": ";
+    const size_t pos = line.find(pattern);
+    if (pos == std::string::npos) return "";
+    size_t begin = pos + pattern.size();
+    size_t end = line.find_first_of(",}", begin);
+    if (line[begin] == '"')
+    {
+        begin++;
+        end = line.find('"', begin);
+    }
+    return line.substr(begin, end - begin);
+}
+
+// ns per frame for every workload and mode in an earlier result
+static std::map<std::string, double> load_baseline(const std::string& filename)
+{
+    std::map<std::string, double> baseline;
+    std::ifstream file(filename);
+    if (!file)
+    {
+        fprintf(stderr, "Could not open baseline %s\n", filename.c_str());
+        exit(1);
+    }
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const std::string workload = json_field(line, "workload");
+        if (workload.empty()) continue;
+        const std::string key = workload + "/" + json_field(line, "mode");
+        baseline[key] = std::atof(json_field(line, "ns_per_frame").c_str());
+    }
+    return baseline;
+}
+
+static options_t parse_options(int argc, char** argv)
+{
+    options_t opts;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help" || i + 1 >= argc)
+        {
+            fprintf(stderr, "%s", USAGE);
+            exit(arg == "-h" || arg == "--help" ? 0 : 1);
+        }
+        const char* value = argv[++i];
+        if (arg == "--frames")
+            opts.frames = std::atoi(value);
+        else if (arg == "--warmup")
+            opts.warmup = std::atoi(value);
+        else if (arg == "--repeat")
+            opts.repeat = std::max(1, std::atoi(value));
+        else if (arg == "--workload")
+            opts.workload = value;
+        else if (arg == "--mode")
+            opts.mode = value;
+        else if (arg == "--roms")
+            opts.roms = value;
+        else if (arg == "--compare")
+            opts.compare = value;
+        else if (arg == "--threshold")
+            opts.threshold = std::atof(value);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n%s", arg.c_str(), USAGE);
+            exit(1);
+        }
+    }
+    return opts;
+}
+
+int main(int argc, char** argv)
+{
+    const options_t opts = parse_options(argc, argv);
+
+    // the bundled test ROMs, then the synthetic ones
+    std::vector<workload_t> workloads;
+    std::vector<std::string> files;
+    for (const auto& entry : std::filesystem::directory_iterator(opts.roms))
+    {
+        if (entry.path().extension() == ".gb") files.push_back(entry.path().string());
+    }
+    std::sort(files.begin(), files.end());
+    for (const auto& file : files)
+    { workloads.push_back({std::filesystem::path(file).stem().string(), load_file(file)}); }
+    for (auto& workload : synthetic_workloads()) workloads.push_back(std::move(workload));
+
+    std::map<std::string, double> baseline;
+    if (!opts.compare.empty()) baseline = load_baseline(opts.compare);
+
+    printf("{\n");
+    printf("  \"frames\": %d, \"warmup\": %d, \"repeat\": %d, \"stats\": %s,\n", opts.frames,
+           opts.warmup, opts.repeat, gbc::Stats::enabled ? "true" : "false");
+    printf("  \"results\": [\n");
+    int regressions = 0;
+    bool first = true;
+    for (const auto& workload : workloads)
+    {
+        if (workload.name.find(opts.workload) == std::string::npos) continue;
+        const auto rom = std::make_shared<const gbc::ROM>(workload.rom);
+        const uint64_t instructions = count_instructions(rom, opts);
+
+        for (int mode = 0; mode < NUM_MODES; mode++)
+        {
+            if (!opts.mode.empty() && opts.mode != mode_names[mode]) continue;
+            double seconds = 1e30;
+            for (int i = 0; i < opts.repeat; i++)
+            { seconds = std::min(seconds, time_run(rom, (bench_mode_t) mode, opts)); }
+            const double ns_per_frame = seconds * 1e9 / opts.frames;
+
+            std::ostringstream line;
+            line << "    {\"workload\": \"" << workload.name << "\", \"mode\": \""
+                 << mode_names[mode] << "\", \"instructions\": " << instructions
+                 << ", \"seconds\": " << seconds
+                 << ", \"instructions_per_sec\": " << uint64_t(instructions / seconds)
+                 << ", \"frames_per_sec\": " << opts.frames / seconds
+                 << ", \"ns_per_frame\": " << uint64_t(ns_per_frame);
+            const auto it = baseline.find(workload.name + "/" + mode_names[mode]);
+            if (it != baseline.end() && it->second > 0.0)
+            {
+                const double change = (ns_per_frame / it->second - 1.0) * 100.0;
+                const bool regressed = change > opts.threshold;
+                regressions += regressed;
+                line << ", \"baseline_ns_per_frame\": " << uint64_t(it->second)
+                     << ", \"change_percent\": " << change
+                     << ", \"regressed\": " << (regressed ? "true" : "false");
+                fprintf(stderr, "%-14s %-8s %10.0f ns/frame %+7.1f%%%s\n", workload.name.c_str(),
+                        mode_names[mode], ns_per_frame, change, regressed ? "  REGRESSED" : "");
+            }
+            else
+            {
+                fprintf(stderr, "%-14s %-8s %10.0f ns/frame\n", workload.name.c_str(),
+                        mode_names[mode], ns_per_frame);
+            }
+            line << "}";
+            printf("%s%s", first ? "" : ",\n", line.str().c_str());
+            first = false;
+        }
+    }
+    printf("\n  ],\n  \"regressions\": %d\n}\n", regressions);
+    return (regressions > 0) ? 1 : 0;
+}
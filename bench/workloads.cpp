@@ -0,0 +1,268 @@
+#include "workloads.hpp"
+#include <cassert>
+#include <cstring>
+#include <initializer_list>
+
+namespace
+{
+// just enough of an assembler to lay out the workloads
+class RomBuilder
+{
+public:
+    RomBuilder(const int banks, const uint8_t cart_type, const uint8_t ram_size, const bool cgb)
+        : m_rom(banks * 0x4000, 0x00)
+    {
+        // entry point: NOP, JP 0x150
+        this->org(0x100);
+        this->emit({0x00, 0xC3, 0x50, 0x01});
+        std::memcpy(&m_rom[0x134], "GBCBENCH", 8);
+        m_rom[0x143] = cgb ? 0x80 : 0x00;
+        m_rom[0x147] = cart_type;
+        // 32kb << N
+        m_rom[0x148] = __builtin_ctz(banks) - 1;
+        m_rom[0x149] = ram_size;
+        // every interrupt just returns (RETI)
+        for (int vector = 0x40; vector <= 0x60; vector += 8) m_rom[vector] = 0xD9;
+        // DI, LD SP, 0xFFFE
+        this->org(0x150);
+        this->emit({0xF3, 0x31, 0xFE, 0xFF});
+    }
+
+    uint16_t here() const noexcept { return m_pc; }
+    void org(const uint16_t addr) noexcept { this->m_pc = addr; }
+    void emit(std::initializer_list<uint8_t> bytes)
+    {
+        for (const uint8_t byte : bytes) m_rom.at(m_pc++) = byte;
+    }
+    // JR (0x18) or JR cc (0x20, 0x28, 0x30, 0x38) to a label
+    void jr(const uint8_t op, const uint16_t target)
+    {
+        const int disp = target - (m_pc + 2);
+        assert(disp >= -128 && disp < 128);
+        this->emit({op, uint8_t(disp)});
+    }
+    // LD B, N, then DEC B until it is zero (16 T-cycles per round)
+    void delay(const uint8_t rounds)
+    {
+        this->emit({0x06, rounds});
+        const uint16_t loop = here();
+        this->emit({0x05});
+        this->jr(0x20, loop);
+    }
+    // anywhere in the image, by file offset
+    uint8_t& operator[](const size_t offset) { return m_rom.at(offset); }
+
+    std::vector<uint8_t> release() { return std::move(m_rom); }
+
+private:
+    std::vector<uint8_t> m_rom;
+    uint16_t m_pc = 0;
+};
+
+std::vector<uint8_t> alu_rom()
+{
+    RomBuilder rom(2, 0x00, 0x00, false);
+    const uint16_t loop = rom.here();
+    rom.emit({
+        0x80,       // ADD A, B
+        0xA9,       // XOR C
+        0x04,       // INC B
+        0x0D,       // DEC C
+        0x07,       // RLCA
+        0x8A,       // ADC A, D
+        0x93,       // SUB E
+        0xA4,       // AND H
+        0xB5,       // OR L
+        0x23,       // INC HL
+        0x1B,       // DEC DE
+        0xCB, 0x37, // SWAP A
+        0x2F,       // CPL
+        0x09,       // ADD HL, BC
+    });
+    rom.jr(0x18, loop);
+    return rom.release();
+}
+
+std::vector<uint8_t> banking_rom()
+{
+    // MBC5 with 64 ROM banks and 4 RAM banks
+    constexpr int BANKS = 64;
+    RomBuilder rom(BANKS, 0x1B, 0x03, false);
+    // every bank starts with its number, followed by RET
+    for (int bank = 1; bank < BANKS; bank++)
+    {
+        rom[bank * 0x4000] = bank;
+        rom[bank * 0x4000 + 1] = 0xC9;
+    }
+    rom.emit({
+        0x3E, 0x0A,       // LD A, 0x0A
+        0xEA, 0x00, 0x00, // LD (0x0000), A: enable RAM
+        0x0E, 0x01,       // LD C, 1
+    });
+    const uint16_t loop = rom.here();
+    rom.emit({
+        0x79,             // LD A, C
+        0xEA, 0x00, 0x20, // LD (0x2000), A: select ROM bank
+        0xFA, 0x00, 0x40, // LD A, (0x4000)
+        0xCD, 0x01, 0x40, // CALL 0x4001
+        0xEA, 0x00, 0xA0, // LD (0xA000), A
+        0x79,             // LD A, C
+        0xE6, 0x03,       // AND 3
+        0xEA, 0x00, 0x40, // LD (0x4000), A: select RAM bank
+        0x0C,             // INC C
+    });
+    rom.jr(0x18, loop);
+    return rom.release();
+}
+
+std::vector<uint8_t> dma_rom()
+{
+    RomBuilder rom(2, 0x00, 0x00, true);
+    const uint16_t loop = rom.here();
+    rom.emit({
+        0x3E, 0xC0, // LD A, 0xC0
+        0xE0, 0x46, // LDH (DMA), A: OAM DMA from 0xC000
+    });
+    rom.delay(40);
+    rom.emit({
+        0x3E, 0xC0, // LD A, 0xC0
+        0xE0, 0x51, // LDH (HDMA1), A
+        0xAF,       // XOR A
+        0xE0, 0x52, // LDH (HDMA2), A: from 0xC000
+        0xE0, 0x53, // LDH (HDMA3), A
+        0xE0, 0x54, // LDH (HDMA4), A: to 0x8000
+        0x3E, 0x7F, // LD A, 0x7F
+        0xE0, 0x55, // LDH (HDMA5), A: 2kb general purpose DMA
+        0x3E, 0x8F, // LD A, 0x8F
+        0xE0, 0x55, // LDH (HDMA5), A: 256 bytes of H-blank DMA
+    });
+    // H-blank DMA takes 16 lines
+    rom.delay(0);
+    rom.delay(0);
+    rom.jr(0x18, loop);
+    return rom.release();
+}
+
+std::vector<uint8_t> sprites_rom()
+{
+    RomBuilder rom(2, 0x00, 0x00, false);
+    // 40 sprites spread over the screen, at 0x1000
+    for (int i = 0; i < 40; i++)
+    {
+        rom[0x1000 + i * 4 + 0] = 16 + (i * 7) % 136;
+        rom[0x1000 + i * 4 + 1] = 8 + (i * 13) % 160;
+        rom[0x1000 + i * 4 + 2] = 1;
+        // alternating palettes, and every other pair behind the background
+        rom[0x1000 + i * 4 + 3] = ((i & 1) << 4) | ((i & 2) << 6);
+    }
+    rom.emit({
+        0xAF,             // XOR A
+        0xE0, 0x40,       // LDH (LCDC), A: LCD off
+        0x21, 0x00, 0x80, // LD HL, 0x8000
+        0x3E, 0x55,       // LD A, 0x55
+        0x06, 0x10,       // LD B, 16
+    });
+    // a background tile of stripes
+    uint16_t loop = rom.here();
+    rom.emit({
+        0x22, // LD (HL+), A
+        0x2F, // CPL
+        0x05, // DEC B
+    });
+    rom.jr(0x20, loop);
+    rom.emit({
+        0x3E, 0xFF, // LD A, 0xFF
+        0x06, 0x10, // LD B, 16
+    });
+    // and a solid sprite tile
+    loop = rom.here();
+    rom.emit({
+        0x22, // LD (HL+), A
+        0x05, // DEC B
+    });
+    rom.jr(0x20, loop);
+    rom.emit({
+        0x21, 0x00, 0x10, // LD HL, 0x1000
+        0x11, 0x00, 0xC0, // LD DE, 0xC000
+        0x06, 0xA0,       // LD B, 160
+    });
+    // copy the sprites to work RAM
+    loop = rom.here();
+    rom.emit({
+        0x2A, // LD A, (HL+)
+        0x12, // LD (DE), A
+        0x13, // INC DE
+        0x05, // DEC B
+    });
+    rom.jr(0x20, loop);
+    rom.emit({
+        0x3E, 0xE4, // LD A, 0xE4
+        0xE0, 0x47, // LDH (BGP), A
+        0xE0, 0x48, // LDH (OBP0), A
+        0xE0, 0x49, // LDH (OBP1), A
+        0x3E, 0x93, // LD A, 0x93
+        0xE0, 0x40, // LDH (LCDC), A: LCD, background and sprites on
+        0x3E, 0x01, // LD A, 1
+        0xE0, 0xFF, // LDH (IE), A: V-blank
+        0xAF,       // XOR A
+        0xE0, 0x0F, // LDH (IF), A
+        0xFB,       // EI
+    });
+    const uint16_t frame = rom.here();
+    rom.emit({
+        0x76,             // HALT
+        0x00,             // NOP
+        0x21, 0x01, 0xC0, // LD HL, 0xC001
+        0x06, 0x28,       // LD B, 40
+    });
+    // move every sprite one pixel to the right
+    loop = rom.here();
+    rom.emit({
+        0x34,                   // INC (HL)
+        0x2C, 0x2C, 0x2C, 0x2C, // INC L (x4)
+        0x05,                   // DEC B
+    });
+    rom.jr(0x20, loop);
+    rom.emit({
+        0x3E, 0xC0, // LD A, 0xC0
+        0xE0, 0x46, // LDH (DMA), A
+    });
+    rom.delay(40);
+    rom.jr(0x18, frame);
+    return rom.release();
+}
+
+std::vector<uint8_t> halt_rom()
+{
+    RomBuilder rom(2, 0x00, 0x00, false);
+    rom.emit({
+        0x3E, 0x04, // LD A, 0x04
+        0xE0, 0x07, // LDH (TAC), A: timer on, 4096 Hz
+        0xAF,       // XOR A
+        0xE0, 0x06, // LDH (TMA), A
+        0x3E, 0x05, // LD A, 0x05
+        0xE0, 0xFF, // LDH (IE), A: V-blank and timer
+        0xAF,       // XOR A
+        0xE0, 0x0F, // LDH (IF), A
+        0xFB,       // EI
+    });
+    const uint16_t loop = rom.here();
+    rom.emit({
+        0x76, // HALT
+        0x00, // NOP
+    });
+    rom.jr(0x18, loop);
+    return rom.release();
+}
+} // namespace
+
+std::vector<workload_t> synthetic_workloads()
+{
+    std::vector<workload_t> result;
+    result.push_back({"alu", alu_rom()});
+    result.push_back({"banking", banking_rom()});
+    result.push_back({"dma", dma_rom()});
+    result.push_back({"sprites", sprites_rom()});
+    result.push_back({"halt", halt_rom()});
+    return result;
+}
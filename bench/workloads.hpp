@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct workload_t
+{
+    std::string name;
+    std::vector<uint8_t> rom;
+};
+
+// ROMs generated in-tree, each stressing one part of the emulator:
+//   alu      a tight loop of ALU, rotate and CB instructions
+//   banking  MBC5 ROM and RAM bank switches, calling into every bank
+//   dma      OAM DMA, general purpose DMA and H-blank DMA back to back
+//   sprites  40 sprites moving every frame, with a background
+//   halt     HALT until the next V-blank or timer interrupt
+std::vector<workload_t> synthetic_workloads();
@@ -1,54 +1,518 @@
 #include "apu.hpp"
-#include "generators.hpp"
 #include "io.hpp"
 #include "machine.hpp"
+#include "sample_ring.hpp"
+#include <algorithm>
 
 namespace gbc
 {
-APU::APU(Machine& mach) : m_machine{mach} {}
+APU::APU(Machine& mach) : m_machine{mach}
+{
+    this->reset();
+    this->set_sample_rate(m_sample_rate);
+}
+
+void APU::reset()
+{
+    this->m_state = {};
+    // the boot ROM leaves channel 1 on, with its volume faded out
+    m_state.square1.enabled = true;
+    m_state.square1.dac = true;
+    m_state.square1.duty = 2;
+    m_state.square1.timer = m_state.square1.period();
+    m_state.square1.sweep_timer = 8;
+}
+
+void APU::on_audio_out(audio_stream_t callback) { this->m_audio_out = std::move(callback); }
+void APU::set_ring(std::shared_ptr<SampleRing> ring) { this->m_ring = std::move(ring); }
+void APU::set_sample_rate(const unsigned rate)
+{
+    if (rate == 0 || rate > CLOCK) throw MachineException("Invalid audio sample rate");
+    this->m_sample_rate = rate;
+    this->m_sample_cycles = CLOCK / rate;
+    m_blip.set_rates(CLOCK, rate, BLIP_FRAME);
+    this->m_blip_time = 0;
+    // the output starts over from silence
+    this->m_amplitude[0] = 0;
+    this->m_amplitude[1] = 0;
+    this->m_output_dirty = true;
+}
+
+void APU::flush()
+{
+    this->catch_up();
+    if (this->synthesizing()) this->end_blip_frame();
+    this->deliver();
+}
+void APU::deliver()
+{
+    if (m_samples.empty()) return;
+    if (m_ring) m_ring->write(m_samples.data(), m_samples.size());
+    if (m_audio_out) m_audio_out(m_samples.data(), m_samples.size());
+    m_samples.clear();
+}
+
+bool APU::powered() const noexcept { return m_machine.io.reg(IO::REG_NR52) & 0x80; }
+
+void APU::simulate(const uint64_t cycles)
+{
+    // if sound is off and nobody listens, don't do anything
+    if (!this->powered() && !this->synthesizing()) return;
+    // the APU keeps its pace in double speed mode, and nothing it does is
+    // seen before the next sound register access, so the work is deferred
+    m_state.pending += machine().memory.double_speed() ? cycles / 2 : cycles;
+    if (m_state.pending >= BLIP_FRAME) this->catch_up();
+}
+
+void APU::catch_up()
+{
+    uint64_t cycles = m_state.pending;
+    m_state.pending = 0;
+    const bool synth = this->synthesizing();
+    const bool on = this->powered();
+    // registers may have changed since last time
+    if (synth && m_output_dirty) this->update_output();
+
+    while (cycles > 0)
+    {
+        // up to the next frame sequencer step, which can change the outputs
+        uint64_t step = cycles;
+        if (on) step = std::min<uint64_t>(step, m_state.sequencer_timer);
+        if (synth)
+        {
+            step = std::min<uint64_t>(step, BLIP_FRAME - m_blip_time);
+            this->run_channels(step);
+            this->m_blip_time += step;
+        }
+        cycles -= step;
+
+        if (on)
+        {
+            m_state.sequencer_timer -= step;
+            if (m_state.sequencer_timer == 0)
+            {
+                m_state.sequencer_timer = SEQUENCER_CYCLES;
+                this->clock_sequencer();
+                if (synth) this->update_output();
+            }
+        }
+        if (synth && m_blip_time == BLIP_FRAME) this->end_blip_frame();
+    }
+    // about a frame worth of samples, when V-blank is far away
+    if (m_samples.size() >= m_sample_rate / 60) this->deliver();
+}
+
+void APU::reset_divider()
+{
+    this->catch_up();
+    // the frame sequencer is clocked by a falling edge of DIV (bit 12, or 13
+    // in double speed mode)
+    m_state.sequencer_timer = SEQUENCER_CYCLES;
+}
+
+// every channel runs through the whole span on its own, adding a delta to
+// the output each time its level changes
+void APU::run_channels(const uint32_t cycles)
+{
+    auto square_level = [](const square_t& ch) { return 2 * ch.output() - 15; };
+    this->run_channel(m_state.square1, 0, cycles, square_level);
+    this->run_channel(m_state.square2, 1, cycles, square_level);
+    const uint8_t* wave_ram = &machine().io.reg(IO::REG_WAV0);
+    this->run_channel(m_state.wave, 2, cycles,
+                      [wave_ram](const wave_t& ch) { return 2 * ch.output(wave_ram) - 15; });
+    this->run_channel(m_state.noise, 3, cycles,
+                      [](const noise_t& ch) { return 2 * ch.output() - 15; });
+}
+
+template <typename Channel, typename Level>
+void APU::run_channel(Channel& ch, const int index, const uint32_t cycles, Level level)
+{
+    if (!ch.enabled || !ch.dac || !ch.clocked()) return;
+    const uint32_t period = ch.period();
+    // steps faster than the output rate are taken together
+    const uint32_t batch =
+        (Channel::BATCHED && period < m_sample_cycles) ? m_sample_cycles / period : 1;
+    uint32_t time = m_blip_time;
+    uint32_t remaining = cycles;
+    while (true)
+    {
+        const uint32_t span = ch.timer + (batch - 1) * period;
+        if (span > remaining) break;
+        time += span;
+        remaining -= span;
+        ch.step(batch);
+        ch.timer = period;
+        this->set_level(index, level(ch), time, Channel::BATCHED);
+    }
+    // the last few batched steps happen before the end of the span
+    const uint32_t steps = ch.steps(remaining, period);
+    if (steps > 0)
+    {
+        ch.step(steps);
+        this->set_level(index, level(ch), m_blip_time + cycles, Channel::BATCHED);
+    }
+}
+
+// noise is not worth band-limiting, so it can use a cheaper step
+void APU::set_level(const int index, const int32_t level, const uint32_t time, const bool fast)
+{
+    const int32_t delta = level - m_level[index];
+    if (delta == 0) return;
+    this->m_level[index] = level;
+    const int32_t left = delta * m_volume[0][index];
+    const int32_t right = delta * m_volume[1][index];
+    if (left == 0 && right == 0) return;
+    if (fast)
+        m_blip.add_delta_fast(time, left, right);
+    else
+        m_blip.add_delta(time, left, right);
+    this->m_amplitude[0] += left;
+    this->m_amplitude[1] += right;
+}
 
-void APU::simulate()
+// after register writes and frame sequencer steps: all the levels and
+// volumes are recalculated, and the total change goes to the output
+void APU::update_output()
 {
-    // if sound is off, don't do anything
-    if ((machine().io.reg(IO::REG_NR52) & 0x80) == 0) return;
+    auto& io = machine().io;
+    this->m_output_dirty = false;
+    const channel_base_t* channels[4] = {&m_state.square1, &m_state.square2, &m_state.wave,
+                                         &m_state.noise};
+    const uint8_t outputs[4] = {m_state.square1.output(), m_state.square2.output(),
+                                m_state.wave.output(&io.reg(IO::REG_WAV0)),
+                                m_state.noise.output()};
+    const uint8_t panning = io.reg(IO::REG_NR51);
+    const uint8_t volume = io.reg(IO::REG_NR50);
+    // up to 4 channels * 15 * volume 8 = 480
+    const int32_t left = (((volume >> 4) & 0x7) + 1) * 64;
+    const int32_t right = ((volume & 0x7) + 1) * 64;
+    int32_t amplitude[2] = {0, 0};
+    for (int i = 0; i < 4; i++)
+    {
+        m_level[i] = (channels[i]->dac) ? 2 * outputs[i] - 15 : 0;
+        m_volume[0][i] = (panning & (0x10 << i)) ? left : 0;
+        m_volume[1][i] = (panning & (0x1 << i)) ? right : 0;
+        amplitude[0] += m_level[i] * m_volume[0][i];
+        amplitude[1] += m_level[i] * m_volume[1][i];
+    }
+    if (amplitude[0] == m_amplitude[0] && amplitude[1] == m_amplitude[1]) return;
+    m_blip.add_delta(m_blip_time, amplitude[0] - m_amplitude[0], amplitude[1] - m_amplitude[1]);
+    this->m_amplitude[0] = amplitude[0];
+    this->m_amplitude[1] = amplitude[1];
+}
 
-    // TODO: writeme
+void APU::end_blip_frame()
+{
+    m_blip.end_frame(m_blip_time);
+    this->m_blip_time = 0;
+    m_blip.read_samples(m_samples, m_blip.samples_avail());
+}
+
+void APU::clock_sequencer()
+{
+    const uint8_t step = m_state.sequencer_step;
+    m_state.sequencer_step = (step + 1) & 0x7;
+    // length counters at 256 Hz, sweep at 128 Hz and envelopes at 64 Hz
+    if ((step & 1) == 0)
+    {
+        m_state.square1.clock_length();
+        m_state.square2.clock_length();
+        m_state.wave.clock_length();
+        m_state.noise.clock_length();
+    }
+    if (step == 2 || step == 6) this->clock_sweep();
+    if (step == 7)
+    {
+        m_state.square1.envelope.clock();
+        m_state.square2.envelope.clock();
+        m_state.noise.envelope.clock();
+    }
+}
+
+uint16_t APU::sweep_frequency()
+{
+    auto& ch = m_state.square1;
+    const uint8_t nr10 = machine().io.reg(IO::REG_NR10);
+    const uint16_t delta = ch.shadow >> (nr10 & 0x7);
+    const uint16_t freq = (nr10 & 0x8) ? ch.shadow - delta : ch.shadow + delta;
+    // overflowing disables the channel
+    if (freq > 2047) ch.enabled = false;
+    return freq;
+}
+void APU::clock_sweep()
+{
+    auto& ch = m_state.square1;
+    if (--ch.sweep_timer != 0) return;
+    const uint8_t nr10 = machine().io.reg(IO::REG_NR10);
+    const uint8_t period = (nr10 >> 4) & 0x7;
+    ch.sweep_timer = (period != 0) ? period : 8;
+    if (!ch.sweep_enabled || period == 0) return;
+
+    const uint16_t freq = this->sweep_frequency();
+    if (freq <= 2047 && (nr10 & 0x7) != 0)
+    {
+        ch.frequency = ch.shadow = freq;
+        // the new frequency is checked for overflow once more
+        this->sweep_frequency();
+    }
+}
+
+void APU::trigger_square(square_t& ch, const uint8_t nrx2)
+{
+    ch.enabled = ch.dac;
+    if (ch.length == 0) ch.length = 64;
+    ch.timer = ch.period();
+    ch.envelope.trigger(nrx2);
 }
 
 uint8_t APU::read(const uint16_t addr, uint8_t& reg)
 {
-    switch (addr)
+    this->catch_up();
+    // bits that can not be read back are ones, from NR10 to the wave RAM
+    static constexpr std::array<uint8_t, 0x20> MASKS = {
+        0x80, 0x3F, 0x00, 0xFF, 0xBF, 0xFF, 0x3F, 0x00, // FF10
+        0xFF, 0xBF, 0x7F, 0xFF, 0x9F, 0xFF, 0xBF, 0xFF, // FF18
+        0xFF, 0x00, 0x00, 0xBF, 0x00, 0x00, 0x70, 0xFF, // FF20
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // FF28
+    };
+    if (addr == IO::REG_NR52)
     {
-    case IO::REG_NR52:
-        return reg;
+        return (reg & 0x80) | 0x70 | m_state.square1.enabled | (m_state.square2.enabled << 1) |
+               (m_state.wave.enabled << 2) | (m_state.noise.enabled << 3);
     }
-    printf("ERROR: Unhandled APU read at %04X (reg %02X)\n", addr, reg);
-    GBC_ASSERT(0 && "Unhandled APU read");
+    if (addr >= IO::REG_WAV0) return reg;
+    return reg | MASKS.at(addr - IO::REG_NR10);
 }
+
 void APU::write(const uint16_t addr, const uint8_t value, uint8_t& reg)
 {
+    auto& io = machine().io;
+    this->catch_up();
+    this->m_output_dirty = true;
+    if (addr == IO::REG_NR52)
+    {
+        const bool was_on = this->powered();
+        reg = value & 0x80;
+        if (was_on && !this->powered())
+        {
+            // powering off clears every register, but not the wave RAM
+            for (uint16_t r = IO::REG_NR10; r < IO::REG_NR52; r++) io.reg(r) = 0;
+            this->m_state = {};
+        }
+        else if (!was_on && this->powered())
+        {
+            m_state.sequencer_step = 0;
+        }
+        return;
+    }
+    // the wave RAM can always be written
+    if (addr >= IO::REG_WAV0)
+    {
+        reg = value;
+        return;
+    }
+    // the rest is read-only while the APU is off
+    if (!this->powered()) return;
+    reg = value;
+
+    auto& sq = (addr < IO::REG_NR21) ? m_state.square1 : m_state.square2;
+    auto& wave = m_state.wave;
+    auto& noise = m_state.noise;
     switch (addr)
     {
-    case IO::REG_NR52:
-        // TODO: writing bit7 should clear all sound registers
-        // printf("NR52 Sound ON/OFF 0x%04x write 0x%02x\n", addr, value);
-        reg &= 0xF;
-        reg |= value & 0x80;
-        // GBC_ASSERT(0 && "NR52 Sound ON/OFF register write");
+    case IO::REG_NR11:
+    case IO::REG_NR21:
+        sq.duty = value >> 6;
+        sq.length = 64 - (value & 0x3F);
+        return;
+    case IO::REG_NR12:
+    case IO::REG_NR22:
+        // the DAC is off when the upper 5 bits are zero
+        sq.dac = (value & 0xF8) != 0;
+        if (!sq.dac) sq.enabled = false;
+        return;
+    case IO::REG_NR13:
+    case IO::REG_NR23:
+        sq.frequency = (sq.frequency & 0x700) | value;
+        return;
+    case IO::REG_NR14:
+    case IO::REG_NR24:
+        sq.frequency = (sq.frequency & 0xFF) | ((value & 0x7) << 8);
+        sq.length_enabled = value & 0x40;
+        if (value & 0x80)
+        {
+            this->trigger_square(sq, io.reg(addr - 2));
+            if (&sq == &m_state.square1)
+            {
+                const uint8_t nr10 = io.reg(IO::REG_NR10);
+                const uint8_t period = (nr10 >> 4) & 0x7;
+                sq.shadow = sq.frequency;
+                sq.sweep_timer = (period != 0) ? period : 8;
+                sq.sweep_enabled = period != 0 || (nr10 & 0x7) != 0;
+                if (nr10 & 0x7) this->sweep_frequency();
+            }
+        }
+        return;
+    case IO::REG_NR30:
+        wave.dac = value & 0x80;
+        if (!wave.dac) wave.enabled = false;
+        return;
+    case IO::REG_NR31:
+        wave.length = 256 - value;
+        return;
+    case IO::REG_NR32:
+        wave.volume_code = (value >> 5) & 0x3;
+        return;
+    case IO::REG_NR33:
+        wave.frequency = (wave.frequency & 0x700) | value;
+        return;
+    case IO::REG_NR34:
+        wave.frequency = (wave.frequency & 0xFF) | ((value & 0x7) << 8);
+        wave.length_enabled = value & 0x40;
+        if (value & 0x80)
+        {
+            wave.enabled = wave.dac;
+            if (wave.length == 0) wave.length = 256;
+            wave.timer = wave.period();
+            wave.position = 0;
+        }
+        return;
+    case IO::REG_NR41:
+        noise.length = 64 - (value & 0x3F);
+        return;
+    case IO::REG_NR42:
+        noise.dac = (value & 0xF8) != 0;
+        if (!noise.dac) noise.enabled = false;
+        return;
+    case IO::REG_NR43:
+        noise.shift = value >> 4;
+        noise.narrow = value & 0x8;
+        noise.divisor = value & 0x7;
+        return;
+    case IO::REG_NR44:
+        noise.length_enabled = value & 0x40;
+        if (value & 0x80)
+        {
+            noise.enabled = noise.dac;
+            if (noise.length == 0) noise.length = 64;
+            noise.timer = noise.period();
+            noise.envelope.trigger(io.reg(IO::REG_NR42));
+            noise.lfsr = 0x7FFF;
+        }
         return;
     }
-    printf("ERROR: Unhandled APU write at %04X val=%02X (reg %02X)\n", addr, value, reg);
-    GBC_ASSERT(0 && "Unhandled APU write");
 }
 
 // serialization
-int APU::restore_state(const std::vector<uint8_t>& data, int off)
+static void get_channel(StateReader& in, channel_base_t& ch)
+{
+    in.get(ch.enabled);
+    in.get(ch.dac);
+    in.get(ch.length_enabled);
+    in.get(ch.length);
+    in.get(ch.frequency);
+    in.get(ch.timer);
+}
+static void put_channel(StateWriter& out, const channel_base_t& ch)
 {
-    this->m_state = *(state_t*) &data.at(off);
-    return sizeof(m_state);
+    out.put(ch.enabled);
+    out.put(ch.dac);
+    out.put(ch.length_enabled);
+    out.put(ch.length);
+    out.put(ch.frequency);
+    out.put(ch.timer);
 }
-void APU::serialize_state(std::vector<uint8_t>& res) const
+static void get_envelope(StateReader& in, envelope_t& env)
 {
-    res.insert(res.end(), (uint8_t*) &m_state, (uint8_t*) &m_state + sizeof(m_state));
+    in.get(env.volume);
+    in.get(env.period);
+    in.get(env.timer);
+    in.get(env.increase);
+}
+static void put_envelope(StateWriter& out, const envelope_t& env)
+{
+    out.put(env.volume);
+    out.put(env.period);
+    out.put(env.timer);
+    out.put(env.increase);
+}
+
+bool APU::load_state(const StateView& view, state_t& state) const
+{
+    if (!view.has(make_tag("APU "))) return false;
+    auto in = view.chunk(make_tag("APU "));
+    for (square_t* sq : {&state.square1, &state.square2})
+    {
+        get_channel(in, *sq);
+        get_envelope(in, sq->envelope);
+        in.get(sq->duty);
+        in.get(sq->position);
+        in.get(sq->shadow);
+        in.get(sq->sweep_timer);
+        in.get(sq->sweep_enabled);
+        if (sq->frequency >= 2048 || sq->duty >= 4 || sq->position >= 8)
+            throw MachineException("Save state square channel is out of range");
+    }
+    get_channel(in, state.wave);
+    in.get(state.wave.position);
+    in.get(state.wave.volume_code);
+    if (state.wave.frequency >= 2048 || state.wave.position >= 32 || state.wave.volume_code >= 4)
+        throw MachineException("Save state wave channel is out of range");
+    get_channel(in, state.noise);
+    get_envelope(in, state.noise.envelope);
+    in.get(state.noise.lfsr);
+    in.get(state.noise.shift);
+    in.get(state.noise.divisor);
+    in.get(state.noise.narrow);
+    if (state.noise.shift >= 16 || state.noise.divisor >= 8)
+        throw MachineException("Save state noise channel is out of range");
+    in.get(state.sequencer_timer);
+    in.get(state.sequencer_step);
+    in.get(state.pending);
+    return true;
+}
+void APU::validate_state(const StateView& view) const
+{
+    state_t state;
+    this->load_state(view, state);
+}
+void APU::restore_state(const StateView& view)
+{
+    state_t state = m_state;
+    const bool has_sound = this->load_state(view, state);
+    this->m_output_dirty = true;
+    if (!has_sound)
+    {
+        this->reset();
+        return;
+    }
+    this->m_state = state;
+}
+void APU::serialize_state(StateWriter& out) const
+{
+    out.begin(make_tag("APU "), 1);
+    for (const square_t* sq : {&m_state.square1, &m_state.square2})
+    {
+        put_channel(out, *sq);
+        put_envelope(out, sq->envelope);
+        out.put(sq->duty);
+        out.put(sq->position);
+        out.put(sq->shadow);
+        out.put(sq->sweep_timer);
+        out.put(sq->sweep_enabled);
+    }
+    put_channel(out, m_state.wave);
+    out.put(m_state.wave.position);
+    out.put(m_state.wave.volume_code);
+    put_channel(out, m_state.noise);
+    put_envelope(out, m_state.noise.envelope);
+    out.put(m_state.noise.lfsr);
+    out.put(m_state.noise.shift);
+    out.put(m_state.noise.divisor);
+    out.put(m_state.noise.narrow);
+    out.put(m_state.sequencer_timer);
+    out.put(m_state.sequencer_step);
+    out.put(m_state.pending);
+    out.end();
 }
 } // namespace gbc
@@ -1,46 +1,104 @@
 #pragma once
+#include "blip.hpp"
 #include "common.hpp"
+#include "generators.hpp"
 #include <array>
 #include <cstdint>
 #include <functional>
+#include <memory>
+#include <vector>
 
 namespace gbc
 {
+class SampleRing;
+
+// Two square channels, a wave channel and a noise channel. The APU is simulated
+// in bulk whenever the hardware syncs (on sound register accesses, and on other
+// events such as V-blank), and only synthesizes samples when there is somewhere
+// to deliver them. Without an output, only what the CPU can see is simulated.
+// Samples are made by band-limited step synthesis at the output rate, from
+// every change in the channel outputs at its exact APU cycle.
 class APU
 {
 public:
     APU(Machine& mach);
-    using audio_stream_t = std::function<void(uint16_t, uint16_t)>;
-
+    void reset();
+    // batches of stereo samples, called from inside the simulation,
+    // so the callback must not access the machine
+    using audio_stream_t = std::function<void(const sample_t*, size_t count)>;
     void on_audio_out(audio_stream_t);
-    void simulate();
+    // samples also go into the ring, which another thread can drain
+    void set_ring(std::shared_ptr<SampleRing>);
+    void set_sample_rate(unsigned rate);
+    unsigned sample_rate() const noexcept { return m_sample_rate; }
+    // deliver the samples synthesized so far (done at every V-blank)
+    void flush();
+    // simulate the deferred cycles now, without delivering samples
+    void catch_up();
+
+    void simulate(uint64_t cycles);
+    // DIV was written, which restarts the frame sequencer period
+    void reset_divider();
 
     uint8_t read(uint16_t, uint8_t& reg);
     void write(uint16_t, uint8_t, uint8_t& reg);
 
     // serialization
-    int restore_state(const std::vector<uint8_t>&, int);
-    void serialize_state(std::vector<uint8_t>&) const;
+    // throws what restore_state() would, without changing anything
+    void validate_state(const StateView&) const;
+    void restore_state(const StateView&);
+    void serialize_state(StateWriter&) const;
 
     Machine& machine() noexcept { return m_machine; }
 
 private:
-    struct generator_t
-    {
-    };
-    struct channel_t
-    {
-        bool generators_enabled[4] = {false};
-        bool enabled = true;
-    };
+    static constexpr uint32_t CLOCK = 4194304;
+    // the frame sequencer steps at 512 Hz
+    static constexpr uint32_t SEQUENCER_CYCLES = CLOCK / 512;
+    // the longest stretch of audio kept before it is resampled
+    static constexpr uint32_t BLIP_FRAME = CLOCK / 64;
+    bool powered() const noexcept;
+    bool synthesizing() const noexcept { return m_audio_out != nullptr || m_ring != nullptr; }
+    void clock_sequencer();
+    void clock_sweep();
+    uint16_t sweep_frequency();
+    void trigger_square(square_t&, uint8_t nrx2);
+    void deliver();
+    void run_channels(uint32_t cycles);
+    template <typename Channel, typename Level>
+    void run_channel(Channel&, int index, uint32_t cycles, Level);
+    void set_level(int index, int32_t level, uint32_t time, bool fast);
+    void update_output();
+    void end_blip_frame();
 
     struct state_t
     {
-        bool nothing = false;
-
+        square_t square1;
+        square_t square2;
+        wave_t wave;
+        noise_t noise;
+        uint32_t sequencer_timer = SEQUENCER_CYCLES;
+        uint8_t sequencer_step = 0;
+        // APU cycles that have not been simulated yet
+        uint64_t pending = 0;
     } m_state;
+    // throws on out-of-range values, and returns false for states
+    // from before there was sound, which have no APU chunk
+    bool load_state(const StateView&, state_t&) const;
 
     Machine& m_machine;
     audio_stream_t m_audio_out;
+    std::shared_ptr<SampleRing> m_ring;
+    unsigned m_sample_rate = 48000;
+    // amplitude changes go into the band-limited buffers at their APU time
+    BlipBuffer m_blip;
+    uint32_t m_blip_time = 0;
+    uint32_t m_sample_cycles = 0;
+    // the DAC output of each channel, and its volume on each side
+    int32_t m_level[4] = {};
+    int32_t m_volume[2][4] = {};
+    int32_t m_amplitude[2] = {};
+    bool m_output_dirty = true;
+    std::vector<sample_t> m_samples;
 };
 } // namespace gbc
@@ -0,0 +1,203 @@
+#include "archive.hpp"
+#include "lz.hpp"
+#include "machine.hpp"
+
+namespace gbc
+{
+// frames that can wait for compression before recording blocks
+static constexpr size_t MAX_PENDING = 64;
+
+template <typename T> static void append_le(std::vector<uint8_t>& dst, T value)
+{
+    for (size_t i = 0; i < sizeof(T); i++) dst.push_back(uint8_t(value >> (8 * i)));
+}
+template <typename T> static T load_le(const uint8_t* src)
+{
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) value |= T(src[i]) << (8 * i);
+    return value;
+}
+
+ArchiveWriter::ArchiveWriter(FILE* file, uint16_t keyframe_interval)
+    : m_file(file), m_interval(keyframe_interval > 0 ? keyframe_interval : 1)
+{
+    std::vector<uint8_t> header;
+    append_le<uint32_t>(header, archive_t::MAGIC);
+    append_le<uint16_t>(header, archive_t::VERSION);
+    append_le<uint16_t>(header, m_interval);
+    if (fwrite(header.data(), header.size(), 1, m_file) != 1)
+        throw MachineException("Could not write snapshot archive header");
+    m_offset = header.size();
+    m_thread = std::thread(&ArchiveWriter::worker, this);
+}
+ArchiveWriter::~ArchiveWriter()
+{
+    try
+    {
+        this->finish();
+    }
+    catch (const MachineException&)
+    {
+        // call finish() to find out
+    }
+}
+
+void ArchiveWriter::record(Machine& machine)
+{
+    pending_t frame;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_error != nullptr) throw MachineException(m_error);
+        if (!m_free.empty())
+        {
+            frame.state = std::move(m_free.back());
+            m_free.pop_back();
+        }
+    }
+    frame.state.clear();
+    if (m_frames % m_interval == 0)
+    {
+        frame.kind = archive_t::KEYFRAME;
+        machine.serialize_state(frame.state);
+        machine.set_delta_base();
+    }
+    else
+    {
+        frame.kind = archive_t::DELTA;
+        machine.serialize_delta(frame.state);
+    }
+    m_frames++;
+
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cv.wait(lock, [this] { return m_queue.size() < MAX_PENDING; });
+    m_queue.push_back(std::move(frame));
+    lock.unlock();
+    m_cv.notify_all();
+}
+
+void ArchiveWriter::worker()
+{
+    std::vector<uint8_t> scratch;
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [this] { return !m_queue.empty() || m_done; });
+        if (m_queue.empty()) return;
+        pending_t frame = std::move(m_queue.front());
+        m_queue.pop_front();
+        lock.unlock();
+        // a slot in the queue opened up
+        m_cv.notify_all();
+
+        this->write_frame(frame, scratch);
+
+        lock.lock();
+        m_free.push_back(std::move(frame.state));
+    }
+}
+
+void ArchiveWriter::write_frame(const pending_t& frame, std::vector<uint8_t>& scratch)
+{
+    // every frame after a failed one would be at the wrong offset
+    // NOTE: only the worker sets the error, so it can read it unlocked
+    if (m_error != nullptr) return;
+    scratch.clear();
+    append_le<uint32_t>(scratch, 0);
+    append_le<uint32_t>(scratch, frame.state.size());
+    append_le<uint8_t>(scratch, frame.kind);
+    const uint32_t clen = lz_compress(frame.state.data(), frame.state.size(), scratch);
+    for (size_t i = 0; i < 4; i++) scratch[i] = uint8_t(clen >> (8 * i));
+    const bool written = fwrite(scratch.data(), scratch.size(), 1, m_file) == 1;
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (!written)
+    {
+        this->m_error = "Could not write snapshot archive frame";
+        return;
+    }
+    m_offsets.push_back(m_offset);
+    m_offset += scratch.size();
+}
+
+size_t ArchiveWriter::bytes_written() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_offset;
+}
+
+void ArchiveWriter::finish()
+{
+    if (m_finished) return;
+    m_finished = true;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_done = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    if (m_error != nullptr) throw MachineException(m_error);
+    // the index is written last, so that frames never have to be moved
+    std::vector<uint8_t> index;
+    for (const uint64_t offset : m_offsets) append_le<uint64_t>(index, offset);
+    append_le<uint64_t>(index, m_offset);
+    append_le<uint32_t>(index, m_offsets.size());
+    append_le<uint32_t>(index, archive_t::INDEX_MAGIC);
+    if (fwrite(index.data(), index.size(), 1, m_file) != 1 || fflush(m_file) != 0)
+        throw MachineException("Could not write snapshot archive index");
+}
+
+ArchiveReader::ArchiveReader(const uint8_t* data, size_t len) : m_data(data), m_len(len)
+{
+    if (len < archive_t::HEADER_SIZE + archive_t::FOOTER_SIZE ||
+        load_le<uint32_t>(&data[0]) != archive_t::MAGIC)
+        throw MachineException("Not a snapshot archive");
+    if (load_le<uint16_t>(&data[4]) > archive_t::VERSION)
+        throw MachineException("Snapshot archive is from a newer version");
+    m_interval = load_le<uint16_t>(&data[6]);
+
+    const uint8_t* footer = &data[len - archive_t::FOOTER_SIZE];
+    if (load_le<uint32_t>(&footer[12]) != archive_t::INDEX_MAGIC)
+        throw MachineException("Snapshot archive has no index");
+    const uint64_t index = load_le<uint64_t>(&footer[0]);
+    m_count = load_le<uint32_t>(&footer[8]);
+    if (index < archive_t::HEADER_SIZE || index > len - archive_t::FOOTER_SIZE ||
+        len - archive_t::FOOTER_SIZE - index != m_count * 8 || m_interval == 0)
+        throw MachineException("Snapshot archive index is damaged");
+    m_index = &data[index];
+}
+
+archive_t::kind_t ArchiveReader::state(size_t frame, std::vector<uint8_t>& result) const
+{
+    if (frame >= m_count) throw MachineException("Snapshot archive frame is out of range");
+    const uint64_t offset = load_le<uint64_t>(&m_index[frame * 8]);
+    const size_t frames_end = m_index - m_data;
+    if (offset > frames_end || frames_end - offset < archive_t::FRAME_HEADER_SIZE)
+        throw MachineException("Snapshot archive frame is out of bounds");
+    const uint8_t* hdr = &m_data[offset];
+    const uint32_t clen = load_le<uint32_t>(&hdr[0]);
+    if (frames_end - offset - archive_t::FRAME_HEADER_SIZE < clen)
+        throw MachineException("Snapshot archive frame is out of bounds");
+    result.resize(load_le<uint32_t>(&hdr[4]));
+    lz_decompress(&hdr[archive_t::FRAME_HEADER_SIZE], clen, result.data(), result.size());
+    return archive_t::kind_t(hdr[8]);
+}
+
+void ArchiveReader::restore(Machine& machine, size_t frame)
+{
+    const size_t key = frame - frame % m_interval;
+    if (m_cached_key != key)
+    {
+        // invalid until the keyframe has been decompressed
+        m_cached_key = SIZE_MAX;
+        if (this->state(key, m_key) != archive_t::KEYFRAME)
+            throw MachineException("Snapshot archive keyframe is missing");
+        m_cached_key = key;
+    }
+    machine.restore_state(m_key);
+    if (frame != key)
+    {
+        this->state(frame, m_delta);
+        machine.restore_delta(m_delta);
+    }
+}
+} // namespace gbc
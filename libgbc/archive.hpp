@@ -0,0 +1,114 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gbc
+{
+class Machine;
+
+// A snapshot archive is a stream of compressed machine states followed by an index:
+//   header: magic, version, keyframe interval
+//   frames: length, raw length, kind, compressed state
+//   index:  file offset of every frame, then the frame count, index offset and magic
+// Every keyframe_interval frames there is a full state (a keyframe), and the frames
+// in between are deltas against that keyframe. Restoring any frame is one keyframe
+// and at most one delta, no matter how long the recording is.
+struct archive_t
+{
+    static constexpr uint32_t MAGIC = 0x41434247; // GBCA
+    static constexpr uint32_t INDEX_MAGIC = 0x49434247; // GBCI
+    static constexpr uint16_t VERSION = 1;
+    static constexpr size_t HEADER_SIZE = 8;
+    static constexpr size_t FRAME_HEADER_SIZE = 9;
+    static constexpr size_t FOOTER_SIZE = 16;
+    enum kind_t : uint8_t
+    {
+        KEYFRAME = 0,
+        DELTA = 1
+    };
+};
+
+class ArchiveWriter
+{
+public:
+    // the file must be opened for writing, and is not closed
+    // throws a MachineException when the header can not be written
+    ArchiveWriter(FILE* file, uint16_t keyframe_interval = 60);
+    // finishes the archive if that has not been done, ignoring errors
+    ~ArchiveWriter();
+
+    // serializes the machine now, and compresses it in the background
+    // throws a MachineException when an earlier frame could not be written
+    // NOTE: every keyframe calls set_delta_base() on the machine, so while it
+    // is being recorded, serialize_delta() is against the last keyframe and
+    // not against any base the caller set
+    void record(Machine&);
+    // waits for all frames to be written, then writes the index
+    // throws a MachineException when anything could not be written, and then
+    // there is no index, so that the archive can not be opened
+    void finish();
+
+    size_t frames() const noexcept { return m_frames; }
+    // bytes written so far, excluding frames that are still being compressed
+    size_t bytes_written() const;
+
+private:
+    struct pending_t
+    {
+        archive_t::kind_t kind;
+        std::vector<uint8_t> state;
+    };
+    void worker();
+    void write_frame(const pending_t&, std::vector<uint8_t>& scratch);
+
+    FILE* m_file;
+    const uint16_t m_interval;
+    size_t m_frames = 0;
+    bool m_finished = false;
+    // owned by the worker until it has exited
+    std::vector<uint64_t> m_offsets;
+    uint64_t m_offset = 0;
+
+    mutable std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::deque<pending_t> m_queue;
+    // buffers are reused to avoid reallocating every frame
+    std::vector<std::vector<uint8_t>> m_free;
+    bool m_done = false;
+    // the first write that failed, after which nothing more is written
+    const char* m_error = nullptr;
+    std::thread m_thread;
+};
+
+// random access into a finished archive, eg. a mmap'd file
+// NOTE: the memory must outlive the reader
+class ArchiveReader
+{
+public:
+    // throws a MachineException when there is no valid index
+    ArchiveReader(const uint8_t* data, size_t len);
+
+    size_t frames() const noexcept { return m_count; }
+    uint16_t keyframe_interval() const noexcept { return m_interval; }
+    // restores the machine to a recorded frame, making it the delta base
+    void restore(Machine&, size_t frame);
+    // decompresses the state of a frame, which is a delta unless it is a keyframe
+    archive_t::kind_t state(size_t frame, std::vector<uint8_t>& result) const;
+
+private:
+    const uint8_t* m_data;
+    size_t m_len;
+    uint16_t m_interval;
+    size_t m_count;
+    const uint8_t* m_index;
+    // the last keyframe, as it is needed for every frame after it
+    size_t m_cached_key = SIZE_MAX;
+    std::vector<uint8_t> m_key;
+    std::vector<uint8_t> m_delta;
+};
+} // namespace gbc
@@ -0,0 +1,79 @@
+#include "audio_chunk.hpp"
+#include <algorithm>
+#include <array>
+
+namespace gbc
+{
+static constexpr std::array<int16_t, 89> STEPS = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,
+    25,    28,    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,
+    88,    97,    107,   118,   130,   143,   157,   173,   190,   209,   230,   253,   279,
+    307,   337,   371,   408,   449,   494,   544,   598,   658,   724,   796,   876,   963,
+    1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,  3327,
+    3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+static constexpr int8_t INDEX_ADJUST[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+static void put16(std::vector<uint8_t>& dst, uint16_t value)
+{
+    dst.push_back(value & 0xFF);
+    dst.push_back(value >> 8);
+}
+
+void AudioEncoder::reset()
+{
+    for (auto& channel : m_channel) channel = {};
+}
+
+inline uint8_t AudioEncoder::channel_t::encode(const int16_t sample)
+{
+    const int32_t step = STEPS[index];
+    int32_t diff = sample - predictor;
+    const uint8_t sign = (diff < 0) ? 8 : 0;
+    diff = std::abs(diff);
+    // the difference in quarter steps, adding up the same fractions of the
+    // step as the decoder (written to compile without branches)
+    int32_t delta = step >> 3;
+    const bool b2 = diff >= step;
+    diff -= b2 ? step : 0;
+    delta += b2 ? step : 0;
+    const bool b1 = diff >= (step >> 1);
+    diff -= b1 ? (step >> 1) : 0;
+    delta += b1 ? (step >> 1) : 0;
+    const bool b0 = diff >= (step >> 2);
+    delta += b0 ? (step >> 2) : 0;
+    const uint8_t code = (b2 << 2) | (b1 << 1) | b0;
+    this->predictor = std::clamp(predictor + (sign ? -delta : delta), -32768, 32767);
+    this->index = std::clamp(index + INDEX_ADJUST[code], 0, int32_t(STEPS.size() - 1));
+    return code | sign;
+}
+
+size_t AudioEncoder::encode(const sample_t* samples, size_t count, std::vector<uint8_t>& dst)
+{
+    count = std::min(count, MAX_SAMPLES);
+    const size_t begin = dst.size();
+    dst.reserve(begin + chunk_size(count));
+    dst.push_back('G');
+    dst.push_back('A');
+    dst.push_back(1);
+    dst.push_back(2);
+    put16(dst, m_sample_rate);
+    put16(dst, count);
+    // the decoder starts from the state the encoder is in now
+    for (const auto& channel : m_channel)
+    {
+        put16(dst, channel.predictor);
+        dst.push_back(channel.index);
+        dst.push_back(0);
+    }
+    dst.resize(begin + chunk_size(count));
+    uint8_t* out = &dst[begin + HEADER_SIZE];
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t left = m_channel[0].encode(samples[i].left);
+        const uint8_t right = m_channel[1].encode(samples[i].right);
+        out[i] = left | (right << 4);
+    }
+    return dst.size() - begin;
+}
+} // namespace gbc
@@ -0,0 +1,38 @@
+#pragma once
+#include "generators.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gbc
+{
+// compact audio chunks for streaming, using 4-bit IMA ADPCM (a quarter of
+// 16-bit PCM) which is cheap to encode, and simple to decode in a browser
+// every chunk is self-contained, little-endian:
+//   "GA", version, channels (2), sample rate (u16), sample count (u16),
+//   then for each side the predictor (i16), step index (u8) and a padding byte,
+//   then one byte per stereo sample: left in the low nibble, right in the high
+class AudioEncoder
+{
+public:
+    static constexpr size_t HEADER_SIZE = 16;
+    static constexpr size_t MAX_SAMPLES = 0xFFFF;
+
+    AudioEncoder(unsigned sample_rate) : m_sample_rate{sample_rate} {}
+    void reset();
+
+    // appends a chunk, returns its size
+    size_t encode(const sample_t* samples, size_t count, std::vector<uint8_t>& dst);
+    static size_t chunk_size(size_t count) noexcept { return HEADER_SIZE + count; }
+
+private:
+    struct channel_t
+    {
+        int32_t predictor = 0;
+        int32_t index = 0;
+        uint8_t encode(int16_t sample);
+    };
+    unsigned m_sample_rate;
+    channel_t m_channel[2];
+};
+} // namespace gbc
@@ -0,0 +1,142 @@
+#include "blip.hpp"
+#include "common.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+namespace gbc
+{
+static constexpr int PHASES = 1 << BlipBuffer::PHASE_BITS;
+static constexpr int WIDTH = 2 * BlipBuffer::HALF_WIDTH;
+// the high-pass filter cuts off around 15 Hz at 48 kHz
+static constexpr int BASS_SHIFT = 9;
+using kernel_t = std::array<std::array<int32_t, WIDTH>, PHASES>;
+
+// the difference between consecutive output samples of a band-limited step,
+// for each fractional position of the step between two samples
+static const kernel_t& kernel()
+{
+    static const kernel_t table = [] {
+        constexpr int H = BlipBuffer::HALF_WIDTH;
+        // a windowed sinc impulse cut off a bit below the output Nyquist rate
+        constexpr double CUTOFF = 0.45;
+        auto impulse = [](const double t) {
+            if (std::abs(t) >= H) return 0.0;
+            const double x = 2.0 * CUTOFF * t;
+            const double sinc = (x == 0.0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+            const double window =
+                0.42 + 0.5 * std::cos(M_PI * t / H) + 0.08 * std::cos(2.0 * M_PI * t / H);
+            return 2.0 * CUTOFF * sinc * window;
+        };
+        // integrate it into a step, from -H to H in steps of 1/(PHASES*RES)
+        constexpr int RES = 16;
+        constexpr int STEPS = WIDTH * PHASES * RES;
+        constexpr double dt = 1.0 / (PHASES * RES);
+        std::vector<double> step(STEPS + 1);
+        for (int i = 1; i <= STEPS; i++)
+        {
+            const double t = -H + i * dt;
+            step[i] = step[i - 1] + 0.5 * (impulse(t - dt) + impulse(t)) * dt;
+        }
+
+        kernel_t result;
+        for (int phase = 0; phase < PHASES; phase++)
+        {
+            // the step is centered after the first H-1 taps, plus its phase
+            int32_t previous = 0;
+            for (int k = 0; k < WIDTH; k++)
+            {
+                const int index = (k + 1) * PHASES * RES - phase * RES;
+                const double value = step[std::min(index, STEPS)] / step[STEPS];
+                // the last tap completes the step exactly
+                constexpr int32_t UNIT = 1 << BlipBuffer::KERNEL_BITS;
+                const int32_t level = (k == WIDTH - 1) ? UNIT : std::lround(value * UNIT);
+                result[phase][k] = level - previous;
+                previous = level;
+            }
+        }
+        return result;
+    }();
+    return table;
+}
+
+void BlipBuffer::set_rates(uint32_t clock_rate, uint32_t sample_rate, uint32_t max_clocks)
+{
+    // rounded up, so that there are never fewer samples than expected
+    this->m_factor = ((uint64_t(sample_rate) << 32) + clock_rate - 1) / clock_rate;
+    const size_t frame_samples = ((max_clocks * m_factor) >> 32) + 1;
+    this->m_buffer.assign(2 * (frame_samples + WIDTH + 1), 0);
+    this->clear();
+}
+void BlipBuffer::clear()
+{
+    this->m_offset = 0;
+    this->m_avail = 0;
+    this->m_integrator[0] = 0;
+    this->m_integrator[1] = 0;
+    std::fill(m_buffer.begin(), m_buffer.end(), 0);
+}
+
+void BlipBuffer::add_delta(const uint32_t time, const int32_t left, const int32_t right)
+{
+    const uint64_t position = m_offset + time * m_factor;
+    const size_t index = m_avail + (position >> 32);
+    if (UNLIKELY(2 * (index + WIDTH) > m_buffer.size()))
+        throw MachineException("Audio frame is too long for the sample buffer");
+    const auto& taps = kernel()[(position >> (32 - PHASE_BITS)) & (PHASES - 1)];
+    int32_t* out = &m_buffer[2 * index];
+    for (int k = 0; k < WIDTH; k++)
+    {
+        out[2 * k] += taps[k] * left;
+        out[2 * k + 1] += taps[k] * right;
+    }
+}
+
+void BlipBuffer::add_delta_fast(const uint32_t time, const int32_t left, const int32_t right)
+{
+    const uint64_t position = m_offset + time * m_factor;
+    const size_t index = m_avail + (position >> 32);
+    if (UNLIKELY(2 * (index + WIDTH) > m_buffer.size()))
+        throw MachineException("Audio frame is too long for the sample buffer");
+    // at the center of where the band-limited step would be
+    const int32_t fraction = (position >> (32 - KERNEL_BITS)) & ((1 << KERNEL_BITS) - 1);
+    int32_t* out = &m_buffer[2 * (index + HALF_WIDTH - 1)];
+    out[0] += ((1 << KERNEL_BITS) - fraction) * left;
+    out[1] += ((1 << KERNEL_BITS) - fraction) * right;
+    out[2] += fraction * left;
+    out[3] += fraction * right;
+}
+
+void BlipBuffer::end_frame(const uint32_t time)
+{
+    this->m_offset += time * m_factor;
+    this->m_avail += m_offset >> 32;
+    this->m_offset &= 0xFFFFFFFF;
+}
+
+size_t BlipBuffer::read_samples(std::vector<sample_t>& out, size_t count)
+{
+    count = std::min(count, m_avail);
+    const size_t base = out.size();
+    out.resize(base + count);
+    int32_t left = m_integrator[0];
+    int32_t right = m_integrator[1];
+    for (size_t i = 0; i < count; i++)
+    {
+        left += m_buffer[2 * i];
+        right += m_buffer[2 * i + 1];
+        const int32_t l = std::clamp(left >> KERNEL_BITS, -32768, 32767);
+        const int32_t r = std::clamp(right >> KERNEL_BITS, -32768, 32767);
+        out[base + i] = {int16_t(l), int16_t(r)};
+        left -= l << (KERNEL_BITS - BASS_SHIFT);
+        right -= r << (KERNEL_BITS - BASS_SHIFT);
+    }
+    this->m_integrator[0] = left;
+    this->m_integrator[1] = right;
+    // move the tails of the last steps to the front
+    std::move(m_buffer.begin() + 2 * count, m_buffer.end(), m_buffer.begin());
+    std::fill(m_buffer.end() - 2 * count, m_buffer.end(), 0);
+    this->m_avail -= count;
+    return count;
+}
+} // namespace gbc
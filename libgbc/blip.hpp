@@ -0,0 +1,47 @@
+#pragma once
+#include "generators.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gbc
+{
+// Band-limited step synthesis: every change in amplitude, at its exact clock
+// time, is added to the buffer as a pre-computed band-limited step. Output
+// samples are then just the running sum of the buffer, so the source can run
+// at any rate and there is no per-sample filtering or resampling.
+// The output also goes through a high-pass filter, removing DC offsets.
+// Both sides are kept interleaved, so that a change on both costs one step.
+class BlipBuffer
+{
+public:
+    // frames can be at most max_clocks long
+    void set_rates(uint32_t clock_rate, uint32_t sample_rate, uint32_t max_clocks);
+    void clear();
+
+    // amplitude change at a clock time relative to the start of the frame
+    void add_delta(uint32_t time, int32_t left, int32_t right);
+    // a linearly interpolated step, much cheaper but not band-limited
+    void add_delta_fast(uint32_t time, int32_t left, int32_t right);
+    // the frame ends at a clock time, and its samples become available
+    void end_frame(uint32_t time);
+
+    size_t samples_avail() const noexcept { return m_avail; }
+    // appends up to count samples, returns how many
+    size_t read_samples(std::vector<sample_t>& out, size_t count);
+
+    // kernel taps on each side of a step, which is also the output latency
+    static constexpr int HALF_WIDTH = 8;
+    static constexpr int PHASE_BITS = 6;
+    static constexpr int KERNEL_BITS = 14;
+
+private:
+    // output samples per clock, and the position of the frame, in 32.32
+    uint64_t m_factor = 0;
+    uint64_t m_offset = 0;
+    size_t m_avail = 0;
+    int32_t m_integrator[2] = {};
+    // left and right, interleaved
+    std::vector<int32_t> m_buffer;
+};
+} // namespace gbc
@@ -0,0 +1,56 @@
+#pragma once
+#include "common.hpp"
+#include "instruction.hpp"
+#include <array>
+#include <cstdint>
+#include <memory>
+
+namespace gbc
+{
+// A basic block of pre-decoded ROM instructions. Blocks are keyed by the host
+// address of their first instruction in the (immutable) ROM image, which already
+// tells ROM banks apart, so they never have to be invalidated. A block is a run of
+// instructions up to an unconditional jump, call or return, and never crosses a
+// 16kb ROM area, as the next area can be another bank.
+struct cached_op_t
+{
+    handler_t handler;
+    uint8_t opcode;
+    uint8_t length;
+    // operand bytes, which handlers read with readop8/readop16
+    uint8_t imm[2];
+};
+
+struct block_t
+{
+    static constexpr int MAX_OPS = 16;
+    const uint8_t* host = nullptr;
+    uint16_t pc = 0;
+    uint8_t count = 0;
+    // the first ops loop back to the start of the block without writing
+    // anything, and can be skipped while they keep reading the same values
+    uint8_t loop_ops = 0;
+    std::array<cached_op_t, MAX_OPS> ops;
+};
+
+// direct-mapped, so that memory use stays bounded with many machines
+class BlockCache
+{
+public:
+    static constexpr size_t NUM_BLOCKS = 1024;
+
+    // the block that would hold the given instruction, which may hold another
+    block_t& slot(const uint8_t* host)
+    {
+        if (UNLIKELY(m_blocks == nullptr)) m_blocks.reset(new block_t[NUM_BLOCKS]);
+        const uint64_t hash = uint64_t(uintptr_t(host)) * 0x9E3779B97F4A7C15ull;
+        return m_blocks[hash >> (64 - HASH_BITS)];
+    }
+    void clear() { m_blocks.reset(); }
+
+private:
+    static constexpr int HASH_BITS = 10;
+    static_assert(NUM_BLOCKS == 1u << HASH_BITS, "Hash bits must match the cache size");
+    std::unique_ptr<block_t[]> m_blocks;
+};
+} // namespace gbc
@@ -15,7 +15,11 @@ class CPU;
 class Machine;
 class Memory;
 class IO;
+class StateView;
+class StateWriter;
 constexpr bool ENABLE_GBC = true;
+// returned by components that have no hardware event scheduled
+constexpr uint64_t NO_EVENT = 0x100000000ull;
 
 inline void setflag(bool expr, uint8_t& flg, uint8_t mask)
 {
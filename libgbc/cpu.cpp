@@ -3,6 +3,7 @@
 #include "instructions.cpp"
 #include "machine.hpp"
 #include <cassert>
+#include <cstring>
 
 namespace gbc
 {
@@ -29,6 +30,8 @@ void CPU::reset() noexcept
     registers().sp = 0xfffe;
     registers().pc = memory().bootrom_enabled() ? 0x0 : 0x100;
     this->m_state.cycles_total = 0;
+    this->m_state.synced_cycles = 0;
+    this->m_state.event_cycles = 0;
 }
 
 void CPU::simulate()
@@ -53,8 +56,21 @@ void CPU::simulate()
     }
 }
 
+void CPU::run_until(const uint64_t cycles)
+{
+    this->m_exit_run = false;
+    while (gettime() < cycles && !this->m_exit_run)
+    {
+        // nothing can wake the CPU before the next event
+        if (m_state.asleep && m_idle_skip) this->skip_halt(cycles);
+        if (!this->run_block(cycles)) this->simulate();
+    }
+}
+
 void CPU::execute()
 {
+    // operands are read from memory, not from a cached block
+    this->m_fetch = nullptr;
     // 1. read instruction from memory
     const uint8_t opcode = this->peekop8(0);
     // 2. decode into executable instruction
@@ -69,6 +85,7 @@ void CPU::execute()
     }
 
     // 3. increment PC, hardware tick
+    GBC_STAT(machine().counters().opcodes[opcode]++);
     registers().pc++;
     this->hardware_tick();
 
@@ -85,6 +102,11 @@ void CPU::execute()
             printf("* Flags changed: [%s]\n", cstr_flags(fbuf, registers().flags));
         }
     }
+    this->check_pc_area();
+}
+
+void CPU::check_pc_area()
+{
     if (UNLIKELY(memory().is_within(registers().pc, Memory::VideoRAM)))
     {
         fprintf(stderr, "ERROR: PC is in the Video RAM area: %04X\n", registers().pc);
@@ -110,9 +132,23 @@ void CPU::execute()
 void CPU::hardware_tick()
 {
     this->incr_cycles(4);
-    machine().gpu.simulate();
-    machine().io.simulate();
-    machine().apu.simulate();
+    // hardware only needs to catch up when something can happen
+    if (UNLIKELY(gettime() >= m_state.event_cycles)) this->hardware_sync();
+}
+void CPU::hardware_sync()
+{
+    const uint64_t elapsed = gettime() - m_state.synced_cycles;
+    if (elapsed > 0)
+    {
+        // hardware can access I/O while simulating, which syncs again
+        m_state.synced_cycles = gettime();
+        machine().gpu.simulate(elapsed);
+        machine().io.simulate(elapsed);
+        machine().apu.simulate(elapsed);
+    }
+    const uint64_t next =
+        std::min(machine().gpu.cycles_until_event(), machine().io.cycles_until_event());
+    m_state.event_cycles = gettime() + next;
 }
 
 // it takes 2 instruction-cycles to toggle interrupts
@@ -169,6 +205,7 @@ void CPU::interrupt(interrupt_t& intr)
 {
     if (UNLIKELY(machine().verbose_interrupts))
     { printf("%9lu: Executing interrupt %s (%#x)\n", this->gettime(), intr.name, intr.mask); }
+    GBC_STAT(machine().counters().interrupts[__builtin_ctz(intr.mask)]++);
     // disable interrupt request
     machine().io.reg(IO::REG_IF) &= ~intr.mask;
     // set interrupt bit
@@ -183,339 +220,268 @@ void CPU::interrupt(interrupt_t& intr)
     if (intr.callback) intr.callback(machine(), intr);
 }
 
-instruction_t& CPU::decode(const uint8_t opcode)
+const instruction_t& CPU::decode(const uint8_t opcode) { return opcode_table[opcode]; }
+
+// instructions that only change registers, so that a loop of them can only
+// read something new after a hardware event (CB is checked per operand)
+static constexpr bool writes_nothing(const uint8_t op)
 {
-    switch (opcode)
+    // LD R, R and ALU A, R, except LD (HL), R and HALT
+    if (op >= 0x40 && op < 0xC0) return op < 0x70 || op >= 0x78;
+    switch (op)
     {
     case 0x00: // NOP
-        return instr_NOP;
-    case 0x08: // LD SP, imm16
-        return instr_LD_N_SP;
-    case 0x10: // STOP
-        return instr_STOP;
-    case 0x76: // HALT
-        return instr_HALT;
-    // LD D, imm8
-    case 0x06:
-    case 0x16:
-    case 0x26:
-    case 0x36:
-    case 0x0E:
-    case 0x1E:
-    case 0x2E:
-    case 0x3E:
-        return instr_LD_D_N;
-    // LD B, D
-    case 0x40:
-    case 0x41:
-    case 0x42:
-    case 0x43:
-    case 0x44:
-    case 0x45:
-    case 0x46:
-    case 0x47:
-    // LD C, D
-    case 0x48:
-    case 0x49:
-    case 0x4A:
-    case 0x4B:
-    case 0x4C:
-    case 0x4D:
-    case 0x4E:
-    case 0x4F:
-    // LD D, D
-    case 0x50:
-    case 0x51:
-    case 0x52:
-    case 0x53:
-    case 0x54:
-    case 0x55:
-    case 0x56:
-    case 0x57:
-    // LD E, D
-    case 0x58:
-    case 0x59:
-    case 0x5A:
-    case 0x5B:
-    case 0x5C:
-    case 0x5D:
-    case 0x5E:
-    case 0x5F:
-    // LD H, D
-    case 0x60:
-    case 0x61:
-    case 0x62:
-    case 0x63:
-    case 0x64:
-    case 0x65:
-    case 0x66:
-    case 0x67:
-    // LD L, D
-    case 0x68:
-    case 0x69:
-    case 0x6A:
-    case 0x6B:
-    case 0x6C:
-    case 0x6D:
-    case 0x6E:
-    case 0x6F:
-    // LD (HL), D
-    // NOTE: 0x76: is HALT and *not* LD (HL), (HL)
-    case 0x70:
-    case 0x71:
-    case 0x72:
-    case 0x73:
-    case 0x74:
-    case 0x75:
-    case 0x77:
-    // LD A, D
-    case 0x78:
-    case 0x79:
-    case 0x7A:
-    case 0x7B:
-    case 0x7C:
-    case 0x7D:
-    case 0x7E:
-    case 0x7F:
-        return instr_LD_D_D;
-    // LD A, R
-    case 0x02:
-    case 0x12:
-    case 0x0A:
-    case 0x1A:
-        return instr_LD_R_A_R;
-    case 0xEA: // LD (imm16), A
-    case 0xFA: // LD A, (imm16)
-        return instr_LD_N_A_N;
-    case 0x22: // LDI (HL), A
-    case 0x32: // LDD (HL), A
-    case 0x2A: // LDI A, (HL)
-    case 0x3A: // LDD A, (HL)
-        return instr_LDID_HL_A;
-    case 0xE2: // LD (FF00+C), A
-    case 0xF2: // LD A, (FF00+C)
-    case 0xE0: // LD (FF00+imm8), A
-    case 0xF0: // LD A, (FF00+imm8)
-        return instr_LD_FF00_A;
-    // LD R, imm16
-    case 0x01:
-    case 0x11:
-    case 0x21:
-    case 0x31:
-        return instr_LD_R_N;
-    case 0xE8:
-        return instr_ADD_SP_N;
-    case 0xF8: // LD HL, SP+imm8
-    case 0xF9: // LD SP, HL
-        return instr_LD_HL_SP;
-    // POP R
-    case 0xC1:
-    case 0xD1:
-    case 0xE1:
-    case 0xF1:
-    // PUSH R
-    case 0xC5:
-    case 0xD5:
-    case 0xE5:
-    case 0xF5:
-        return instr_PUSH_POP;
-    // ALU operations
-    // ADD A, D
-    case 0x80:
-    case 0x81:
-    case 0x82:
-    case 0x83:
-    case 0x84:
-    case 0x85:
-    case 0x86:
-    case 0x87:
-        return instr_ALU_A_D;
-    // ADC A, D
-    case 0x88:
-    case 0x89:
-    case 0x8A:
-    case 0x8B:
-    case 0x8C:
-    case 0x8D:
-    case 0x8E:
-    case 0x8F:
-        return instr_ALU_A_D;
-    // SUB A, D
-    case 0x90:
-    case 0x91:
-    case 0x92:
-    case 0x93:
-    case 0x94:
-    case 0x95:
-    case 0x96:
-    case 0x97:
-        return instr_ALU_A_D;
-    // SBC A, D
-    case 0x98:
-    case 0x99:
-    case 0x9A:
-    case 0x9B:
-    case 0x9C:
-    case 0x9D:
-    case 0x9E:
-    case 0x9F:
-        return instr_ALU_A_D;
-    // AND A, D
-    case 0xA0:
-    case 0xA1:
-    case 0xA2:
-    case 0xA3:
-    case 0xA4:
-    case 0xA5:
-    case 0xA6:
-    case 0xA7:
-        return instr_ALU_A_D;
-    // XOR A, D
-    case 0xA8:
-    case 0xA9:
-    case 0xAA:
-    case 0xAB:
-    case 0xAC:
-    case 0xAD:
-    case 0xAE:
-    case 0xAF:
-        return instr_ALU_A_D;
-    // OR  A, D
-    case 0xB0:
-    case 0xB1:
-    case 0xB2:
-    case 0xB3:
-    case 0xB4:
-    case 0xB5:
-    case 0xB6:
-    case 0xB7:
-        return instr_ALU_A_D;
-    // CP A, D
-    case 0xB8:
-    case 0xB9:
-    case 0xBA:
-    case 0xBB:
-    case 0xBC:
-    case 0xBD:
-    case 0xBE:
-    case 0xBF:
-        return instr_ALU_A_D;
-    // ALU OP A, im8
-    case 0xC6:
-    case 0xCE:
-    case 0xD6:
-    case 0xDE:
-    case 0xE6:
-    case 0xEE:
-    case 0xF6:
-    case 0xFE:
-        return instr_ALU_A_N;
-    // INC R, DEC R
-    case 0x03:
-    case 0x0B:
-    case 0x13:
-    case 0x1B:
-    case 0x23:
-    case 0x2B:
-    case 0x33:
-    case 0x3B:
-        return instr_INC_DEC_R;
-    // INC D, DEC D
-    case 0x04:
-    case 0x05:
-    case 0x0C:
-    case 0x0D:
-    case 0x14:
-    case 0x15:
-    case 0x1C:
-    case 0x1D:
-    case 0x24:
-    case 0x25:
-    case 0x2C:
-    case 0x2D:
-    case 0x34:
-    case 0x35:
-    case 0x3C:
-    case 0x3D:
-        return instr_INC_DEC_D;
-    // ADD HL, R
-    case 0x09:
-    case 0x19:
-    case 0x29:
-    case 0x39:
-        return instr_ADD_HL_R;
-    case 0x27: // DA A
-        return instr_DAA;
-    case 0x2F: // CPL A
-        return instr_CPL_A;
-    case 0x37: // SCF
-    case 0x3F: // CCF
-        return instr_SCF_CCF;
-    case 0x07: // RLC A
-    case 0x17: // RL A
-    case 0x0F: // RRC A
-    case 0x1F: // RR A
-        return instr_RLC_RRC;
-    case 0xC3: // JP imm16
-    case 0xC2: // JP nz, imm16
-    case 0xCA: // JP z, imm16
-    case 0xD2: // JP nc, imm16
-    case 0xDA: // JP c, imm16
-        return instr_JP;
-    case 0xE9: // JP HL
-        return instr_JP_HL;
+    case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C: // INC R
+    case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D: // DEC R
+    case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E: // LD R, imm8
+    case 0x01: case 0x11: case 0x21: // LD R, imm16
+    case 0x03: case 0x13: case 0x23: case 0x0B: case 0x1B: case 0x2B: // INC/DEC R16
+    case 0x09: case 0x19: case 0x29: // ADD HL, R16
+    case 0x0A: case 0x1A: case 0x2A: case 0x3A: // LD A, (R16)
+    case 0x07: case 0x0F: case 0x17: case 0x1F: // rotate A
+    case 0x27: case 0x2F: case 0x37: case 0x3F: // DAA, CPL, SCF, CCF
+    case 0xC6: case 0xCE: case 0xD6: case 0xDE: // ALU A, imm8
+    case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+    case 0xF0: case 0xF2: case 0xFA: // LD A, (FF00+N), (FF00+C) and (N)
+    case 0x20: case 0x28: case 0x30: case 0x38: // JR cc, imm8
+    case 0xC2: case 0xCA: case 0xD2: case 0xDA: // JP cc, imm16
+    case 0xCB:
+        return true;
+    }
+    return false;
+}
+
+struct block_info_t
+{
+    uint8_t length;
+    bool ends_block;
+    bool missing;
+    bool writes_nothing;
+};
+static constexpr block_info_t make_block_info(const uint8_t op)
+{
+    block_info_t info{1, false, decode_opcode(op).handler == handler_MISSING, writes_nothing(op)};
+    switch (op)
+    {
+    case 0x06: case 0x0E: case 0x16: case 0x1E: // LD D, imm8
+    case 0x26: case 0x2E: case 0x36: case 0x3E:
+    case 0xC6: case 0xCE: case 0xD6: case 0xDE: // ALU A, imm8
+    case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+    case 0x20: case 0x28: case 0x30: case 0x38: // JR cc, imm8
+    case 0xE0: case 0xF0: case 0xE8: case 0xF8: case 0xCB:
+        info.length = 2;
+        break;
+    case 0x01: case 0x11: case 0x21: case 0x31: // LD R, imm16
+    case 0x08: case 0xEA: case 0xFA:
+    case 0xC2: case 0xCA: case 0xD2: case 0xDA: // JP cc, imm16
+    case 0xC4: case 0xCC: case 0xD4: case 0xDC: // CALL cc, imm16
+        info.length = 3;
+        break;
     case 0x18: // JR imm8
-    case 0x20: // JR nz, imm8
-    case 0x28: // JR z, imm8
-    case 0x30: // JR nc, imm8
-    case 0x38: // JR c, imm8
-        return instr_JR_N;
+        info.length = 2;
+        info.ends_block = true;
+        break;
+    case 0xC3: // JP imm16
     case 0xCD: // CALL imm16
-    case 0xC4: // CALL nz, imm16
-    case 0xCC: // CALL z, imm16
-    case 0xD4: // CALL nc, imm16
-    case 0xDC: // CALL c, imm16
-        return instr_CALL;
+        info.length = 3;
+        info.ends_block = true;
+        break;
+    case 0x10: // STOP skips its second byte by itself
+    case 0x76: // HALT
+    case 0xE9: // JP HL
     case 0xC9: // RET
-    case 0xC0: // RET nz
-    case 0xC8: // RET z
-    case 0xD0: // RET nc
-    case 0xD8: // RET c
-        return instr_RET;
     case 0xD9: // RETI
-        return instr_RETI;
-    // RST 0x0, 0x08, 0x10, 0x18
-    case 0xC7:
-    case 0xCF:
-    case 0xD7:
-    case 0xDF:
-    // RST 0x20, 0x028, 0x30, 0x38
-    case 0xE7:
-    case 0xEF:
-    case 0xF7:
-    case 0xFF:
-        return instr_RST;
-    case 0xF3: // DI
-    case 0xFB: // EI
-        return instr_DI_EI;
-    case 0xCB:
-        return instr_CB_EXT;
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF: // RST
+    case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+        info.ends_block = true;
+        break;
+    }
+    return info;
+}
+template <int... OP>
+static constexpr std::array<block_info_t, 256> make_block_table(std::integer_sequence<int, OP...>)
+{
+    return {{make_block_info(OP)...}};
+}
+static constexpr auto block_table = make_block_table(std::make_integer_sequence<int, 256>{});
+
+void CPU::set_block_cache(const bool en)
+{
+    this->m_use_blocks = en;
+    if (!en) this->m_blocks.clear();
+}
+
+void CPU::decode_block(block_t& block, const uint8_t* host, const uint16_t pc)
+{
+    block.host = host;
+    block.pc = pc;
+    block.count = 0;
+    // the ROM is only contiguous up to the end of the 16kb area
+    size_t left = 0x4000 - (pc & 0x3FFF);
+    while (block.count < block_t::MAX_OPS)
+    {
+        const uint8_t opcode = host[0];
+        const auto& info = block_table[opcode];
+        if (info.missing || info.length > left) break;
+        auto& op = block.ops[block.count++];
+        op.handler = opcode_table[opcode].handler;
+        op.opcode = opcode;
+        op.length = info.length;
+        op.imm[0] = (info.length > 1) ? host[1] : 0;
+        op.imm[1] = (info.length > 2) ? host[2] : 0;
+        if (info.ends_block) break;
+        host += info.length;
+        left -= info.length;
+    }
+    // look for a polling loop at the start of the block
+    block.loop_ops = 0;
+    uint16_t addr = pc;
+    for (int i = 0; i < block.count; i++)
+    {
+        const auto& op = block.ops[i];
+        if (!block_table[op.opcode].writes_nothing) break;
+        // only BIT N, (HL) leaves (HL) alone
+        const uint8_t cb = op.imm[0];
+        if (op.opcode == 0xCB && (cb & 0x7) == 0x6 && (cb < 0x40 || cb >= 0x80)) break;
+        addr += op.length;
+        uint16_t dest = addr;
+        if ((op.opcode & 0xE7) == 0x20)
+            dest = addr + (int8_t) op.imm[0];
+        else if ((op.opcode & 0xE7) == 0xC2)
+            dest = op.imm[0] | (op.imm[1] << 8);
+        if (dest == pc)
+        {
+            block.loop_ops = i + 1;
+            break;
+        }
+    }
+}
+
+bool CPU::run_block(const uint64_t end)
+{
+    bool ran = false;
+    // blocks are chained until something needs the plain interpreter
+    while (gettime() < end && !m_exit_run)
+    {
+        const uint16_t start = registers().pc;
+        // anything that needs to see every instruction uses the plain interpreter
+        if (!m_use_blocks || start >= 0x8000 || m_state.asleep || m_state.stopped || m_break ||
+            m_break_steps_cnt != 0 || !m_breakpoints.empty() || machine().verbose_instructions)
+            break;
+        const uint8_t* page = memory().read_page(start);
+        // unmapped ROM, or watchpoints on it
+        if (page == nullptr) break;
+        const uint8_t* host = page + (start & 0xFFF);
+
+        block_t& block = m_blocks.slot(host);
+        if (block.host != host || block.pc != start) this->decode_block(block, host, start);
+        if (block.count == 0) break;
+        ran = true;
+
+        // remember where a polling loop started, to see if it repeats itself
+        const bool loop = block.loop_ops != 0 && m_idle_skip;
+        const regs_t loop_regs = registers();
+        const uint64_t loop_time = gettime();
+        const uint64_t loop_event = m_state.event_cycles;
+        if (loop) memory().clear_read_flags();
+
+        uint16_t pc = start;
+        int i = 0;
+        for (; i < block.count; i++)
+        {
+            const cached_op_t& op = block.ops[i];
+            // the same checks simulate() does between instructions
+            if (i > 0)
+            {
+                if (gettime() >= end || m_exit_run || m_break || m_state.asleep ||
+                    m_state.stopped)
+                    break;
+                // a jump, a taken branch or a bank switch leaves the block
+                const uint8_t* cur = memory().read_page(pc);
+                if (registers().pc != pc || cur == nullptr || cur + (pc & 0xFFF) != host) break;
+            }
+            if (UNLIKELY(m_state.intr_pending != 0 ||
+                         ((m_state.ime || m_state.haltbug) && machine().io.interrupt_mask() != 0)))
+            {
+                this->handle_interrupts();
+                if (registers().pc != pc || m_state.asleep) break;
+            }
+            GBC_STAT(machine().counters().opcodes[op.opcode]++);
+            registers().pc++;
+            this->hardware_tick();
+            this->m_fetch = op.imm;
+            op.handler(*this, op.opcode);
+            this->m_fetch = nullptr;
+
+            pc += op.length;
+            host += op.length;
+        }
+        if (loop && i == block.loop_ops && registers().pc == start)
+            this->skip_idle_loop(loop_regs, loop_time, loop_event, end);
     }
-    return instr_MISSING;
+    if (UNLIKELY(registers().pc >= 0x8000)) this->check_pc_area();
+    return ran;
+}
+
+void CPU::skip_halt(const uint64_t end)
+{
+    // the checks and interrupts simulate() does every tick must have nothing to do
+    if (m_state.stopped || m_state.intr_pending != 0 || m_break || this->break_time() ||
+        !m_breakpoints.empty() || machine().io.interrupt_mask() != 0)
+        return;
+    const uint64_t now = gettime();
+    const uint64_t until = std::min(m_state.event_cycles, end);
+    if (until <= now) return;
+    // every tick stays before the next event, and the end
+    this->incr_cycles((until - 1 - now) & ~3ull);
+}
+
+void CPU::skip_idle_loop(const regs_t& start, const uint64_t started, const uint64_t event,
+                         const uint64_t end)
+{
+    const uint64_t now = gettime();
+    // the next round only repeats the last one when nothing happened during it,
+    // the registers are the same, and no interrupt is about to be taken
+    if (event <= now || m_state.intr_pending != 0 || m_break || m_exit_run) return;
+    if (std::memcmp(&start, &registers(), sizeof(regs_t)) != 0) return;
+    if ((m_state.ime || m_state.haltbug) && machine().io.interrupt_mask() != 0) return;
+    const uint8_t reads = memory().read_flags();
+    if (reads & Memory::READ_VOLATILE) return;
+
+    // every tick stays before the next event, and the run ends on the loop start
+    uint64_t until = std::min(m_state.event_cycles - 1, end);
+    if (reads & Memory::READ_GPU_MODE)
+    {
+        // LY and STAT can change on the next boundary, even without an event
+        const uint64_t boundary = m_state.synced_cycles + machine().gpu.cycles_until_boundary();
+        until = std::min(until, boundary - 4);
+    }
+    if (until <= now) return;
+    const uint64_t period = now - started;
+    this->incr_cycles((until - now) / period * period);
 }
 
 uint8_t CPU::peekop8(int disp) { return memory().read8(registers().pc + disp); }
 uint16_t CPU::peekop16(int disp) { return memory().read16(registers().pc + disp); }
 uint8_t CPU::readop8()
 {
-    const uint8_t operand = peekop8(0);
+    const uint8_t operand = (m_fetch != nullptr) ? *m_fetch++ : peekop8(0);
     registers().pc++;
     hardware_tick();
     return operand;
 }
 uint16_t CPU::readop16()
 {
-    const uint16_t operand = peekop16(0);
+    uint16_t operand;
+    if (m_fetch != nullptr)
+    {
+        operand = m_fetch[0] | m_fetch[1] << 8;
+        this->m_fetch += 2;
+    }
+    else
+    {
+        operand = peekop16(0);
+    }
     registers().pc += 2;
     hardware_tick();
     hardware_tick();
@@ -549,9 +515,9 @@ void CPU::mtwrite16(uint16_t addr, uint16_t value)
     this->hardware_tick();
 }
 
-void CPU::incr_cycles(int count)
+void CPU::incr_cycles(uint64_t count)
 {
-    assert(count >= 0);
+    // skipping ahead can cover more than 2^31 cycles when nothing is scheduled
     this->m_state.cycles_total += count;
 }
 
@@ -561,7 +527,9 @@ void CPU::stop()
     // preparing a speed switch?
     if (machine().io.reg(IO::REG_KEY1) & 0x1) { this->m_state.switch_cycles = 4; }
     // disable screen etc.
+    this->hardware_sync();
     machine().io.perform_stop();
+    this->hardware_sync();
 }
 void CPU::handle_speed_switch()
 {
@@ -572,10 +540,12 @@ void CPU::handle_speed_switch()
         {
             // stop the stopping
             this->m_state.stopped = false;
+            this->hardware_sync();
             // change speed
             memory().do_switch_speed();
             // this can turn the LCD back on
             machine().io.deactivate_stop();
+            this->hardware_sync();
         }
     }
 }
@@ -609,13 +579,58 @@ void CPU::push_and_jump(uint16_t address)
     this->jump(address);
 }
 
-int CPU::restore_state(const std::vector<uint8_t>& data, int off)
+void CPU::load_state(const StateView& view, state_t& state) const
+{
+    auto in = view.chunk(make_tag("CPU "));
+    auto& regs = state.registers;
+    in.get(regs.af);
+    in.get(regs.bc);
+    in.get(regs.de);
+    in.get(regs.hl);
+    in.get(regs.sp);
+    in.get(regs.pc);
+    in.get(state.cycles_total);
+    in.get(state.synced_cycles);
+    in.get(state.event_cycles);
+    in.get(state.last_flags);
+    in.get(state.intr_pending);
+    in.get(state.ime);
+    in.get(state.stopped);
+    in.get(state.asleep);
+    in.get(state.haltbug);
+    in.get(state.switch_cycles);
+}
+void CPU::validate_state(const StateView& view) const
+{
+    state_t state;
+    this->load_state(view, state);
+}
+void CPU::restore_state(const StateView& view)
 {
-    this->m_state = *(state_t*) &data.at(off);
-    return sizeof(m_state);
+    state_t state;
+    this->load_state(view, state);
+    this->m_state = state;
 }
-void CPU::serialize_state(std::vector<uint8_t>& res) const
+void CPU::serialize_state(StateWriter& out, bool with_event) const
 {
-    res.insert(res.end(), (uint8_t*) &m_state, (uint8_t*) &m_state + sizeof(m_state));
+    out.begin(make_tag("CPU "), 1);
+    const auto& regs = m_state.registers;
+    out.put(regs.af);
+    out.put(regs.bc);
+    out.put(regs.de);
+    out.put(regs.hl);
+    out.put(regs.sp);
+    out.put(regs.pc);
+    out.put(m_state.cycles_total);
+    out.put(m_state.synced_cycles);
+    out.put(with_event ? m_state.event_cycles : uint64_t(0));
+    out.put(m_state.last_flags);
+    out.put(m_state.intr_pending);
+    out.put(m_state.ime);
+    out.put(m_state.stopped);
+    out.put(m_state.asleep);
+    out.put(m_state.haltbug);
+    out.put(m_state.switch_cycles);
+    out.end();
 }
 } // namespace gbc
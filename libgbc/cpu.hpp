@@ -1,4 +1,5 @@
 #pragma once
+#include "blocks.hpp"
 #include "instruction.hpp"
 #include "interrupt.hpp"
 #include "registers.hpp"
@@ -19,6 +20,16 @@ public:
     CPU(Machine&) noexcept;
     void reset() noexcept;
     void simulate();
+    // run until the given cycle is reached, or until exit_run() is called
+    void run_until(uint64_t cycles);
+    void exit_run() noexcept { this->m_exit_run = true; }
+    bool run_exited() const noexcept { return this->m_exit_run; }
+    // run ROM code from pre-decoded blocks (on by default)
+    void set_block_cache(bool en);
+    bool block_cache_enabled() const noexcept { return this->m_use_blocks; }
+    // skip ahead to the next event when halted or in a polling loop (on by default)
+    void set_idle_skip(bool en) noexcept { this->m_idle_skip = en; }
+    bool idle_skip_enabled() const noexcept { return this->m_idle_skip; }
     uint64_t gettime() const noexcept { return m_state.cycles_total; }
 
     void execute();
@@ -35,14 +46,21 @@ public:
     void mtwrite16(uint16_t addr, uint16_t value);
     // perform one hardware tick
     void hardware_tick();
-    void incr_cycles(int count);
+    // bring hardware up to the current cycle and schedule the next event
+    void hardware_sync();
+    // bring hardware up to the current cycle, unless it already is
+    void hardware_catchup()
+    {
+        if (gettime() != m_state.synced_cycles) this->hardware_sync();
+    }
+    void incr_cycles(uint64_t count);
     void push_value(uint16_t addr);
     void push_and_jump(uint16_t addr);
     void jump(uint16_t dest);
     void stop();
     void wait(); // wait for interrupts
     void buggy_halt();
-    instruction_t& decode(uint8_t opcode);
+    const instruction_t& decode(uint8_t opcode);
 
     regs_t& registers() noexcept { return m_state.registers; }
     // helpers for reading and writing (HL)
@@ -60,8 +78,12 @@ public:
     bool is_halting() const noexcept { return m_state.asleep; }
 
     // serialization
-    int restore_state(const std::vector<uint8_t>&, int);
-    void serialize_state(std::vector<uint8_t>&) const;
+    // throws what restore_state() would, without changing anything
+    void validate_state(const StateView&) const;
+    void restore_state(const StateView&);
+    // the next event depends on video settings, so hashes of the
+    // emulated state leave it out (with the hardware synced)
+    void serialize_state(StateWriter&, bool with_event = true) const;
 
     // debugging
     void breakpoint(uint16_t address, breakpoint_t func);
@@ -78,6 +100,11 @@ public:
 private:
     void handle_interrupts();
     void handle_speed_switch();
+    bool run_block(uint64_t end);
+    void decode_block(block_t&, const uint8_t* host, uint16_t pc);
+    void check_pc_area();
+    void skip_halt(uint64_t end);
+    void skip_idle_loop(const regs_t& start, uint64_t started, uint64_t event, uint64_t end);
     void execute_interrupts(const uint8_t);
     bool break_time() const;
     void interrupt(interrupt_t&);
@@ -88,6 +115,10 @@ private:
     {
         regs_t registers;
         uint64_t cycles_total = 0;
+        // hardware has been simulated up to this cycle
+        uint64_t synced_cycles = 0;
+        // next cycle where any hardware can change observable state
+        uint64_t event_cycles = 0;
         uint8_t last_flags = 0xff;
         int8_t intr_pending = 0;
         bool ime = false;
@@ -96,8 +127,16 @@ private:
         bool haltbug = false;
         uint8_t switch_cycles = 0;
     } m_state;
+    // throws on a missing or short chunk
+    void load_state(const StateView&, state_t&) const;
     // debugging
     bool m_break = false;
+    bool m_exit_run = false;
+    bool m_use_blocks = true;
+    bool m_idle_skip = true;
+    // operands of the cached instruction being executed, or nullptr
+    const uint8_t* m_fetch = nullptr;
+    BlockCache m_blocks;
     mutable int16_t m_break_steps = 0;
     mutable int16_t m_break_steps_cnt = 0;
     std::map<uint16_t, breakpoint_t> m_breakpoints;
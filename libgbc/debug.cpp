@@ -36,7 +36,7 @@ static void print_help()
       b, break [addr]       Breakpoint on executing [addr]
       rb [addr]             Breakpoint on reading from [addr]
       wb [addr]             Breakpoint on writing to [addr]
-      clear                 Clear all breakpoints
+      clear                 Clear all breakpoints and watchpoints
       reset                 Reset the machine
       read [addr] (len=1)   Read from [addr] (len) bytes and print
       write [addr] [value]  Write [value] to memory location [addr]
@@ -97,6 +97,7 @@ static bool execute_commands(CPU& cpu)
     else if (cmd == "clear")
     {
         cpu.breakpoints().clear();
+        cpu.memory().clear_watchpoints();
         return true;
     }
     else if (cmd == "rb" || cmd == "wb")
@@ -110,21 +111,19 @@ static bool execute_commands(CPU& cpu)
         uint16_t traploc = std::strtoul(params[1].c_str(), 0, 16) & 0xFFFF;
         printf("Breaking after any %s %04X (%s)\n", (mode) ? "write to" : "read from", traploc,
                cpu.memory().explain(traploc).c_str());
-        cpu.memory().breakpoint(mode, [traploc, mode](Memory& mem, uint16_t addr, uint8_t value) {
-            if (addr == traploc)
+        cpu.memory().watchpoint(mode, {traploc, traploc},
+                                [mode](Memory& mem, uint16_t addr, uint8_t value) {
+            if (mode == Memory::READ)
             {
-                if (mode == Memory::READ)
-                {
-                    printf("Breaking after read from %04X (%s) with value %02X\n", addr,
-                           mem.explain(addr).c_str(), mem.read8(addr));
-                }
-                else
-                { // WRITE
-                    printf("Breaking after write to %04X (%s) with value %02X (old: %02X)\n", addr,
-                           mem.explain(addr).c_str(), value, mem.read8(addr));
-                }
-                mem.machine().break_now();
+                printf("Breaking after read from %04X (%s) with value %02X\n", addr,
+                       mem.explain(addr).c_str(), mem.read8(addr));
             }
+            else
+            { // WRITE
+                printf("Breaking after write to %04X (%s) with value %02X (old: %02X)\n", addr,
+                       mem.explain(addr).c_str(), value, mem.read8(addr));
+            }
+            mem.machine().break_now();
         });
         return true;
     }
@@ -203,7 +202,7 @@ static bool execute_commands(CPU& cpu)
         }
         unsigned long hex = std::strtoul(params[1].c_str(), 0, 16);
         hex &= 0x1FFF;
-        printf("VRAM1:%04lX -> %02X\n", hex, cpu.memory().video_ram_ptr()[off + hex]);
+        printf("VRAM1:%04lX -> %02X\n", hex, cpu.memory().video_ram().read(off + hex));
         return true;
     }
     else if (cmd == "vblank" || cmd == "vbl")
@@ -1,21 +1,147 @@
 #pragma once
+#include <cstdint>
 
 namespace gbc
 {
 struct sample_t
 {
-    uint16_t left;
-    uint16_t right;
+    int16_t left;
+    int16_t right;
 };
-struct Generator
+
+// The sound channels, advanced by many steps at a time. Timers count APU
+// cycles (4 MHz, also in double speed mode) until the next waveform step.
+struct envelope_t
+{
+    uint8_t volume = 0;
+    uint8_t period = 0;
+    uint8_t timer = 0;
+    bool increase = false;
+
+    void trigger(const uint8_t nrx2)
+    {
+        this->volume = nrx2 >> 4;
+        this->increase = nrx2 & 0x8;
+        this->period = nrx2 & 0x7;
+        this->timer = (period != 0) ? period : 8;
+    }
+    // 64 Hz, from the frame sequencer
+    void clock()
+    {
+        if (period == 0 || --timer != 0) return;
+        this->timer = period;
+        if (increase && volume < 15)
+            volume++;
+        else if (!increase && volume > 0)
+            volume--;
+    }
+};
+
+struct channel_base_t
 {
-    virtual void tick(Machine&) = 0;
-    virtual sample_t sample(Machine&) = 0;
+    bool enabled = false;
+    // the DAC is powered by the upper bits of NRx2 (NR30 for wave)
+    bool dac = false;
+    bool length_enabled = false;
+    uint16_t length = 0;
+    uint16_t frequency = 0;
+    uint32_t timer = 0;
+
+    // 256 Hz, from the frame sequencer
+    void clock_length()
+    {
+        if (length_enabled && length > 0 && --length == 0) this->enabled = false;
+    }
+    // how many steps the waveform takes in the given number of cycles
+    uint32_t steps(uint32_t cycles, const uint32_t period)
+    {
+        if (cycles < timer)
+        {
+            this->timer -= cycles;
+            return 0;
+        }
+        cycles -= timer;
+        this->timer = period - cycles % period;
+        return 1 + cycles / period;
+    }
 };
 
-struct WhiteNoise : public Generator
+struct square_t : public channel_base_t
 {
-    void tick(Machine& machine) override {}
-    sample_t sample(Machine& machine) override { return {0, 0}; }
+    uint8_t duty = 0;
+    uint8_t position = 0;
+    envelope_t envelope;
+    // frequency sweep, channel 1 only
+    uint16_t shadow = 0;
+    uint8_t sweep_timer = 0;
+    bool sweep_enabled = false;
+
+    static constexpr bool BATCHED = false;
+    uint32_t period() const noexcept { return (2048 - frequency) * 4; }
+    bool clocked() const noexcept { return true; }
+    void step(const uint32_t n) { this->position = (position + n) & 0x7; }
+    uint8_t output() const noexcept
+    {
+        static constexpr uint8_t DUTY[4] = {0x01, 0x81, 0x87, 0x7E};
+        return (enabled && (DUTY[duty] >> position) & 1) ? envelope.volume : 0;
+    }
+};
+
+struct wave_t : public channel_base_t
+{
+    uint8_t position = 0;
+    uint8_t volume_code = 0;
+
+    static constexpr bool BATCHED = false;
+    uint32_t period() const noexcept { return (2048 - frequency) * 2; }
+    bool clocked() const noexcept { return true; }
+    void step(const uint32_t n) { this->position = (position + n) & 0x1F; }
+    uint8_t output(const uint8_t* wave_ram) const noexcept
+    {
+        if (!enabled || volume_code == 0) return 0;
+        const uint8_t byte = wave_ram[position / 2];
+        const uint8_t sample = (position & 1) ? (byte & 0xF) : (byte >> 4);
+        return sample >> (volume_code - 1);
+    }
+};
+
+struct noise_t : public channel_base_t
+{
+    uint16_t lfsr = 0x7FFF;
+    uint8_t shift = 0;
+    uint8_t divisor = 0;
+    bool narrow = false;
+    envelope_t envelope;
+
+    // noise can step much faster than the output rate, so the steps between
+    // two output samples can be taken all at once
+    static constexpr bool BATCHED = true;
+    uint32_t period() const noexcept
+    {
+        return (divisor != 0) ? (divisor * 16u) << shift : 8u << shift;
+    }
+    // the LFSR does not clock with the two highest shifts
+    bool clocked() const noexcept { return shift < 14; }
+    void step(uint32_t n)
+    {
+        // k steps shift in the XOR of neighbouring bits of the old state, as
+        // long as those are all from the old state (15 bits, or 7 when narrow)
+        const uint32_t max = narrow ? 6 : 14;
+        while (n > 0)
+        {
+            const uint32_t k = (n < max) ? n : max;
+            const uint16_t feedback = (lfsr ^ (lfsr >> 1)) & ((1u << k) - 1);
+            const uint16_t wide = (lfsr >> k) | (feedback << (15 - k));
+            if (narrow)
+                this->lfsr = (wide & ~0x7F) | ((lfsr & 0x7F) >> k) | (feedback << (7 - k));
+            else
+                this->lfsr = wide;
+            n -= k;
+        }
+    }
+    uint8_t output() const noexcept
+    {
+        return (enabled && (~lfsr & 1)) ? envelope.volume : 0;
+    }
 };
 } // namespace gbc
@@ -3,12 +3,16 @@
 #include "machine.hpp"
 #include "sprite.hpp"
 #include "tiledata.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <unistd.h>
 
 namespace gbc
 {
+const int GPU::SCREEN_H;
 const int GPU::WHITE_IDX;
+const int Sprite::SPRITE_W;
 GPU::GPU(Machine& mach) noexcept
     : m_memory(mach.memory)
     , m_io(mach.io)
@@ -22,13 +26,20 @@ GPU::GPU(Machine& mach) noexcept
 void GPU::reset() noexcept
 {
     m_pixels.resize(SCREEN_W * SCREEN_H);
+    this->invalidate_tiles();
     this->m_state.video_offset = 0;
+    memory().remap_video_ram();
     // set_mode((m_reg_ly >= 144) ? 1 : 2);
 }
 uint64_t GPU::scanline_cycles() const noexcept
 {
     return oam_cycles() + vram_cycles() + hblank_cycles();
 }
+uint64_t GPU::frame_cycles() const noexcept
+{
+    // period advances 4 cycles per tick
+    return FRAME_LINES * ((scanline_cycles() + 3) & ~3ull);
+}
 uint64_t GPU::oam_cycles() const noexcept
 {
     return 83 * memory().speed_factor();
@@ -44,15 +55,64 @@ uint64_t GPU::hblank_cycles() const noexcept
     return 207 * memory().speed_factor();
     // return memory().speed_factor() * 204;
 }
-void GPU::simulate()
+uint64_t GPU::cycles_until_boundary() const noexcept
+{
+    // the next mode or scanline boundary
+    uint64_t target = scanline_cycles();
+    if (!this->is_vblank())
+    {
+        if (get_mode() == 2)
+            target = oam_cycles();
+        else if (get_mode() == 3)
+            target = oam_cycles() + vram_cycles();
+    }
+    // period advances 4 cycles per tick
+    if (m_state.period + 4 >= target) return 4;
+    return (target - m_state.period + 3) & ~3ull;
+}
+uint64_t GPU::cycles_until_event() const noexcept
+{
+    if (!this->lcd_enabled()) return NO_EVENT;
+    const uint64_t next = this->cycles_until_boundary();
+    // OAM and H-blank interrupts and HDMA happen inside scanlines
+    if (!m_headless || (m_reg_stat & 0x28) || m_io.hdma_active()) return next;
+
+    // without video, wake up only on scanlines that start with an interrupt,
+    // the V-blank line 0 or the new frame
+    const int scanline = m_state.current_scanline;
+    const int line = (is_vblank() && scanline == 0) ? FRAME_LINES - 1 : scanline;
+    auto lines_until = [line](int target) {
+        return (target - line + FRAME_LINES - 1) % FRAME_LINES + 1;
+    };
+    int lines = std::min({lines_until(0), lines_until(144), lines_until(154)});
+    const int lyc = m_io.reg(IO::REG_LYC);
+    if ((m_reg_stat & 0x40) && lyc > 0 && lyc < 154) lines = std::min(lines, lines_until(lyc));
+
+    const uint64_t period = m_state.period;
+    const uint64_t line_end =
+        (period + 4 >= scanline_cycles()) ? 4 : (scanline_cycles() - period + 3) & ~3ull;
+    return line_end + (lines - 1) * ((scanline_cycles() + 3) & ~3ull);
+}
+
+void GPU::simulate(uint64_t cycles)
 {
     // nothing to do with LCD being off
     if (!this->lcd_enabled()) { return; }
-
+    // without video the next event can be many boundaries away
+    do
+    {
+        const uint64_t step = std::min(cycles, this->cycles_until_boundary());
+        this->simulate_boundary(step);
+        cycles -= step;
+    } while (cycles > 0);
+}
+void GPU::simulate_boundary(const uint64_t cycles)
+{
     auto& vblank = io().vblank;
     auto& lcd_stat = io().lcd_stat;
 
-    this->m_state.period += 4;
+    // nothing happens before the last tick
+    this->m_state.period += cycles;
     const uint64_t period = this->m_state.period;
     // assert(period == 4);
     const bool new_scanline = period >= scanline_cycles();
@@ -83,6 +143,8 @@ void GPU::simulate()
             set_mode(1);
             // MODE 1: vblank interrupt
             io().trigger(vblank);
+            // let run_until_vblank() return
+            machine().cpu.exit_run();
             // modify stat
             this->set_mode(1);
             // if STAT vblank interrupt is enabled
@@ -117,7 +179,7 @@ void GPU::simulate()
             set_mode(3);
 
             // render a scanline (if rendering enabled)
-            if (LIKELY(!this->m_state.white_frame && this->m_render))
+            if (LIKELY(!this->m_state.white_frame && this->m_render && !this->m_headless))
             { this->render_scanline(m_state.current_scanline); }
             // TODO: perform HDMA transfers here!
         }
@@ -137,8 +199,19 @@ bool GPU::is_hblank() const noexcept { return get_mode() == 0; }
 uint8_t GPU::get_mode() const noexcept { return m_reg_stat & 0x3; }
 void GPU::set_mode(uint8_t mode)
 {
+    const bool was_locked = get_mode() == 3;
     this->m_reg_stat &= 0xfc;
     this->m_reg_stat |= mode & 0x3;
+    // video RAM is inaccessible in mode 3
+    if (was_locked != (get_mode() == 3)) memory().remap_video_ram();
+}
+
+void GPU::set_headless(const bool en)
+{
+    this->m_headless = en;
+    // video RAM is always accessed through the slow path when headless
+    memory().remap_video_ram();
+    machine().cpu.hardware_sync();
 }
 
 void GPU::do_ly_comparison()
@@ -166,9 +239,11 @@ void GPU::render_frame()
 
 void GPU::render_scanline(int scan_y)
 {
-    const uint8_t scroll_y = memory().read8(IO::REG_SCY);
-    const uint8_t scroll_x = memory().read8(IO::REG_SCX);
+    GBC_STAT(machine().counters().scanlines++);
+    const uint8_t scroll_y = io().reg(IO::REG_SCY);
+    const uint8_t scroll_x = io().reg(IO::REG_SCX);
     const int sy = (scan_y + scroll_y) % 256;
+    const bool is_cgb = machine().is_cgb();
 
     // create tiledata object from LCDC register
     auto td = this->create_tiledata(bg_tiles(), tile_data());
@@ -185,48 +260,120 @@ void GPU::render_scanline(int scan_y)
     // tile configuration
     tileconf_t tileconf = this->tile_config();
 
-    // render whole scanline
-    for (int scan_x = 0; scan_x < SCREEN_W; scan_x++)
+    // background line starting at the first (partial) tile, where
+    // the raw tile colors are kept for sprite priority
+    static constexpr int LINE_W = SCREEN_W + TileData::TILE_W;
+    static constexpr int LINE_TILES = LINE_W / TileData::TILE_W;
+    std::array<uint8_t, LINE_W> line_tile;
+    std::array<uint16_t, LINE_W> line_color;
+    std::array<bool, LINE_W> line_prio;
+    std::array<uint8_t, LINE_TILES> attrs;
+    // tile data at 0x8800 starts at tile 128
+    const int tile_base = (tile_data() - 0x8000) / 16;
+    for (int tx = 0; tx < LINE_TILES; tx++)
     {
-        const int sx = (scan_x + scroll_x) % 256;
-        // get the tile id and attribute
-        const int tid = td.tile_id(sx / 8, sy / 8);
-        const int tattr = td.tile_attr(sx / 8, sy / 8);
-        // copy the 16-byte tile into buffer
-        const int tile_color = td.pattern(tid, tattr, sx & 7, sy & 7);
-        uint16_t color = this->colorize_tile(tileconf, tattr, tile_color);
-
-        if ((tattr & 0x80) == 0 || !machine().is_cgb())
+        const int mx = ((scroll_x / 8) + tx) % 32;
+        attrs[tx] = td.tile_attr(mx, sy / 8);
+        const int tid = tile_base + td.tile_id(mx, sy / 8);
+        std::memcpy(&line_tile[tx * TileData::TILE_W], decoded_row(tid, attrs[tx], sy & 7),
+                    TileData::TILE_W);
+    }
+    for (int tx = 0; tx < LINE_TILES; tx++)
+    {
+        const int x0 = tx * TileData::TILE_W;
+        // BG-to-OAM priority hides window and sprites
+        const bool prio = (attrs[tx] & 0x80) && is_cgb;
+        for (int i = x0; i < x0 + TileData::TILE_W; i++)
         {
-            // window on can be under sprites
-            if (window && scan_x >= window_x() - 7)
-            {
-                const int wpx = scan_x - window_x() + 7;
-                const int wpy = scan_y - window_y();
-                // draw window pixel
-                const int wtile = wtd.tile_id(wpx / 8, wpy / 8);
-                const int wattr = wtd.tile_attr(wpx / 8, wpy / 8);
-                const int widx = wtd.pattern(wtile, wattr, wpx & 7, wpy & 7);
-                color = this->colorize_tile(tileconf, wattr, widx);
-            }
+            line_color[i] = this->colorize_tile(tileconf, attrs[tx], line_tile[i]);
+            line_prio[i] = prio;
+        }
+    }
+    const uint8_t* tile_color = &line_tile[scroll_x & 7];
+    uint16_t* color = &line_color[scroll_x & 7];
+    const bool* bg_prio = &line_prio[scroll_x & 7];
 
-            // render sprites within this x
-            sprconf.scan_x = scan_x;
-            for (const auto* sprite : sprites)
-            {
-                const uint8_t idx = sprite->pixel(sprconf);
-                if (idx != 0)
-                {
-                    if (!sprite->behind() || tile_color == 0) {
-						color = this->colorize_sprite(sprite, sprconf, idx);
-					}
-                }
-            }
-        } // BG priority
-        m_pixels.at(scan_y * SCREEN_W + scan_x) = color;
-    } // x
+    // window on can be under sprites
+    if (window)
+    {
+        const int wpy = scan_y - window_y();
+        // screen position of the first window pixel
+        const int wx0 = window_x() - 7;
+        const int wtiles = (SCREEN_W - wx0 + TileData::TILE_W - 1) / TileData::TILE_W;
+        std::array<uint8_t, LINE_W> row;
+        for (int wtx = 0; wtx < wtiles; wtx++)
+        {
+            attrs[wtx] = wtd.tile_attr(wtx, wpy / 8);
+            const int tid = tile_base + wtd.tile_id(wtx, wpy / 8);
+            std::memcpy(&row[wtx * TileData::TILE_W], decoded_row(tid, attrs[wtx], wpy & 7),
+                        TileData::TILE_W);
+        }
+        for (int i = std::max(0, -wx0); i < wtiles * TileData::TILE_W; i++)
+        {
+            const int scan_x = wx0 + i;
+            if (scan_x >= SCREEN_W) break;
+            if (bg_prio[scan_x]) continue;
+            color[scan_x] = this->colorize_tile(tileconf, attrs[i / TileData::TILE_W], row[i]);
+        }
+    }
+
+    // render sprites within this x
+    // composite each sprite row once, in drawing order
+    for (const Sprite* sprite : sprites)
+    {
+        const uint8_t* row = this->sprite_row(sprconf, sprite);
+        const int x0 = sprite->start_x();
+        const int tx_end = std::min(Sprite::SPRITE_W, SCREEN_W - x0);
+        for (int tx = std::max(0, -x0); tx < tx_end; tx++)
+        {
+            const int scan_x = x0 + tx;
+            if (row[tx] == 0 || bg_prio[scan_x]) continue;
+            if (!sprite->behind() || tile_color[scan_x] == 0)
+            { color[scan_x] = this->colorize_sprite(sprite, sprconf, row[tx]); }
+        }
+    }
+    std::copy(color, color + SCREEN_W, &m_pixels.at(scan_y * SCREEN_W));
 } // render_to(...)
 
+const uint8_t* GPU::decoded_row(int tile, int tattr, int ty)
+{
+    const int slot = ((tattr & 0x08) ? TILE_COUNT : 0) + tile;
+    if (UNLIKELY(!m_tile_valid[slot])) this->decode_tile(slot);
+    if (tattr & 0x40) ty = 7 - ty;
+    return &m_tile_cache[slot * 128 + ((tattr & 0x20) ? 64 : 0) + ty * 8];
+}
+const uint8_t* GPU::sprite_row(const sprite_config_t& config, const Sprite* sprite)
+{
+    int ty = config.scan_y - sprite->start_y();
+    if (sprite->flipy()) ty = config.height - 1 - ty;
+    // 8x16 sprites continue into the next tile
+    const int tile = sprite->pattern_idx() + ty / 8;
+    int tattr = sprite->flipx() ? 0x20 : 0x0;
+    if (config.is_cgb && sprite->cgb_bank()) tattr |= 0x08;
+    return this->decoded_row(tile, tattr, ty & 7);
+}
+void GPU::decode_tile(int slot)
+{
+    // headless machines never need the cache
+    if (m_tile_cache.empty()) m_tile_cache.resize(2 * TILE_COUNT * 2 * 64);
+    const int bank = slot / TILE_COUNT;
+    const int offset = bank * 0x2000 + (slot % TILE_COUNT) * 16;
+    const uint8_t* src = memory().video_ram().page(offset >> PagedRAM::PAGE_SHIFT);
+    src += offset & (PagedRAM::PAGE_SIZE - 1);
+    std::array<uint8_t, 16> flipped;
+    for (size_t i = 0; i < flipped.size(); i++) flipped[i] = TILEROW_FLIP[src[i]];
+    expand_tile_rows(src, TileData::TILE_H, &m_tile_cache[slot * 128]);
+    expand_tile_rows(flipped.data(), TileData::TILE_H, &m_tile_cache[slot * 128 + 64]);
+    m_tile_valid[slot] = true;
+}
+void GPU::invalidate_tile(uint16_t vram_offset) noexcept
+{
+    const int offset = vram_offset & 0x1FFF;
+    if (offset < TILE_COUNT * 16)
+    { m_tile_valid[(vram_offset >> 13) * TILE_COUNT + offset / 16] = false; }
+}
+void GPU::invalidate_tiles() noexcept { m_tile_valid = {}; }
+
 uint16_t GPU::colorize_tile(const tileconf_t& conf, const uint8_t attr, const uint8_t idx)
 {
     size_t index = 0;
@@ -270,32 +417,35 @@ uint16_t GPU::tile_data() const noexcept { return (m_reg_lcdc & 0x10) ? 0x8000 :
 TileData GPU::create_tiledata(uint16_t tiles, uint16_t patterns)
 {
     const bool is_signed = (m_reg_lcdc & 0x10) == 0;
-    const auto* vram = memory().video_ram_ptr();
+    const auto& vram = memory().video_ram();
     // printf("Background tiles: 0x%04x  Tile data: 0x%04x\n",
     //        bg_tiles(), tile_data());
-    const auto* tile_base = &vram[tiles - 0x8000];
-    const auto* patt_base = &vram[patterns - 0x8000];
+    // a tile map never crosses a page
+    auto map_base = [&vram](const int offset) {
+        return vram.page(offset >> PagedRAM::PAGE_SHIFT) + (offset & (PagedRAM::PAGE_SIZE - 1));
+    };
+    const auto* tile_base = map_base(tiles - 0x8000);
     const uint8_t* attr_base = nullptr;
     if (machine().is_cgb())
     {
         // attributes are always in VRAM bank 1 (which is off=0x2000)
-        attr_base = &vram[tiles - 0x8000 + 0x2000];
+        attr_base = map_base(tiles - 0x8000 + 0x2000);
     }
-    return TileData{tile_base, patt_base, attr_base, is_signed};
+    return TileData{tile_base, vram, uint16_t(patterns - 0x8000), attr_base, is_signed};
 }
 tileconf_t GPU::tile_config()
 {
     return tileconf_t{
         .is_cgb = machine().is_cgb(),
-        .dmg_pal = memory().read8(IO::REG_BGP),
+        .dmg_pal = io().reg(IO::REG_BGP),
     };
 }
 sprite_config_t GPU::sprite_config()
 {
     sprite_config_t config;
-    config.patterns = memory().video_ram_ptr();
-    config.palette[0] = memory().read8(IO::REG_OBP0);
-    config.palette[1] = memory().read8(IO::REG_OBP1);
+    config.patterns = &memory().video_ram();
+    config.palette[0] = io().reg(IO::REG_OBP0);
+    config.palette[1] = io().reg(IO::REG_OBP1);
     config.scan_x = 0;
     config.scan_y = 0;
     config.set_height(m_reg_lcdc & 0x4);
@@ -303,44 +453,61 @@ sprite_config_t GPU::sprite_config()
     return config;
 }
 
-std::vector<const Sprite*> GPU::find_sprites(const sprite_config_t& config) const
+sprite_list_t GPU::find_sprites(const sprite_config_t& config)
 {
-    const Sprite* sprite_begin = this->sprites_begin();
-    const Sprite* sprite_back = this->sprites_end() - 1;
-    std::vector<const Sprite*> results;
+    if (m_sprites_dirty || m_sprite_height != config.height) this->bin_sprites(config.height);
+    sprite_list_t results;
+    if (config.scan_y < 0 || config.scan_y >= SCREEN_H) return results;
     // draw sprites from right to left
-    for (const Sprite* sprite = sprite_back; sprite >= sprite_begin; sprite--)
+    uint64_t bins = m_sprite_bins[config.scan_y];
+    while (bins != 0 && !results.full())
     {
-        if (sprite->hidden() == false)
-            if (sprite->is_within_scanline(config))
-            {
-                results.push_back(sprite);
-                // GB/GBC supports 10 sprites max per scanline
-                if (results.size() == 10) break;
-            }
+        const int idx = 63 - __builtin_clzll(bins);
+        results.push_back(&this->sprites_begin()[idx]);
+        bins &= ~(1ull << idx);
     }
     return results;
 }
+void GPU::bin_sprites(const int height)
+{
+    m_sprite_bins = {};
+    for (int idx = 0; idx < 40; idx++)
+    {
+        const Sprite& sprite = this->sprites_begin()[idx];
+        if (sprite.hidden()) continue;
+        const int y0 = std::max(0, sprite.start_y());
+        const int y1 = std::min(SCREEN_H, sprite.start_y() + height);
+        for (int y = y0; y < y1; y++) m_sprite_bins[y] |= 1ull << idx;
+    }
+    m_sprite_height = height;
+    m_sprites_dirty = false;
+}
 const Sprite* GPU::sprites_begin() const noexcept { return &((Sprite*) memory().oam_ram_ptr())[0]; }
 const Sprite* GPU::sprites_end() const noexcept { return &((Sprite*) memory().oam_ram_ptr())[40]; }
 
-std::vector<uint16_t> GPU::dump_background()
+std::vector<uint16_t> GPU::dump_background() { return this->dump_tilemap(bg_tiles()); }
+std::vector<uint16_t> GPU::dump_window() { return this->dump_tilemap(window_tiles()); }
+std::vector<uint16_t> GPU::dump_tilemap(uint16_t tiles)
 {
     std::vector<uint16_t> data(256 * 256);
     // create tiledata object from LCDC register
-    auto td = this->create_tiledata(bg_tiles(), tile_data());
+    auto td = this->create_tiledata(tiles, tile_data());
     auto tconf = this->tile_config();
+    std::array<uint8_t, 2 * 32> planes;
+    std::array<uint8_t, 32> attrs;
+    std::array<uint8_t, 256> row;
 
     for (int y = 0; y < 256; y++)
-        for (int x = 0; x < 256; x++)
+    {
+        for (int tx = 0; tx < 32; tx++)
         {
-            // get the tile id
-            const int tid = td.tile_id(x >> 3, y >> 3);
-            const int tattr = td.tile_attr(x >> 3, y >> 3);
-            // copy the 16-byte tile into buffer
-            const int idx = td.pattern(tid, tattr, x & 7, y & 7);
-            data.at(y * 256 + x) = this->colorize_tile(tconf, tattr, idx);
+            attrs[tx] = td.tile_attr(tx, y >> 3);
+            td.pattern_planes(td.tile_id(tx, y >> 3), attrs[tx], y & 7, &planes[tx * 2]);
         }
+        expand_tile_rows(planes.data(), 32, row.data());
+        for (int x = 0; x < 256; x++)
+            data[y * 256 + x] = this->colorize_tile(tconf, attrs[x >> 3], row[x]);
+    }
     return data;
 }
 std::vector<uint16_t> GPU::dump_tiles(int bank)
@@ -350,22 +517,25 @@ std::vector<uint16_t> GPU::dump_tiles(int bank)
     auto td = this->create_tiledata(0x8000, 0x8000);
     auto tconf = this->tile_config();
     const uint8_t attr = (bank == 0) ? 0x00 : 0x08;
+    std::array<uint8_t, 2 * 16> planes;
+    std::array<uint8_t, 128> row;
 
     for (int y = 0; y < 24 * 8; y++)
-        for (int x = 0; x < 16 * 8; x++)
-        {
-            int tile = (y / 8) * 16 + (x / 8);
-            // copy the 16-byte tile into buffer
-            const int idx = td.pattern(tile, attr, x & 7, y & 7);
-            data.at(y * 128 + x) = this->colorize_tile(tconf, attr, idx);
-        }
+    {
+        for (int tx = 0; tx < 16; tx++)
+            td.pattern_planes((y / 8) * 16 + tx, attr, y & 7, &planes[tx * 2]);
+        expand_tile_rows(planes.data(), 16, row.data());
+        for (int x = 0; x < 128; x++) data[y * 128 + x] = this->colorize_tile(tconf, attr, row[x]);
+    }
     return data;
 }
 
 void GPU::set_video_bank(const uint8_t bank)
 {
     assert(bank < 2);
+    GBC_STAT(machine().counters().vram_bank_switches++);
     this->m_state.video_offset = bank * 0x2000;
+    memory().remap_video_ram();
 }
 void GPU::lcd_power_changed(const bool online)
 {
@@ -408,13 +578,47 @@ void GPU::setpal(uint16_t index, uint8_t value)
 void GPU::set_dmg_variant(dmg_variant_t variant) { this->m_variant = variant; }
 
 // serialization
-int GPU::restore_state(const std::vector<uint8_t>& data, int off)
+void GPU::load_state(const StateView& view, state_t& state) const
+{
+    auto in = view.chunk(make_tag("GPU "));
+    in.get(state.period);
+    in.get(state.frame_count);
+    in.get(state.current_scanline);
+    in.get(state.video_offset);
+    in.get(state.white_frame);
+    in.get(state.cgb_palette.data(), state.cgb_palette.size());
+    if (state.current_scanline < 0 || state.current_scanline >= 154)
+        throw MachineException("Save state scanline is out of range");
+    // a bank is mapped as two whole pages
+    if (state.video_offset % 0x2000 != 0 ||
+        state.video_offset + 0x2000u > memory().video_ram().size())
+        throw MachineException("Save state video bank is out of range");
+}
+void GPU::validate_state(const StateView& view) const
+{
+    state_t state;
+    this->load_state(view, state);
+}
+void GPU::restore_state(const StateView& view)
 {
-    this->m_state = *(state_t*) &data.at(off);
-    return sizeof(m_state);
+    state_t state = m_state;
+    this->load_state(view, state);
+    this->m_state = state;
+    // video bank and STAT mode (in I/O) have been restored
+    memory().remap_video_ram();
+    // and so has video RAM and OAM
+    this->invalidate_tiles();
+    this->invalidate_sprites();
 }
-void GPU::serialize_state(std::vector<uint8_t>& res) const
+void GPU::serialize_state(StateWriter& out) const
 {
-    res.insert(res.end(), (uint8_t*) &m_state, (uint8_t*) &m_state + sizeof(m_state));
+    out.begin(make_tag("GPU "), 1);
+    out.put(m_state.period);
+    out.put(m_state.frame_count);
+    out.put(m_state.current_scanline);
+    out.put(m_state.video_offset);
+    out.put(m_state.white_frame);
+    out.put(m_state.cgb_palette.data(), m_state.cgb_palette.size());
+    out.end();
 }
 } // namespace gbc
@@ -24,7 +24,11 @@ public:
 
     GPU(Machine&) noexcept;
     void reset() noexcept;
-    void simulate();
+    // advance by T-cycles, with no event happening before the last tick
+    void simulate(uint64_t cycles);
+    uint64_t cycles_until_event() const noexcept;
+    // cycles from the last sync until the next mode or scanline change
+    uint64_t cycles_until_boundary() const noexcept;
     // the vector is resized to exactly fit the screen
     const auto& pixels() const noexcept { return m_pixels; }
     // trap on palette changes
@@ -40,12 +44,18 @@ public:
 	static uint32_t color15_to_rgba32(uint16_t color15);
     // enable / disable scanline rendering
     void scanline_rendering(bool en) noexcept { this->m_render = en; }
+    bool is_rendering() const noexcept { return this->m_render; }
+    // no video: only catch up on what the CPU can observe (LY, STAT, interrupts)
+    void set_headless(bool en);
+    bool is_headless() const noexcept { return this->m_headless; }
     // render whole frame now (NOTE: changes are often made mid-frame!)
     void render_frame();
 
     bool is_vblank() const noexcept;
     bool is_hblank() const noexcept;
     int current_scanline() const noexcept { return m_state.current_scanline; }
+    // T-cycles per frame at the current speed
+    uint64_t frame_cycles() const noexcept;
     uint64_t frame_count() const noexcept { return m_state.frame_count; }
 
     void set_mode(uint8_t mode);
@@ -53,6 +63,11 @@ public:
 
     uint16_t video_offset() const noexcept { return m_state.video_offset; }
     void set_video_bank(uint8_t bank);
+    // decoded tile cache, invalidated by writes to tile data
+    void invalidate_tile(uint16_t vram_offset) noexcept;
+    void invalidate_tiles() noexcept;
+    // sprites are re-binned by scanline after OAM changes
+    void invalidate_sprites() noexcept { m_sprites_dirty = true; }
     void lcd_power_changed(bool state);
 
     bool lcd_enabled() const noexcept;
@@ -68,8 +83,10 @@ public:
     uint8_t getpal(uint16_t index) const { return m_state.cgb_palette.at(index); }
 
     // serialization
-    int restore_state(const std::vector<uint8_t>&, int);
-    void serialize_state(std::vector<uint8_t>&) const;
+    // throws what restore_state() would, without changing anything
+    void validate_state(const StateView&) const;
+    void restore_state(const StateView&);
+    void serialize_state(StateWriter&) const;
 
     Machine& machine() noexcept { return m_memory.machine(); }
     Memory& memory() noexcept { return m_memory; }
@@ -83,16 +100,24 @@ public:
     const Sprite* sprites_end() const noexcept;
 
 private:
+    // 154 scanlines, and then LY 0 once more in V-blank
+    static const int FRAME_LINES = 155;
     uint64_t scanline_cycles() const noexcept;
     uint64_t oam_cycles() const noexcept;
     uint64_t vram_cycles() const noexcept;
     uint64_t hblank_cycles() const noexcept;
+    void simulate_boundary(uint64_t cycles);
     void render_scanline(int y);
     void do_ly_comparison();
     TileData create_tiledata(uint16_t tiles, uint16_t patt);
+    std::vector<uint16_t> dump_tilemap(uint16_t tiles);
+    const uint8_t* decoded_row(int tile, int tattr, int ty);
+    const uint8_t* sprite_row(const sprite_config_t&, const Sprite*);
+    void decode_tile(int slot);
     tileconf_t tile_config();
     sprite_config_t sprite_config();
-    std::vector<const Sprite*> find_sprites(const sprite_config_t&) const;
+    sprite_list_t find_sprites(const sprite_config_t&);
+    void bin_sprites(int height);
     uint16_t colorize_tile(const tileconf_t&, uint8_t attr, uint8_t idx);
     uint16_t colorize_sprite(const Sprite*, sprite_config_t&, uint8_t);
     // addresses
@@ -109,6 +134,15 @@ private:
     palchange_func_t m_on_palchange = nullptr;
     dmg_variant_t m_variant = LIGHTER_GREEN;
     bool m_render = true;
+    bool m_headless = false;
+    // 384 tiles per bank, decoded as-is and X-flipped (8x8 indices each)
+    static const int TILE_COUNT = 384;
+    std::vector<uint8_t> m_tile_cache;
+    std::array<bool, 2 * TILE_COUNT> m_tile_valid = {};
+    // one bit per OAM sprite that is on each visible scanline
+    std::array<uint64_t, SCREEN_H> m_sprite_bins = {};
+    int m_sprite_height = 0;
+    bool m_sprites_dirty = true;
 
     struct state_t
     {
@@ -118,8 +152,10 @@ private:
         uint16_t video_offset = 0x0;
         bool white_frame = false;
         // 0-63: tiles 64-127: sprites
-        std::array<uint8_t, 128> cgb_palette;
+        std::array<uint8_t, 128> cgb_palette = {};
     } m_state;
+    // throws on a missing chunk or out-of-range values
+    void load_state(const StateView&, state_t&) const;
 };
 
 inline std::array<uint32_t, 4> GPU::dmg_colors(dmg_variant_t variant)
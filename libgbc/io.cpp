@@ -5,6 +5,8 @@
 
 namespace gbc
 {
+static constexpr std::array<int, 4> TIMA_CYCLES = {1024, 16, 64, 256};
+
 IO::IO(Machine& mach)
     : vblank{0x1, 0x40, "V-blank"}
     , lcd_stat{0x2, 0x48, "LCD Status"}
@@ -27,6 +29,9 @@ void IO::reset()
     // sound defaults
     reg(REG_NR10) = 0x80;
     reg(REG_NR11) = 0xbf;
+    reg(REG_NR12) = 0xf3;
+    reg(REG_NR50) = 0x77;
+    reg(REG_NR51) = 0xf3;
     reg(REG_NR52) = 0xf1;
     // LCD defaults
     reg(REG_LCDC) = 0x91;
@@ -45,55 +50,53 @@ void IO::reset()
     this->m_state.reg_ie = 0x00;
 }
 
-void IO::simulate()
+uint64_t IO::cycles_until_event() const noexcept
 {
-    // 1. DIV timer
-    this->m_state.divider += 256 / 64;
-    this->reg(REG_DIV) = this->m_state.divider >> 8;
-
-    // 2. TIMA timer
+    // HDMA copies on the next tick when in a new H-blank
+    if (this->hdma().bytes_left > 0)
+    {
+        if (m_machine.gpu.is_hblank() && hdma().cur_line != reg(REG_LY)) return 4;
+    }
+    uint64_t next = NO_EVENT;
+    // DMA copies one byte each tick, but the copy is only observable
+    // through OAM, so it only has to be done by the time it ends
+    if (oam_dma().bytes_left > 0) next = 4 * (oam_dma().slow_start + oam_dma().bytes_left);
     if (this->reg(REG_TAC) & 0x4)
     {
-        const std::array<int, 4> TIMA_CYCLES = {1024, 16, 64, 256};
-        const int speed = this->reg(REG_TAC) & 0x3;
-        // TIMA counter timer
-        if (m_state.divider % (TIMA_CYCLES[speed]) == 0)
-        {
-            this->reg(REG_TIMA)++;
-            // if (reg(REG_TIMA) > 16) machine().break_now();
-            // timer interrupt when overflowing to 0
-            if (this->reg(REG_TIMA) == 0)
-            {
-                this->trigger(this->timerint);
-                // BUG: TIMA does not get reset before after 4 cycles
-                this->m_state.timabug = 4;
-            }
-        }
-        else if (UNLIKELY(this->m_state.timabug > 0))
-        {
-            this->m_state.timabug--;
-            if (this->m_state.timabug == 0)
-            {
-                // restart at modulo
-                this->reg(REG_TIMA) = this->reg(REG_TMA);
-            }
-        }
+        if (this->m_state.timabug > 0) return 4;
+        // TIMA is counted in bulk, so only the overflow is an event
+        const uint64_t period = TIMA_CYCLES[this->reg(REG_TAC) & 0x3];
+        const uint64_t tima = period - (m_state.divider % period);
+        next = std::min(next, tima + (0xFF - this->reg(REG_TIMA)) * period);
     }
+    return next;
+}
+
+void IO::simulate(const uint64_t cycles)
+{
+    // 1. DIV timer (the register is derived from it on reads)
+    const uint16_t divider = this->m_state.divider;
+    this->m_state.divider += cycles;
+
+    // 2. TIMA timer
+    if (this->reg(REG_TAC) & 0x4) this->simulate_timer(divider, cycles);
 
     // 3. OAM DMA operation
-    if (this->m_state.dma.bytes_left > 0)
+    if (this->oam_dma().bytes_left > 0)
     {
-        if (this->m_state.dma.slow_start > 0) { this->m_state.dma.slow_start--; }
-        else
+        auto& dma = this->oam_dma();
+        // one byte per tick, after a short delay
+        uint64_t ticks = cycles / 4;
+        const int wait = std::min<uint64_t>(ticks, dma.slow_start);
+        dma.slow_start -= wait;
+        ticks -= wait;
+        const int btw = std::min<uint64_t>(ticks, dma.bytes_left);
+        if (btw > 0)
         {
-            // calculate number of bytes to copy
-            const int btw = 1;
-            // do the copying
-            auto& memory = machine().memory;
-            for (int i = 0; i < btw; i++)
-            { memory.write8(m_state.dma.dst++, memory.read8(m_state.dma.src++)); }
-            assert(m_state.dma.bytes_left >= btw);
-            m_state.dma.bytes_left -= btw;
+            machine().memory.dma_to_oam(dma.src, dma.dst - Memory::OAM_RAM.first, btw);
+            dma.src += btw;
+            dma.dst += btw;
+            dma.bytes_left -= btw;
         }
     }
 
@@ -104,11 +107,10 @@ void IO::simulate()
         if (machine().gpu.is_hblank() && hdma().cur_line != reg(REG_LY))
         {
             hdma().cur_line = reg(REG_LY);
-            auto& memory = machine().memory;
             int btw = std::min(16, hdma().bytes_left);
-            // do the copying
-            for (int i = 0; i < btw; i++)
-            { memory.write8(hdma().dst++, memory.read8(hdma().src++)); }
+            machine().memory.dma_to_vram(hdma().src, hdma().dst, btw);
+            hdma().src += btw;
+            hdma().dst += btw;
             hdma().dst &= 0x9FFF; // make sure it wraps around VRAM
             assert(hdma().bytes_left >= btw);
             hdma().bytes_left -= btw;
@@ -121,6 +123,38 @@ void IO::simulate()
     }
 }
 
+void IO::simulate_timer(uint16_t divider, uint64_t cycles)
+{
+    const unsigned period = TIMA_CYCLES[this->reg(REG_TAC) & 0x3];
+    // the reload after an overflow is delayed, one tick at a time
+    while (UNLIKELY(m_state.timabug > 0) && cycles >= 4)
+    {
+        divider += 4;
+        cycles -= 4;
+        if (divider % period == 0)
+        {
+            if (++this->reg(REG_TIMA) == 0) this->timer_overflow();
+        }
+        else if (--this->m_state.timabug == 0)
+        {
+            // restart at modulo
+            this->reg(REG_TIMA) = this->reg(REG_TMA);
+        }
+    }
+    // every increment up to the overflow at once, as the overflow is an event
+    const uint64_t increments = (divider % period + cycles) / period;
+    const uint64_t tima = this->reg(REG_TIMA) + increments;
+    this->reg(REG_TIMA) = tima;
+    if (tima > 0xFF) this->timer_overflow();
+}
+void IO::timer_overflow()
+{
+    // timer interrupt when overflowing to 0
+    this->trigger(this->timerint);
+    // BUG: TIMA does not get reset before after 4 cycles
+    this->m_state.timabug = 4;
+}
+
 uint8_t IO::read_io(const uint16_t addr)
 {
     // default: just return the register value
@@ -218,17 +252,68 @@ void IO::deactivate_stop()
 
 void IO::reset_divider()
 {
+    machine().apu.reset_divider();
     this->m_state.divider = 0;
-    this->reg(REG_DIV) = 0;
 }
 
-int IO::restore_state(const std::vector<uint8_t>& data, int off)
+void IO::load_state(const StateView& view, state_t& state) const
+{
+    auto in = view.chunk(make_tag("IO  "));
+    in.get(state.ioregs.data(), state.ioregs.size());
+    in.get(state.joypad.ioswitch);
+    in.get(state.joypad.keypad);
+    in.get(state.joypad.buttons);
+    in.get(state.joypad.last_mask);
+    in.get(state.divider);
+    in.get(state.timabug);
+    in.get(state.lcd_powered);
+    in.get(state.reg_ie);
+    for (dma_t* dma : {&state.dma, &state.hdma})
+    {
+        in.get(dma->cur_line);
+        in.get(dma->slow_start);
+        in.get(dma->src);
+        in.get(dma->dst);
+        in.get(dma->bytes_left);
+    }
+    // OAM DMA copies the rest of its bytes straight into OAM
+    const auto& dma = state.dma;
+    if (dma.bytes_left > 0 &&
+        (!Memory::is_within(dma.dst, Memory::OAM_RAM) ||
+         dma.dst + dma.bytes_left > Memory::OAM_RAM.second + 1))
+        throw MachineException("Save state OAM DMA is out of range");
+}
+void IO::validate_state(const StateView& view) const
 {
-    this->m_state = *(state_t*) &data.at(off);
-    return sizeof(m_state);
+    state_t state;
+    this->load_state(view, state);
 }
-void IO::serialize_state(std::vector<uint8_t>& res) const
+void IO::restore_state(const StateView& view)
 {
-    res.insert(res.end(), (uint8_t*) &m_state, (uint8_t*) &m_state + sizeof(m_state));
+    state_t state = m_state;
+    this->load_state(view, state);
+    this->m_state = state;
+}
+void IO::serialize_state(StateWriter& out) const
+{
+    out.begin(make_tag("IO  "), 1);
+    out.put(m_state.ioregs.data(), m_state.ioregs.size());
+    out.put(m_state.joypad.ioswitch);
+    out.put(m_state.joypad.keypad);
+    out.put(m_state.joypad.buttons);
+    out.put(m_state.joypad.last_mask);
+    out.put(m_state.divider);
+    out.put(m_state.timabug);
+    out.put(m_state.lcd_powered);
+    out.put(m_state.reg_ie);
+    for (const dma_t* dma : {&m_state.dma, &m_state.hdma})
+    {
+        out.put(dma->cur_line);
+        out.put(dma->slow_start);
+        out.put(dma->src);
+        out.put(dma->dst);
+        out.put(dma->bytes_left);
+    }
+    out.end();
 }
 } // namespace gbc
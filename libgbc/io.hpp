@@ -97,11 +97,15 @@ public:
     void perform_stop();
     void deactivate_stop();
     void reset_divider();
+    // the 16-bit counter that DIV is the upper half of
+    uint16_t divider() const noexcept { return m_state.divider; }
 
     Machine& machine() noexcept { return m_machine; }
 
     void reset();
-    void simulate();
+    // advance by T-cycles, with no event happening before the last tick
+    void simulate(uint64_t cycles);
+    uint64_t cycles_until_event() const noexcept;
 
     inline uint8_t& reg(const uint16_t addr) { return m_state.ioregs[addr & 0x7f]; }
     inline const uint8_t& reg(const uint16_t addr) const { return m_state.ioregs[addr & 0x7f]; }
@@ -130,16 +134,18 @@ public:
     interrupt_t debugint;
 
     // serialization
-    int restore_state(const std::vector<uint8_t>&, int);
-    void serialize_state(std::vector<uint8_t>&) const;
+    // throws what restore_state() would, without changing anything
+    void validate_state(const StateView&) const;
+    void restore_state(const StateView&);
+    void serialize_state(StateWriter&) const;
 
 private:
     struct dma_t
     {
-        uint64_t cur_line;
+        uint64_t cur_line = 0;
         int8_t slow_start = 0;
-        uint16_t src;
-        uint16_t dst;
+        uint16_t src = 0;
+        uint16_t dst = 0;
         int32_t bytes_left = 0;
     };
     const dma_t& oam_dma() const noexcept { return m_state.dma; }
@@ -147,6 +153,9 @@ private:
     const dma_t& hdma() const noexcept { return m_state.hdma; }
     dma_t& hdma() noexcept { return m_state.hdma; }
 
+    void simulate_timer(uint16_t divider, uint64_t cycles);
+    void timer_overflow();
+
     Machine& m_machine;
     struct state_t
     {
@@ -161,6 +170,8 @@ private:
         dma_t dma;
         dma_t hdma;
     } m_state;
+    // throws on a missing chunk or out-of-range values
+    void load_state(const StateView&, state_t&) const;
 
     joypad_read_handler_t m_jp_handler = nullptr;
 };
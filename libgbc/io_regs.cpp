@@ -38,7 +38,7 @@ void iowrite_DIV(IO& io, uint16_t, uint8_t)
     // writing to DIV resets it to 0
     io.reset_divider();
 }
-uint8_t ioread_DIV(IO& io, uint16_t) { return io.reg(IO::REG_DIV); }
+uint8_t ioread_DIV(IO& io, uint16_t) { return io.divider() >> 8; }
 
 void iowrite_LCDC(IO& io, uint16_t addr, uint8_t value)
 {
@@ -107,8 +107,7 @@ void iowrite_HDMA(IO& io, uint16_t addr, uint8_t value)
             // do the transfer immediately
             // printf("HDMA transfer 0x%04x to 0x%04x (%u bytes)\n", src, dst, end - src);
             const uint16_t end = src + num_bytes;
-            auto& mem = io.machine().memory;
-            while (src < end) mem.write8(dst++, mem.read8(src++));
+            if (src < end) io.machine().memory.dma_to_vram(src, dst, num_bytes);
             // transfer complete
             io.reg(IO::REG_HDMA5) = 0xFF;
         }
@@ -217,7 +216,8 @@ __attribute__((constructor)) static void set_io_handlers()
     IOHANDLER(IO::REG_LCDC, LCDC);
     IOHANDLER(IO::REG_STAT, STAT);
     IOHANDLER(IO::REG_DMA, DMA);
-    IOHANDLER(IO::REG_NR52, AUDIO);
+    // sound registers and wave RAM
+    for (uint16_t addr = IO::REG_NR10; addr <= IO::REG_WAVF; addr++) IOHANDLER(addr, AUDIO);
     // CGB registers
     IOHANDLER(IO::REG_KEY1, KEY1);
     IOHANDLER(IO::REG_VBK, VBK);
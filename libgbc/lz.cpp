@@ -0,0 +1,125 @@
+#include "lz.hpp"
+#include "common.hpp"
+#include <array>
+#include <cstring>
+
+namespace gbc
+{
+static constexpr int HASH_BITS = 13;
+static constexpr size_t MIN_MATCH = 4;
+// the end of the input is always literals, so that matches can be extended
+// without checking for the end of the input on every byte
+static constexpr size_t LAST_LITERALS = 5;
+static constexpr size_t MAX_OFFSET = 0xFFFF;
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+static inline uint32_t hash32(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+static void put_length(std::vector<uint8_t>& dst, size_t len)
+{
+    for (; len >= 255; len -= 255) dst.push_back(255);
+    dst.push_back(len);
+}
+static void put_sequence(std::vector<uint8_t>& dst, const uint8_t* lit, size_t litlen,
+                         size_t offset, size_t mlen)
+{
+    const size_t mcode = (mlen > 0) ? mlen - MIN_MATCH : 0;
+    dst.push_back(((litlen < 15) ? litlen : 15) << 4 | ((mcode < 15) ? mcode : 15));
+    if (litlen >= 15) put_length(dst, litlen - 15);
+    dst.insert(dst.end(), lit, lit + litlen);
+    // the last sequence has no match
+    if (mlen == 0) return;
+    dst.push_back(offset & 0xFF);
+    dst.push_back(offset >> 8);
+    if (mcode >= 15) put_length(dst, mcode - 15);
+}
+
+size_t lz_compress(const uint8_t* src, size_t len, std::vector<uint8_t>& dst)
+{
+    const size_t begin = dst.size();
+    // worst case is one token and length bytes for incompressible data
+    dst.reserve(begin + len + len / 255 + 16);
+    std::array<uint32_t, 1 << HASH_BITS> table = {};
+
+    size_t anchor = 0;
+    size_t ip = 1;
+    const size_t limit = (len > MIN_MATCH + LAST_LITERALS) ? len - MIN_MATCH - LAST_LITERALS : 0;
+    size_t misses = 0;
+    while (ip < limit)
+    {
+        const uint32_t v = read32(&src[ip]);
+        const uint32_t h = hash32(v);
+        const size_t ref = table[h];
+        table[h] = ip;
+        if (ip - ref > MAX_OFFSET || read32(&src[ref]) != v)
+        {
+            // skip faster through data that does not compress
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+        size_t mlen = MIN_MATCH;
+        while (ip + mlen < len - LAST_LITERALS && src[ref + mlen] == src[ip + mlen]) mlen++;
+
+        put_sequence(dst, &src[anchor], ip - anchor, ip - ref, mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+    put_sequence(dst, &src[anchor], len - anchor, 0, 0);
+    return dst.size() - begin;
+}
+
+static size_t get_length(const uint8_t*& ip, const uint8_t* end)
+{
+    size_t len = 0;
+    uint8_t b;
+    do
+    {
+        if (UNLIKELY(ip >= end)) throw MachineException("Compressed data is truncated");
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+void lz_decompress(const uint8_t* src, size_t clen, uint8_t* dst, size_t len)
+{
+    const uint8_t* ip = src;
+    const uint8_t* const end = src + clen;
+    size_t op = 0;
+    while (ip < end)
+    {
+        const uint8_t token = *ip++;
+        size_t litlen = token >> 4;
+        if (litlen == 15) litlen += get_length(ip, end);
+        if (UNLIKELY(litlen > size_t(end - ip) || litlen > len - op))
+            throw MachineException("Compressed literals are out of bounds");
+        // an empty input has no literals, and maybe no destination either
+        if (litlen > 0) std::memcpy(&dst[op], ip, litlen);
+        ip += litlen;
+        op += litlen;
+        if (ip == end) break;
+
+        if (UNLIKELY(end - ip < 2)) throw MachineException("Compressed data is truncated");
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = (token & 0xF) + MIN_MATCH;
+        if ((token & 0xF) == 15) mlen += get_length(ip, end);
+        if (UNLIKELY(offset == 0 || offset > op || mlen > len - op))
+            throw MachineException("Compressed match is out of bounds");
+        // matches can overlap themselves, which repeats the pattern
+        const uint8_t* match = &dst[op - offset];
+        if (offset >= mlen)
+            std::memcpy(&dst[op], match, mlen);
+        else
+            for (size_t i = 0; i < mlen; i++) dst[op + i] = match[i];
+        op += mlen;
+    }
+    if (UNLIKELY(op != len)) throw MachineException("Compressed data has the wrong size");
+}
+} // namespace gbc
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gbc
+{
+// byte-oriented LZ77 in the same block layout as LZ4: sequences of a token
+// (literal and match lengths), the literals and a 16-bit match offset
+// compression is a single greedy pass, which is plenty for machine state
+// that is mostly zero-filled and repeated tiles
+
+// appends the compressed data, returns its size
+size_t lz_compress(const uint8_t* src, size_t len, std::vector<uint8_t>& dst);
+// throws a MachineException when the data does not decompress to exactly len bytes
+void lz_decompress(const uint8_t* src, size_t clen, uint8_t* dst, size_t len);
+} // namespace gbc
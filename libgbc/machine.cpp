@@ -3,13 +3,18 @@
 namespace gbc
 {
 Machine::Machine(const std::vector<uint8_t>& rom, bool init)
-    : cpu(*this), memory(*this, rom), io(*this), gpu(*this), apu(*this)
+    : Machine(std::make_shared<const ROM>(rom.data(), rom.size()), init)
+{}
+Machine::Machine(std::shared_ptr<const ROM> rom, bool init)
+    : cpu(*this), memory(*this, std::move(rom)), io(*this), gpu(*this), apu(*this)
 {
     // set CGB mode when ROM supports it
-    const uint8_t cgb = memory.read8(0x143);
+    const uint8_t cgb = memory.rom().header().cgb_flag;
     this->m_cgb_mode = (cgb & 0x80) && ENABLE_GBC;
     // reset CPU now that we know the machine type
     if (init) this->cpu.reset();
+    // nothing has been written yet
+    this->m_delta_base = this->state_hash();
 }
 
 void Machine::reset()
@@ -18,14 +23,46 @@ void Machine::reset()
     memory.reset();
     io.reset();
     gpu.reset();
+    apu.reset();
+}
+void Machine::stop() noexcept
+{
+    this->m_running = false;
+    cpu.exit_run();
 }
-void Machine::stop() noexcept { this->m_running = false; }
 
-void Machine::simulate_one_frame()
+Machine::run_result_t Machine::run_for_cycles(const uint64_t cycles)
 {
-    while (gpu.current_scanline() != 0) { cpu.simulate(); }
-    while (gpu.current_scanline() != 144) { cpu.simulate(); }
-    assert(gpu.is_vblank());
+    const uint64_t end = now() + cycles;
+    while (now() < end && this->is_running()) { cpu.run_until(end); }
+    return (this->is_running()) ? RUN_BUDGET : RUN_STOPPED;
+}
+Machine::run_result_t Machine::run_until_vblank(const uint64_t max_cycles)
+{
+    const uint64_t end = now() + max_cycles;
+    while (now() < end && this->is_running())
+    {
+        cpu.run_until(end);
+        // the GPU ends the run when V-blank starts
+        if (cpu.run_exited() && this->is_running())
+        {
+            apu.flush();
+            return RUN_VBLANK;
+        }
+    }
+    return (this->is_running()) ? RUN_BUDGET : RUN_STOPPED;
+}
+Machine::run_result_t Machine::run_frames(const int frames)
+{
+    run_result_t result = RUN_BUDGET;
+    for (int i = 0; i < frames; i++)
+    {
+        // the next V-blank is at most a frame away (unless the LCD turns off)
+        const uint64_t budget = gpu.frame_cycles() * (gpu.lcd_enabled() ? 2 : 1);
+        result = this->run_until_vblank(budget);
+        if (result == RUN_STOPPED) break;
+    }
+    return result;
 }
 
 uint64_t Machine::now() noexcept { return cpu.gettime(); }
@@ -53,22 +90,125 @@ void Machine::set_inputs(uint8_t mask) { io.trigger_keys(mask); }
 
 size_t Machine::restore_state(const std::vector<uint8_t>& data)
 {
-    int offset = 0;
-    offset += cpu.restore_state(data, offset);
-    offset += memory.restore_state(data, offset);
-    offset += io.restore_state(data, offset);
-    offset += gpu.restore_state(data, offset);
-    offset += apu.restore_state(data, offset);
-    return offset;
+    const StateView view(data);
+    this->restore_state(view);
+    return view.size();
+}
+void Machine::restore_state(const StateView& view)
+{
+    if (view.is_delta()) throw MachineException("Save state is a delta");
+    this->restore_components(view);
+}
+size_t Machine::restore_delta(const std::vector<uint8_t>& data)
+{
+    const StateView view(data);
+    this->restore_delta(view);
+    return view.size();
+}
+void Machine::restore_delta(const StateView& view)
+{
+    // a full state is a delta with every page in it
+    if (view.is_delta())
+    {
+        auto in = view.chunk(make_tag("BASE"));
+        if (in.get<uint64_t>() != m_delta_base)
+            throw MachineException("Save state delta is against another state");
+    }
+    this->restore_components(view);
 }
+void Machine::restore_components(const StateView& view)
+{
+    // a state that fails half-way would leave a mix of two machines behind
+    cpu.validate_state(view);
+    memory.validate_state(view);
+    io.validate_state(view);
+    gpu.validate_state(view);
+    apu.validate_state(view);
+    // the GPU relies on I/O and memory being restored first
+    cpu.restore_state(view);
+    memory.restore_state(view);
+    io.restore_state(view);
+    gpu.restore_state(view);
+    apu.restore_state(view);
+    // a stopped machine runs again from the restored state
+    this->m_running = true;
+    // restoring dirtied the pages
+    this->set_delta_base();
+}
+void Machine::restore_chain(const std::vector<uint8_t>& state,
+                            const std::vector<std::vector<uint8_t>>& deltas)
+{
+    this->restore_state(state);
+    for (const auto& delta : deltas) this->restore_delta(delta);
+}
+void Machine::set_delta_base()
+{
+    memory.set_delta_base();
+    this->m_delta_base = this->state_hash();
+}
+uint64_t Machine::state_hash() const
+{
+    std::vector<uint8_t> state;
+    this->serialize_state(state);
+    return savestate_t::hash64(state.data(), state.size());
+}
+
+std::unique_ptr<Machine> Machine::fork()
+{
+    // bring the hardware up to date so that both sides schedule the same events
+    cpu.hardware_sync();
+    auto child = std::make_unique<Machine>(memory.shared_rom(), false);
+    child->memory.fork_from(this->memory);
+    // the rest of the state is small enough to go through serialization
+    std::vector<uint8_t> state;
+    StateWriter out(state);
+    cpu.serialize_state(out);
+    io.serialize_state(out);
+    gpu.serialize_state(out);
+    apu.serialize_state(out);
+    const StateView view(state);
+    child->cpu.restore_state(view);
+    child->io.restore_state(view);
+    child->gpu.restore_state(view);
+    child->apu.restore_state(view);
+    // video settings
+    child->gpu.scanline_rendering(gpu.is_rendering());
+    child->gpu.set_headless(gpu.is_headless());
+    child->set_delta_base();
+    return child;
+}
+
 void Machine::serialize_state(std::vector<uint8_t>& result) const
 {
-    cpu.serialize_state(result);
-    memory.serialize_state(result);
-    io.serialize_state(result);
-    gpu.serialize_state(result);
-    apu.serialize_state(result);
+    StateWriter out(result);
+    cpu.serialize_state(out);
+    memory.serialize_state(out, false);
+    io.serialize_state(out);
+    gpu.serialize_state(out);
+    apu.serialize_state(out);
+}
+void Machine::serialize_delta(std::vector<uint8_t>& result) const
+{
+    StateWriter out(result, savestate_t::FLAG_DELTA);
+    out.begin(make_tag("BASE"), 1);
+    out.put(m_delta_base);
+    out.end();
+    cpu.serialize_state(out);
+    memory.serialize_state(out, true);
+    io.serialize_state(out);
+    gpu.serialize_state(out);
+    apu.serialize_state(out);
+}
+
+Stats Machine::stats() const noexcept
+{
+#ifdef GBC_STATS
+    return m_stats;
+#else
+    return {};
+#endif
 }
+void Machine::reset_stats() noexcept { GBC_STAT(this->m_stats = {}); }
 
 void Machine::break_now() { cpu.break_now(); }
 bool Machine::is_breaking() const noexcept { return cpu.is_breaking(); }
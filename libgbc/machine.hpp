@@ -6,6 +6,9 @@
 #include "interrupt.hpp"
 #include "io.hpp"
 #include "memory.hpp"
+#include "savestate.hpp"
+#include "stats.hpp"
+#include <memory>
 
 namespace gbc
 {
@@ -26,6 +29,8 @@ class Machine
 public:
     // NOTE: machine uses ROM as a const reference
     Machine(const std::vector<uint8_t>& rom, bool init = true);
+    // machines can share a ROM image, eg. one mapped with ROM::map_file()
+    Machine(std::shared_ptr<const ROM> rom, bool init = true);
 
     CPU cpu;
     Memory memory;
@@ -33,8 +38,22 @@ public:
     GPU gpu;
     APU apu;
 
+    // why a run_*() call returned
+    enum run_result_t
+    {
+        RUN_BUDGET,  // the cycle budget was used up
+        RUN_VBLANK,  // V-blank has just started
+        RUN_STOPPED, // the machine was stopped
+    };
+    // execute one instruction
     void simulate();
-    void simulate_one_frame();
+    // run for (at least) the given number of T-cycles
+    run_result_t run_for_cycles(uint64_t cycles);
+    // run until the next V-blank, giving up after max_cycles
+    run_result_t run_until_vblank(uint64_t max_cycles);
+    // run frames, where a frame with the LCD off is just the time it takes
+    run_result_t run_frames(int frames);
+    void simulate_one_frame() { this->run_frames(1); }
     void reset();
     uint64_t now() noexcept;
     bool is_running() const noexcept { return this->m_running; }
@@ -53,9 +72,34 @@ public:
     // use keys_t to form an 8-bit mask
     void set_inputs(uint8_t mask);
 
-    // serialization (state-keeping)
+    // serialization (state-keeping), see savestate.hpp for the format
+    // returns the size of the state, which can be followed by other data
     size_t restore_state(const std::vector<uint8_t>&);
+    // restore from a state validated in place, eg. in an mmap'd file
+    void   restore_state(const StateView&);
     void   serialize_state(std::vector<uint8_t>&) const;
+    // delta states only contain the RAM pages written since the delta base,
+    // which is the last restored state, fork or call to set_delta_base()
+    void   set_delta_base();
+    void   serialize_delta(std::vector<uint8_t>&) const;
+    // must be applied to a machine that is in the base state of the delta,
+    // and throws a MachineException when it is not
+    size_t restore_delta(const std::vector<uint8_t>&);
+    void   restore_delta(const StateView&);
+    // restore a full state followed by a chain of deltas, oldest first
+    void   restore_chain(const std::vector<uint8_t>& state,
+                         const std::vector<std::vector<uint8_t>>& deltas);
+    // clone the machine, sharing RAM pages until either side writes to them
+    // NOTE: callbacks, breakpoints and watchpoints are not cloned
+    std::unique_ptr<Machine> fork();
+
+    // a snapshot of the counters in stats.hpp, which are all zero
+    // unless libgbc is built with STATS=ON (forks start from zero)
+    Stats stats() const noexcept;
+    void reset_stats() noexcept;
+#ifdef GBC_STATS
+    Stats& counters() noexcept { return m_stats; }
+#endif
 
     /// debugging aids ///
     bool verbose_instructions = false;
@@ -71,8 +115,15 @@ public:
     void stop() noexcept;
 
 private:
+    void restore_components(const StateView&);
+    uint64_t state_hash() const;
     bool m_running = true;
+    // identifies the delta base, so that deltas are only applied to it
+    uint64_t m_delta_base = 0;
     bool m_cgb_mode = false;
+#ifdef GBC_STATS
+    Stats m_stats;
+#endif
 };
 
 inline void Machine::simulate() { cpu.simulate(); }
@@ -9,80 +9,25 @@
 
 namespace gbc
 {
-MBC::MBC(Memory& m, const std::vector<uint8_t>& rom) : m_memory(m), m_rom(rom) {}
+MBC::MBC(Memory& m, const ROM& rom) : m_memory(m), m_rom(rom) {}
 
 void MBC::init()
 {
-    this->m_ram.at(0x100) = 0x1;
-    this->m_ram.at(0x101) = 0x3;
-    this->m_ram.at(0x102) = 0x5;
-    this->m_ram.at(0x103) = 0x7;
-    this->m_ram.at(0x104) = 0x9;
+    this->m_ram.write(0x100, 0x1);
+    this->m_ram.write(0x101, 0x3);
+    this->m_ram.write(0x102, 0x5);
+    this->m_ram.write(0x103, 0x7);
+    this->m_ram.write(0x104, 0x9);
     // test ROMs are just instruction arrays
-    if (m_rom.size() < 0x150) return;
-    // parse ROM header
-    switch (m_memory.read8(0x147))
-    {
-    case 0x0:
-    case 0x1: // MBC 1
-    case 0x2:
-    case 0x3:
-        this->m_state.version = 1;
-        break;
-    case 0x5:
-    case 0x6:
-        this->m_state.version = 2;
-        assert(0 && "MBC2 is a weirdo!");
-        break;
-    case 0x0F:
-    case 0x10: // MBC 3
-    case 0x12:
-    case 0x13:
-        this->m_state.version = 3;
-        break;
-    case 0x19:
-    case 0x1A: // MBC 5
-    case 0x1B:
-    case 0x1C:
-        this->m_state.version = 5;
-        this->m_state.rumble = false;
-        break;
-    case 0x1D:
-    case 0x1E:
-        this->m_state.version = 5;
-        this->m_state.rumble = true;
-        break;
-    default:
-        assert(0 && "Unknown cartridge type");
-    }
+    const auto& hdr = m_rom.header();
+    if (!hdr.valid) return;
+    assert(hdr.cartridge_type != 0x5 && hdr.cartridge_type != 0x6 && "MBC2 is a weirdo!");
+    assert(hdr.supported && "Unknown cartridge type");
+    this->m_state.version = hdr.mbc_version;
+    this->m_state.rumble = hdr.rumble;
     // printf("MBC version %u  Rumble: %d\n", this->m_state.version, this->m_state.rumble);
-    switch (m_memory.read8(0x149))
-    {
-    case 0x0:
-        m_state.ram_banks = 0;
-        m_state.ram_bank_size = 0;
-        break;
-    case 0x1: // 2kb
-        m_state.ram_banks = 1;
-        m_state.ram_bank_size = 2048;
-        break;
-    case 0x2: // 8kb
-        m_state.ram_banks = 1;
-        m_state.ram_bank_size = 8192;
-        break;
-    case 0x3: // 32kb
-        m_state.ram_banks = 4;
-        m_state.ram_bank_size = 32768;
-        break;
-    case 0x4: // 128kb
-        m_state.ram_banks = 16;
-        m_state.ram_bank_size = 0x20000;
-        break;
-    case 0x5: // 64kb
-        m_state.ram_banks = 8;
-        m_state.ram_bank_size = 0x10000;
-        break;
-    }
+    m_state.ram_banks = hdr.ram_banks;
+    m_state.ram_bank_size = hdr.ram_bank_size;
     // printf("RAM bank size: 0x%05x\n", m_state.ram_bank_size);
     this->m_state.wram_size = 0x8000;
     // printf("Work RAM bank size: 0x%04x\n", m_state.wram_size);
@@ -100,7 +45,7 @@ uint8_t MBC::read(uint16_t addr)
             {
                 addr -= RAMbankX.first;
                 addr |= this->m_state.ram_bank_offset;
-                if (addr < this->m_state.ram_bank_size) return this->m_ram.at(addr);
+                if (addr < this->m_state.ram_bank_size) return this->m_ram.read(addr);
                 return 0xff; // small 2kb RAM banks
             }
             else
@@ -113,9 +58,9 @@ uint8_t MBC::read(uint16_t addr)
             return 0xff;
         }
     case 0xC000:
-        return this->m_state.wram.at(addr - WRAM_0.first);
+        return this->m_wram.read(addr - WRAM_0.first);
     case 0xD000:
-        return m_state.wram.at(m_state.wram_offset + addr - WRAM_bX.first);
+        return m_wram.read(m_state.wram_offset + addr - WRAM_bX.first);
     case 0xE000: // echo RAM
     case 0xF000:
         return this->read(addr - 0x2000);
@@ -137,6 +82,7 @@ void MBC::write(uint16_t addr, uint8_t value)
             this->m_state.ram_enabled = ((value & 0xF) == 0xA);
         if (UNLIKELY(verbose_banking()))
         { printf("* External RAM enabled: %d\n", this->m_state.ram_enabled); }
+        m_memory.remap_rambank();
         return;
     case 0x2000:
     case 0x3000:
@@ -170,7 +116,7 @@ void MBC::write(uint16_t addr, uint8_t value)
             {
                 addr -= RAMbankX.first;
                 addr |= this->m_state.ram_bank_offset;
-                if (addr < this->m_state.ram_bank_size) { this->m_ram.at(addr) = value; }
+                if (addr < this->m_state.ram_bank_size) { this->write_ram(m_ram, addr, value); }
             }
             else
             {
@@ -179,10 +125,10 @@ void MBC::write(uint16_t addr, uint8_t value)
         }
         return;
     case 0xC000: // WRAM bank 0
-        this->m_state.wram.at(addr - WRAM_0.first) = value;
+        this->write_ram(m_wram, addr - WRAM_0.first, value);
         return;
     case 0xD000: // WRAM bank X
-        this->m_state.wram.at(m_state.wram_offset + addr - WRAM_bX.first) = value;
+        this->write_ram(m_wram, m_state.wram_offset + addr - WRAM_bX.first, value);
         return;
     case 0xE000: // Echo RAM
     case 0xF000:
@@ -193,6 +139,18 @@ void MBC::write(uint16_t addr, uint8_t value)
     assert(0);
 }
 
+void MBC::write_ram(PagedRAM& ram, uint32_t offset, uint8_t value)
+{
+    const bool was_writable = ram.is_writable(offset >> PagedRAM::PAGE_SHIFT);
+    ram.write(offset, value);
+    // the page can be written directly from now on
+    if (!was_writable)
+    {
+        m_memory.remap_rambank();
+        m_memory.remap_wrambank();
+    }
+}
+
 void MBC::set_rombank(int reg)
 {
     const int rom_banks = m_rom.size() / rombank_size();
@@ -208,7 +166,9 @@ void MBC::set_rombank(int reg)
         this->m_memory.machine().break_now();
         return;
     }
+    GBC_STAT(m_memory.machine().counters().rom_bank_switches++);
     this->m_state.rom_bank_offset = offset;
+    m_memory.remap_rombank();
 }
 void MBC::set_rambank(int reg)
 {
@@ -223,7 +183,9 @@ void MBC::set_rambank(int reg)
         printf("Selecting RAM bank 0x%02x offset %#x max %#x\n", reg, offset,
                m_state.ram_bank_size);
     }
+    GBC_STAT(m_memory.machine().counters().ram_bank_switches++);
     this->m_state.ram_bank_offset = offset;
+    m_memory.remap_rambank();
 }
 void MBC::set_wrambank(int reg)
 {
@@ -236,7 +198,9 @@ void MBC::set_wrambank(int reg)
         this->m_memory.machine().break_now();
         return;
     }
+    GBC_STAT(m_memory.machine().counters().wram_bank_switches++);
     this->m_state.wram_offset = offset;
+    m_memory.remap_wrambank();
 }
 void MBC::set_mode(int mode)
 {
@@ -257,18 +221,83 @@ void MBC::set_mode(int mode)
 bool MBC::verbose_banking() const noexcept { return m_memory.machine().verbose_banking; }
 
 // serialization
-int MBC::restore_state(const std::vector<uint8_t>& data, int off)
+void MBC::load_state(const StateView& view, state_t& state) const
+{
+    auto in = view.chunk(make_tag("MBC "));
+    in.get(state.rom_bank_offset);
+    in.get(state.ram_banks);
+    in.get(state.ram_bank_offset);
+    in.get(state.ram_bank_size);
+    in.get(state.wram_offset);
+    in.get(state.wram_size);
+    in.get(state.ram_enabled);
+    in.get(state.rtc_enabled);
+    in.get(state.rumble);
+    in.get(state.rom_bank_reg);
+    in.get(state.mode_select);
+    in.get(state.version);
+    // test ROMs without a second bank keep the initial offset
+    if (state.rom_bank_offset % rombank_size() != 0 ||
+        (state.rom_bank_offset + rombank_size() > m_rom.size() &&
+         state.rom_bank_offset != rombank_size()))
+        throw MachineException("Save state ROM bank is out of range");
+    if (state.ram_bank_size > m_ram.size() || state.ram_bank_offset % rambank_size() != 0)
+        throw MachineException("Save state RAM bank is out of range");
+    if (state.wram_size > m_wram.size() || state.wram_offset % wrambank_size() != 0 ||
+        state.wram_offset + wrambank_size() > m_wram.size())
+        throw MachineException("Save state work RAM bank is out of range");
+}
+void MBC::validate_state(const StateView& view) const
+{
+    state_t state;
+    this->load_state(view, state);
+    m_wram.validate_pages(view, make_tag("WRAM"));
+    m_ram.validate_pages(view, make_tag("CRAM"));
+}
+void MBC::restore_state(const StateView& view)
+{
+    state_t state = m_state;
+    this->load_state(view, state);
+    this->m_state = state;
+    // full states have every page, deltas only the written ones
+    m_wram.restore_pages(view, make_tag("WRAM"));
+    m_ram.restore_pages(view, make_tag("CRAM"));
+    m_memory.remap_rombank();
+    m_memory.remap_rambank();
+    m_memory.remap_wrambank();
+}
+void MBC::serialize_state(StateWriter& out, bool only_dirty) const
+{
+    out.begin(make_tag("MBC "), 1);
+    out.put(m_state.rom_bank_offset);
+    out.put(m_state.ram_banks);
+    out.put(m_state.ram_bank_offset);
+    out.put(m_state.ram_bank_size);
+    out.put(m_state.wram_offset);
+    out.put(m_state.wram_size);
+    out.put(m_state.ram_enabled);
+    out.put(m_state.rtc_enabled);
+    out.put(m_state.rumble);
+    out.put(m_state.rom_bank_reg);
+    out.put(m_state.mode_select);
+    out.put(m_state.version);
+    out.end();
+    m_wram.serialize_pages(out, make_tag("WRAM"), only_dirty, m_wram.size());
+    // only the RAM that the cartridge has
+    m_ram.serialize_pages(out, make_tag("CRAM"), only_dirty, m_state.ram_bank_size);
+}
+void MBC::set_delta_base()
 {
-    // copy state first
-    this->m_state = *(state_t*) &data.at(off);
-    off += sizeof(state_t);
-    // then copy RAM by size
-    std::copy(&data.at(off), &data.at(off) + m_state.ram_bank_size, m_ram.begin());
-    return sizeof(state_t) + m_state.ram_bank_size;
+    m_wram.clear_dirty();
+    m_ram.clear_dirty();
+    // writes have to go through the slow path again to be tracked
+    m_memory.remap_rambank();
+    m_memory.remap_wrambank();
 }
-void MBC::serialize_state(std::vector<uint8_t>& res) const
+void MBC::fork_from(const MBC& parent)
 {
-    res.insert(res.end(), (uint8_t*) &m_state, (uint8_t*) &m_state + sizeof(m_state));
-    res.insert(res.end(), m_ram.begin(), m_ram.begin() + m_state.ram_bank_size);
+    this->m_state = parent.m_state;
+    this->m_wram = parent.m_wram;
+    this->m_ram = parent.m_ram;
 }
 } // namespace gbc
@@ -1,4 +1,6 @@
 #pragma once
+#include "paged_ram.hpp"
+#include "rom.hpp"
 #include <array>
 #include <cassert>
 #include <cstddef>
@@ -20,7 +22,7 @@ public:
     static constexpr range_t WRAM_bX{0xD000, 0xE000};
     static constexpr range_t EchoRAM{0xE000, 0xFE00};
 
-    MBC(Memory&, const std::vector<uint8_t>& rom);
+    MBC(Memory&, const ROM& rom);
 
     const auto& rom() const noexcept { return m_rom; }
     uint32_t rombank_offset() const noexcept { return m_state.rom_bank_offset; }
@@ -39,17 +41,23 @@ public:
     void set_mode(int mode);
 
     // serialization
-    int restore_state(const std::vector<uint8_t>&, int);
-    void serialize_state(std::vector<uint8_t>&) const;
+    // throws what restore_state() would, without changing anything
+    void validate_state(const StateView&) const;
+    void restore_state(const StateView&);
+    // optionally only the RAM pages written since the last delta base
+    void serialize_state(StateWriter&, bool only_dirty) const;
+    void set_delta_base();
+    void fork_from(const MBC& parent);
 
 private:
     void write_MBC1M(uint16_t, uint8_t);
     void write_MBC3(uint16_t, uint8_t);
     void write_MBC5(uint16_t, uint8_t);
     bool verbose_banking() const noexcept;
+    void write_ram(PagedRAM&, uint32_t offset, uint8_t value);
 
     Memory& m_memory;
-    const std::vector<uint8_t>& m_rom;
+    const ROM& m_rom;
     struct state_t
     {
         uint32_t rom_bank_offset = 0x4000;
@@ -64,10 +72,12 @@ private:
         uint16_t rom_bank_reg = 0x1;
         uint8_t mode_select = 0;
         uint8_t version = 1;
-        std::array<uint8_t, 32768> wram;
     } m_state;
+    // throws on a missing chunk or out-of-range values
+    void load_state(const StateView&, state_t&) const;
+    PagedRAM m_wram{0x8000};
     // RAM is so big we want to deal with it dynamically
-    std::array<uint8_t, 131072> m_ram;
+    PagedRAM m_ram{0x20000};
 
     friend class Memory;
     void init();
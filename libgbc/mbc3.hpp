@@ -19,6 +19,7 @@ inline void MBC::write_MBC3(uint16_t addr, uint8_t value)
     case 0x5000:
         this->set_rambank(value & 0x7);
         this->m_state.rtc_enabled = (value & 0x80);
+        m_memory.remap_rambank();
         return;
     case 0x6000:
     case 0x7000:
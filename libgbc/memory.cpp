@@ -1,14 +1,19 @@
 #include "memory.hpp"
 #include "machine.hpp"
+#include <cstring>
 
 namespace gbc
 {
-Memory::Memory(Machine& mach, const std::vector<uint8_t>& rom)
-    : m_machine(mach), m_rom(rom), m_mbc{*this, rom}
+Memory::Memory(Machine& mach, std::shared_ptr<const ROM> rom)
+    : m_machine(mach), m_rom(std::move(rom)), m_mbc{*this, *m_rom}
 {
     assert(this->rom_valid());
     this->disable_bootrom();
     m_mbc.init();
+    // NOTE: video RAM gets mapped by the GPU
+    this->remap_rombank();
+    this->remap_rambank();
+    this->remap_wrambank();
 }
 void Memory::reset()
 {
@@ -24,38 +29,172 @@ void Memory::disable_bootrom() { m_state.bootrom_enabled = false; }
 
 void Memory::set_wram_bank(uint8_t bank) { this->m_mbc.set_wrambank(bank); }
 
+void Memory::remap_rombank()
+{
+    for (int page = 0x0; page < 0x8; page++)
+    {
+        const uint32_t offset =
+            (page < 0x4) ? page * PAGE_SIZE : m_mbc.rombank_offset() + (page - 0x4) * PAGE_SIZE;
+        // test ROMs can be smaller than a page
+        if (offset + PAGE_SIZE <= m_rom->size())
+            this->map_page(page, &m_rom->data()[offset], nullptr);
+        else
+            this->map_page(page, nullptr, nullptr);
+    }
+}
+void Memory::remap_rambank()
+{
+    const auto& state = m_mbc.m_state;
+    for (int page = 0xA; page < 0xC; page++)
+    {
+        const uint32_t offset = ((page - 0xA) * PAGE_SIZE) | state.ram_bank_offset;
+        // small RAM banks are handled by the MBC
+        if (state.ram_enabled && !state.rtc_enabled && offset + PAGE_SIZE <= state.ram_bank_size)
+            this->map_page(page, m_mbc.m_ram, offset);
+        else
+            this->map_page(page, nullptr, nullptr);
+    }
+}
+void Memory::remap_wrambank()
+{
+    this->map_page(0xC, m_mbc.m_wram, 0);
+    this->map_page(0xD, m_mbc.m_wram, m_mbc.m_state.wram_offset);
+    // echo RAM (the rest of it is in the slow path)
+    this->map_page(0xE, m_mbc.m_wram, 0);
+}
+void Memory::remap_video_ram()
+{
+    // cant access Video RAM when working on scanline, and a headless
+    // GPU has to catch up before every access to know the mode
+    // NOTE: writes take the slow path, which invalidates decoded tiles
+    auto& gpu = machine().gpu;
+    if (gpu.get_mode() != 3 && !gpu.is_headless())
+    {
+        const int first = gpu.video_offset() / PAGE_SIZE;
+        this->map_page(0x8, m_vram.page(first), nullptr);
+        this->map_page(0x9, m_vram.page(first + 1), nullptr);
+    }
+    else
+    {
+        this->map_page(0x8, nullptr, nullptr);
+        this->map_page(0x9, nullptr, nullptr);
+    }
+}
+void Memory::remap_all()
+{
+    this->remap_rombank();
+    this->remap_rambank();
+    this->remap_wrambank();
+    this->remap_video_ram();
+}
+void Memory::map_page(int page, const uint8_t* read, uint8_t* write)
+{
+    m_read_pages[page] = (m_read_traps[page]) ? nullptr : read;
+    m_write_pages[page] = (m_write_traps[page]) ? nullptr : write;
+}
+void Memory::map_page(int page, PagedRAM& ram, size_t offset)
+{
+    // shared and clean pages are written through the slow path
+    const size_t idx = offset >> PagedRAM::PAGE_SHIFT;
+    this->map_page(page, ram.page(idx), ram.is_writable(idx) ? ram.writable_page(idx) : nullptr);
+}
+
+void Memory::watchpoint(amode_t mode, range_t range, access_t func)
+{
+    auto& traps = (mode == READ) ? m_read_traps : m_write_traps;
+    for (int page = range.first >> PAGE_SHIFT; page <= (range.second >> PAGE_SHIFT); page++)
+    { traps[page] = true; }
+    if (mode == READ)
+        m_read_watchpoints.push_back({range, std::move(func)});
+    else
+        m_write_watchpoints.push_back({range, std::move(func)});
+    this->remap_all();
+}
+void Memory::clear_watchpoints()
+{
+    m_read_watchpoints.clear();
+    m_write_watchpoints.clear();
+    m_read_traps = {};
+    m_write_traps = {};
+    this->remap_all();
+}
+void Memory::trigger_watchpoints(std::vector<watchpoint_t>& list, uint16_t addr, uint8_t value)
+{
+    this->m_is_busy = true;
+    for (auto& wp : list)
+    {
+        if (is_within(addr, wp.range)) wp.callback(*this, addr, value);
+    }
+    this->m_is_busy = false;
+}
+
+// how an I/O register can change without the CPU writing to it
+static uint8_t io_read_flags(const uint16_t addr)
+{
+    switch (addr)
+    {
+    case IO::REG_LY:
+    case IO::REG_STAT:
+        return Memory::READ_GPU_MODE;
+    // these only change on events, or when written
+    case IO::REG_IF:
+    case IO::REG_TMA:
+    case IO::REG_TAC:
+    case IO::REG_LCDC:
+    case IO::REG_SCY:
+    case IO::REG_SCX:
+    case IO::REG_LYC:
+    case IO::REG_BGP:
+    case IO::REG_OBP0:
+    case IO::REG_OBP1:
+    case IO::REG_WY:
+    case IO::REG_WX:
+        return 0;
+    }
+    return Memory::READ_VOLATILE;
+}
+
 uint8_t Memory::read8(uint16_t address)
 {
-    if (UNLIKELY(!m_read_breakpoints.empty() && !m_is_busy))
+    GBC_STAT(machine().counters().reads[Stats::region(address)]++);
+    const uint8_t* page = m_read_pages[address >> PAGE_SHIFT];
+    if (LIKELY(page != nullptr)) return page[address & (PAGE_SIZE - 1)];
+
+    if (UNLIKELY(m_read_traps[address >> PAGE_SHIFT] && !m_is_busy))
     {
-        this->m_is_busy = true;
-        for (auto& func : m_read_breakpoints) { func(*this, address, 0x0); }
-        this->m_is_busy = false;
+        // every access must reach the watchpoints, so the loop cant be skipped
+        this->m_read_flags |= READ_VOLATILE;
+        this->trigger_watchpoints(m_read_watchpoints, address, 0x0);
     }
+
     switch (address & 0xF000)
     {
     case 0x0000:
     case 0x1000:
     case 0x2000:
     case 0x3000:
-        return m_rom[address];
+        return (*m_rom)[address];
     case 0x4000:
     case 0x5000:
     case 0x6000:
     case 0x7000:
         address -= 0x4000;
-        return m_rom[m_mbc.rombank_offset() | address];
+        return (*m_rom)[m_mbc.rombank_offset() | address];
     case 0x8000:
     case 0x9000:
+        this->m_read_flags |= READ_GPU_MODE;
+        if (machine().gpu.is_headless()) machine().cpu.hardware_catchup();
         // cant read from Video RAM when working on scanline
         if (UNLIKELY(machine().gpu.get_mode() != 3))
         {
             const uint16_t offset = machine().gpu.video_offset();
-            return m_state.video_ram.at(offset + address - VideoRAM.first);
+            return m_vram.read(offset + address - VideoRAM.first);
         }
         return 0xff;
     case 0xA000:
     case 0xB000:
+        // the RTC registers count by themselves
+        this->m_read_flags |= READ_VOLATILE;
         return m_mbc.read(address);
     case 0xC000:
     case 0xD000:
@@ -72,6 +211,10 @@ uint8_t Memory::read8(uint16_t address)
         }
         else if (this->is_within(address, IO_Ports))
         {
+            // I/O registers must reflect the current cycle
+            this->m_read_flags |= io_read_flags(address);
+            GBC_STAT(machine().counters().io_reads[address & 0xFF]++);
+            machine().cpu.hardware_sync();
             return machine().io.read_io(address);
         }
         else if (this->is_within(address, ZRAM))
@@ -80,6 +223,7 @@ uint8_t Memory::read8(uint16_t address)
         }
         else if (address == InterruptEn)
         {
+            GBC_STAT(machine().counters().io_reads[address & 0xFF]++);
             return machine().io.read_io(address);
         }
     }
@@ -89,12 +233,20 @@ uint8_t Memory::read8(uint16_t address)
 
 void Memory::write8(uint16_t address, uint8_t value)
 {
-    if (UNLIKELY(!m_write_breakpoints.empty() && !m_is_busy))
+    GBC_STAT(machine().counters().writes[Stats::region(address)]++);
+    uint8_t* page = m_write_pages[address >> PAGE_SHIFT];
+    if (LIKELY(page != nullptr))
+    {
+        page[address & (PAGE_SIZE - 1)] = value;
+        return;
+    }
+
+    if (UNLIKELY(m_write_traps[address >> PAGE_SHIFT] && !m_is_busy))
     {
-        this->m_is_busy = true;
-        for (auto& func : m_write_breakpoints) { func(*this, address, value); }
-        this->m_is_busy = false;
+        this->m_read_flags |= READ_VOLATILE;
+        this->trigger_watchpoints(m_write_watchpoints, address, value);
     }
+
     switch (address & 0xF000)
     {
     case 0x0000:
@@ -109,10 +261,15 @@ void Memory::write8(uint16_t address, uint8_t value)
         return;
     case 0x8000:
     case 0x9000:
+        if (machine().gpu.is_headless()) machine().cpu.hardware_catchup();
         if (machine().gpu.get_mode() != 3)
         {
-            const uint16_t offset = machine().gpu.video_offset();
-            m_state.video_ram.at(offset + address - VideoRAM.first) = value;
+            const uint16_t offset = machine().gpu.video_offset() + address - VideoRAM.first;
+            const uint8_t* page = m_vram.page(offset >> PAGE_SHIFT);
+            m_vram.write(offset, value);
+            machine().gpu.invalidate_tile(offset);
+            // the page was shared and got copied
+            if (UNLIKELY(m_vram.page(offset >> PAGE_SHIFT) != page)) this->remap_video_ram();
         }
         return;
     case 0xA000:
@@ -135,11 +292,16 @@ void Memory::write8(uint16_t address, uint8_t value)
         else if (this->is_within(address, OAM_RAM))
         {
             this->m_state.oam_ram.at(address - OAM_RAM.first) = value;
+            machine().gpu.invalidate_sprites();
             return;
         }
         else if (this->is_within(address, IO_Ports))
         {
+            GBC_STAT(machine().counters().io_writes[address & 0xFF]++);
+            // catch up before the write, and reschedule after
+            machine().cpu.hardware_sync();
             machine().io.write_io(address, value);
+            machine().cpu.hardware_sync();
             return;
         }
         else if (this->is_within(address, ZRAM))
@@ -149,6 +311,7 @@ void Memory::write8(uint16_t address, uint8_t value)
         }
         else if (address == InterruptEn)
         {
+            GBC_STAT(machine().counters().io_writes[address & 0xFF]++);
             machine().io.write_io(address, value);
             return;
         }
@@ -156,6 +319,64 @@ void Memory::write8(uint16_t address, uint8_t value)
     printf(">>> Invalid memory write at 0x%04x, value 0x%x\n", address, value);
 }
 
+void Memory::read_block(uint16_t src, uint8_t* dst, size_t bytes)
+{
+    while (bytes > 0)
+    {
+        const size_t off = src & (PAGE_SIZE - 1);
+        const size_t count = std::min(bytes, PAGE_SIZE - off);
+        const uint8_t* page = m_read_pages[src >> PAGE_SHIFT];
+        if (LIKELY(page != nullptr)) { std::memcpy(dst, page + off, count); }
+        else
+        {
+            for (size_t i = 0; i < count; i++) dst[i] = this->read8(src + i);
+        }
+        src += count;
+        dst += count;
+        bytes -= count;
+    }
+}
+
+void Memory::dma_to_oam(const uint16_t src, const size_t offset, const size_t bytes)
+{
+    assert(offset + bytes <= m_state.oam_ram.size());
+    GBC_STAT(machine().counters().oam_dma_bytes += bytes);
+    // watchpoints have to see every byte
+    if (UNLIKELY(m_write_traps[OAM_RAM.first >> PAGE_SHIFT]))
+    {
+        for (size_t i = 0; i < bytes; i++)
+        { this->write8(OAM_RAM.first + offset + i, this->read8(src + i)); }
+        return;
+    }
+    this->read_block(src, &m_state.oam_ram[offset], bytes);
+    machine().gpu.invalidate_sprites();
+}
+
+void Memory::dma_to_vram(const uint16_t src, const uint16_t dst, const size_t bytes)
+{
+    GBC_STAT(machine().counters().vram_dma_bytes += bytes);
+    std::array<uint8_t, 2048> buffer;
+    // copying past the end, from video RAM itself, or with watchpoints
+    // has to go byte by byte
+    if (UNLIKELY(dst + bytes > VideoRAM.second + 1u || bytes > buffer.size() ||
+                 is_within(src, VideoRAM) || m_write_traps[0x8] || m_write_traps[0x9]))
+    {
+        for (size_t i = 0; i < bytes; i++) this->write8(dst + i, this->read8(src + i));
+        return;
+    }
+    this->read_block(src, buffer.data(), bytes);
+
+    if (machine().gpu.is_headless()) machine().cpu.hardware_catchup();
+    // cant write to Video RAM when working on scanline
+    if (machine().gpu.get_mode() == 3) return;
+    const uint16_t offset = machine().gpu.video_offset() + dst - VideoRAM.first;
+    m_vram.copy_in(offset, bytes, buffer.data());
+    for (size_t i = 0; i < bytes; i += 16) machine().gpu.invalidate_tile(offset + i);
+    machine().gpu.invalidate_tile(offset + bytes - 1);
+    // shared pages got copied
+    this->remap_video_ram();
+}
+
 void Memory::do_switch_speed()
 {
     auto& reg = machine().io.reg(IO::REG_KEY1);
@@ -209,17 +430,55 @@ std::string Memory::explain(const uint16_t addr) const
 }
 
 // serialization
-int Memory::restore_state(const std::vector<uint8_t>& data, int off)
+void Memory::load_state(const StateView& view, state_t& state) const
+{
+    auto in = view.chunk(make_tag("MEM "));
+    in.get(state.oam_ram.data(), state.oam_ram.size());
+    in.get(state.zram.data(), state.zram.size());
+    in.get(state.bootrom_enabled);
+    in.get(state.speed_factor);
+}
+void Memory::validate_state(const StateView& view) const
+{
+    state_t state;
+    this->load_state(view, state);
+    m_vram.validate_pages(view, make_tag("VRAM"));
+    m_mbc.validate_state(view);
+}
+void Memory::restore_state(const StateView& view)
 {
-    this->m_state = *(state_t*) &data.at(off);
-    off += sizeof(state_t);
+    state_t state;
+    this->load_state(view, state);
+    this->m_state = state;
+    m_vram.restore_pages(view, make_tag("VRAM"));
     // also restore MBC
-    return sizeof(state_t) + this->m_mbc.restore_state(data, off);
+    this->m_mbc.restore_state(view);
 }
-void Memory::serialize_state(std::vector<uint8_t>& res) const
+void Memory::serialize_state(StateWriter& out, bool only_dirty) const
 {
-    res.insert(res.end(), (uint8_t*) &m_state, (uint8_t*) &m_state + sizeof(m_state));
+    out.begin(make_tag("MEM "), 1);
+    out.put(m_state.oam_ram.data(), m_state.oam_ram.size());
+    out.put(m_state.zram.data(), m_state.zram.size());
+    out.put(m_state.bootrom_enabled);
+    out.put(m_state.speed_factor);
+    out.end();
+    m_vram.serialize_pages(out, make_tag("VRAM"), only_dirty, m_vram.size());
     // also serialize MBC
-    this->m_mbc.serialize_state(res);
+    this->m_mbc.serialize_state(out, only_dirty);
+}
+void Memory::set_delta_base()
+{
+    // video RAM writes always go through the slow path
+    m_vram.clear_dirty();
+    m_mbc.set_delta_base();
+}
+void Memory::fork_from(Memory& parent)
+{
+    this->m_vram = parent.m_vram;
+    this->m_state = parent.m_state;
+    this->m_mbc.fork_from(parent.m_mbc);
+    // every page is shared now, so both sides copy before writing
+    parent.remap_all();
+    this->remap_all();
 }
 } // namespace gbc
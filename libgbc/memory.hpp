@@ -1,9 +1,12 @@
 #pragma once
 #include "common.hpp"
 #include "mbc.hpp"
+#include "paged_ram.hpp"
+#include "rom.hpp"
 #include <array>
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -25,7 +28,7 @@ public:
     static constexpr range_t ZRAM{0xFF80, 0xFFFE};
     static constexpr uint16_t InterruptEn = 0xFFFF;
 
-    Memory(Machine&, const std::vector<uint8_t>& rom);
+    Memory(Machine&, std::shared_ptr<const ROM> rom);
     void reset();
     void set_wram_bank(uint8_t bank);
 
@@ -35,13 +38,42 @@ public:
     uint16_t read16(uint16_t address);
     void write16(uint16_t address, uint16_t value);
 
+    // block copies for OAM DMA and HDMA, with the same effects as copying
+    // byte by byte with read8 and write8
+    void dma_to_oam(uint16_t src, size_t offset, size_t bytes);
+    void dma_to_vram(uint16_t src, uint16_t dst, size_t bytes);
+
     uint8_t* oam_ram_ptr() noexcept { return m_state.oam_ram.data(); }
     const uint8_t* oam_ram_ptr() const noexcept { return m_state.oam_ram.data(); }
-    uint8_t* video_ram_ptr() noexcept { return m_state.video_ram.data(); }
-    const uint8_t* video_ram_ptr() const noexcept { return m_state.video_ram.data(); }
+    // both banks of video RAM (writes have to go through write8)
+    const PagedRAM& video_ram() const noexcept { return m_vram; }
+    const ROM& rom() const noexcept { return *m_rom; }
+    const std::shared_ptr<const ROM>& shared_rom() const noexcept { return m_rom; }
+
+    // the host page that reads from addr go to, or nullptr for the slow path
+    const uint8_t* read_page(uint16_t addr) const noexcept
+    {
+        return m_read_pages[addr >> PAGE_SHIFT];
+    }
+
+    // what the reads that went through the slow path since clear_read_flags() can
+    // depend on, so that a polling loop knows for how long it would read the same
+    enum read_flags_t : uint8_t
+    {
+        READ_GPU_MODE = 0x1, // LY, STAT or video RAM
+        READ_VOLATILE = 0x2, // timers, input, sound, cartridge RAM or watchpoints
+    };
+    uint8_t read_flags() const noexcept { return m_read_flags; }
+    void clear_read_flags() noexcept { this->m_read_flags = 0; }
 
     static constexpr uint16_t range_size(range_t range) { return range.second - range.first; }
 
+    // update the page table after bank switches and GPU mode changes
+    void remap_rombank();
+    void remap_rambank();
+    void remap_wrambank();
+    void remap_video_ram();
+
     Machine& machine() const noexcept { return m_machine; }
     Machine& machine() noexcept { return m_machine; }
     bool rom_valid() const noexcept;
@@ -53,8 +85,14 @@ public:
     void do_switch_speed();
 
     // serialization
-    int restore_state(const std::vector<uint8_t>&, int);
-    void serialize_state(std::vector<uint8_t>&) const;
+    // throws what restore_state() would, without changing anything
+    void validate_state(const StateView&) const;
+    void restore_state(const StateView&);
+    // optionally only the RAM pages written since the last delta base
+    void serialize_state(StateWriter&, bool only_dirty) const;
+    void set_delta_base();
+    // share all RAM with another machine, copy-on-write
+    void fork_from(Memory& parent);
 
     // debugging
     std::string explain(uint16_t address) const;
@@ -64,7 +102,11 @@ public:
         WRITE
     };
     using access_t = std::function<void(Memory&, uint16_t, uint8_t)>;
+    // trap on accesses within an (inclusive) address range
+    void watchpoint(amode_t, range_t, access_t);
+    // trap on every access
     void breakpoint(amode_t, access_t);
+    void clear_watchpoints();
 
     inline static bool is_within(uint16_t addr, const range_t& range)
     {
@@ -72,28 +114,49 @@ public:
     }
 
 private:
+    static constexpr int PAGE_SHIFT = 12;
+    static constexpr int PAGE_SIZE = 1 << PAGE_SHIFT;
+    static constexpr int NUM_PAGES = 0x10000 / PAGE_SIZE;
+
     Machine& m_machine;
-    const std::vector<uint8_t>& m_rom;
+    const std::shared_ptr<const ROM> m_rom;
     MBC m_mbc;
+    // host pointers to directly accessible 4kb pages, or nullptr
+    // when the access has to go through the slow path
+    std::array<const uint8_t*, NUM_PAGES> m_read_pages = {};
+    std::array<uint8_t*, NUM_PAGES> m_write_pages = {};
+    // watched pages are never mapped, so only they pay for traps
+    std::array<bool, NUM_PAGES> m_read_traps = {};
+    std::array<bool, NUM_PAGES> m_write_traps = {};
+    void map_page(int page, const uint8_t* read, uint8_t* write);
+    void map_page(int page, PagedRAM& ram, size_t offset);
+    PagedRAM m_vram{0x4000};
     struct state_t
     {
-        std::array<uint8_t, 16384> video_ram = {};
         std::array<uint8_t, 256> oam_ram = {};
         std::array<uint8_t, 128> zram = {}; // high-speed RAM
         bool bootrom_enabled = true;
         int8_t speed_factor = 1;
     } m_state;
+    // throws on a missing or short chunk
+    void load_state(const StateView&, state_t&) const;
     bool m_is_busy = false;
-    std::vector<access_t> m_read_breakpoints;
-    std::vector<access_t> m_write_breakpoints;
+    uint8_t m_read_flags = 0;
+    struct watchpoint_t
+    {
+        range_t range;
+        access_t callback;
+    };
+    std::vector<watchpoint_t> m_read_watchpoints;
+    std::vector<watchpoint_t> m_write_watchpoints;
+    void trigger_watchpoints(std::vector<watchpoint_t>&, uint16_t, uint8_t);
+    void read_block(uint16_t src, uint8_t* dst, size_t bytes);
+    void remap_all();
 };
 
 inline void Memory::breakpoint(amode_t mode, access_t func)
 {
-    if (mode == READ)
-        m_read_breakpoints.push_back(func);
-    else if (mode == WRITE)
-        m_write_breakpoints.push_back(func);
+    this->watchpoint(mode, {0x0000, 0xFFFF}, std::move(func));
 }
 
 inline uint16_t Memory::read16(uint16_t address)
@@ -0,0 +1,242 @@
+#include "movie.hpp"
+#include "machine.hpp"
+
+namespace gbc
+{
+// playback gives up when the game has not read the joypad for this many frames
+static constexpr int MAX_IDLE_FRAMES = 600;
+static constexpr size_t HEADER_SIZE = 52;
+
+template <typename T> static void append_le(std::vector<uint8_t>& dst, T value)
+{
+    for (size_t i = 0; i < sizeof(T); i++) dst.push_back(uint8_t(value >> (8 * i)));
+}
+template <typename T> static T load_le(const uint8_t* src)
+{
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) value |= T(src[i]) << (8 * i);
+    return value;
+}
+static void append_varint(std::vector<uint8_t>& dst, uint64_t value)
+{
+    for (; value >= 0x80; value >>= 7) dst.push_back(uint8_t(value) | 0x80);
+    dst.push_back(value);
+}
+static uint64_t load_varint(const uint8_t*& src, const uint8_t* end)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (UNLIKELY(src >= end)) break;
+        const uint8_t b = *src++;
+        value |= uint64_t(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) return value;
+    }
+    throw MachineException("Input movie is damaged");
+}
+
+// only the emulated state, as a headless machine syncs the hardware and
+// schedules events less often than one that renders, and the sound is
+// simulated in bulk whenever the run happens to flush it
+static uint64_t state_hash(Machine& machine)
+{
+    machine.cpu.hardware_sync();
+    machine.apu.catch_up();
+    std::vector<uint8_t> state;
+    StateWriter out(state);
+    machine.cpu.serialize_state(out, false);
+    machine.memory.serialize_state(out, false);
+    machine.io.serialize_state(out);
+    machine.gpu.serialize_state(out);
+    machine.apu.serialize_state(out);
+    return savestate_t::hash64(state.data(), state.size());
+}
+
+void InputMovie::start(Machine& machine, tick_t clock)
+{
+    const auto& rom = machine.memory.rom();
+    this->m_clock = clock;
+    this->m_rom_hash = savestate_t::hash64(rom.data(), rom.size());
+    this->m_state_hash = state_hash(machine);
+    this->m_start_frame = machine.gpu.frame_count();
+    this->m_start_cycles = machine.now();
+    this->m_cycles = 0;
+    this->m_ticks = 0;
+    this->m_runs.clear();
+    this->rewind();
+}
+
+void InputMovie::append(const uint8_t mask, const uint64_t ticks)
+{
+    if (ticks == 0) return;
+    if (!m_runs.empty() && m_runs.back().mask == mask)
+        m_runs.back().count += ticks;
+    else
+        m_runs.push_back({mask, ticks});
+    this->m_ticks += ticks;
+}
+
+void InputMovie::record(Machine& machine, IO::joypad_read_handler_t source, tick_t clock)
+{
+    this->start(machine, clock);
+    this->m_recording = true;
+    machine.io.on_joypad_read([this, source](Machine& machine, int mode) {
+        if (source) source(machine, mode);
+        // games read the dpad and then the buttons, once per poll
+        if (mode != 1) return;
+        const uint8_t mask = machine.io.joypad().last_mask;
+        if (m_clock == JOYPAD_READS)
+        {
+            this->append(mask);
+            return;
+        }
+        // one input per frame, where frames without reads repeat the last input
+        const uint64_t tick = machine.gpu.frame_count() - m_start_frame;
+        if (tick < m_ticks) return;
+        this->append(m_runs.empty() ? 0 : m_runs.back().mask, tick - m_ticks);
+        this->append(mask);
+    });
+}
+
+void InputMovie::verify_start(Machine& machine) const
+{
+    const auto& rom = machine.memory.rom();
+    if (savestate_t::hash64(rom.data(), rom.size()) != m_rom_hash)
+        throw MachineException("Input movie was recorded with another ROM");
+    if (state_hash(machine) != m_state_hash)
+        throw MachineException("Input movie was recorded from another state");
+}
+
+void InputMovie::rewind() noexcept
+{
+    this->m_run = 0;
+    this->m_run_left = m_runs.empty() ? 0 : m_runs[0].count;
+    this->m_tick = 0;
+    this->m_mask = 0;
+}
+
+uint8_t InputMovie::take() noexcept
+{
+    // runs are never empty, so the next one always has a tick left
+    if (m_run_left == 0) this->m_run_left = m_runs[++m_run].count;
+    this->m_run_left--;
+    this->m_tick++;
+    return m_runs[m_run].mask;
+}
+
+void InputMovie::on_read(Machine& machine, const int mode)
+{
+    if (mode != 1) return;
+    if (m_clock == JOYPAD_READS)
+    {
+        this->m_mask = (this->finished()) ? 0 : this->take();
+    }
+    else
+    {
+        const uint64_t tick = machine.gpu.frame_count() - m_start_frame;
+        while (m_tick <= tick && !this->finished()) this->m_mask = this->take();
+        if (tick >= m_ticks) this->m_mask = 0;
+    }
+    machine.set_inputs(m_mask);
+}
+
+void InputMovie::play(Machine& machine)
+{
+    this->verify_start(machine);
+    this->rewind();
+    this->m_recording = false;
+    machine.io.on_joypad_read([this](Machine& machine, int mode) { this->on_read(machine, mode); });
+}
+
+void InputMovie::play_turbo(Machine& machine)
+{
+    this->play(machine);
+    const bool headless = machine.gpu.is_headless();
+    machine.gpu.set_headless(true);
+    if (m_cycles > 0)
+    {
+        machine.run_for_cycles(m_cycles);
+    }
+    else
+    {
+        int idle = 0;
+        while (!this->finished() && idle < MAX_IDLE_FRAMES)
+        {
+            const uint64_t tick = m_tick;
+            if (machine.run_frames(1) == Machine::RUN_STOPPED) break;
+            idle = (m_tick == tick) ? idle + 1 : 0;
+        }
+    }
+    machine.gpu.set_headless(headless);
+    this->stop(machine);
+}
+
+void InputMovie::stop(Machine& machine)
+{
+    machine.io.on_joypad_read(nullptr);
+    if (m_recording)
+    {
+        this->m_cycles = machine.now() - m_start_cycles;
+        this->m_recording = false;
+    }
+}
+
+void InputMovie::serialize(std::vector<uint8_t>& out) const
+{
+    const size_t begin = out.size();
+    append_le<uint32_t>(out, MAGIC);
+    append_le<uint16_t>(out, VERSION);
+    append_le<uint8_t>(out, m_clock);
+    append_le<uint8_t>(out, 0);
+    append_le<uint64_t>(out, m_rom_hash);
+    append_le<uint64_t>(out, m_state_hash);
+    append_le<uint64_t>(out, m_start_frame);
+    append_le<uint64_t>(out, m_cycles);
+    append_le<uint64_t>(out, m_ticks);
+    append_le<uint32_t>(out, m_runs.size());
+    for (const auto& run : m_runs)
+    {
+        out.push_back(run.mask);
+        append_varint(out, run.count);
+    }
+    append_le<uint32_t>(out, savestate_t::checksum(&out[begin], out.size() - begin));
+}
+
+InputMovie InputMovie::load(const uint8_t* data, const size_t len)
+{
+    if (len < HEADER_SIZE + 4 || load_le<uint32_t>(&data[0]) != MAGIC)
+        throw MachineException("Not an input movie");
+    if (load_le<uint16_t>(&data[4]) > VERSION)
+        throw MachineException("Input movie is from a newer version");
+    if (load_le<uint32_t>(&data[len - 4]) != savestate_t::checksum(data, len - 4))
+        throw MachineException("Input movie checksum mismatch");
+
+    InputMovie movie;
+    movie.m_clock = tick_t(data[6]);
+    if (movie.m_clock > FRAMES) throw MachineException("Input movie has an unknown clock");
+    movie.m_rom_hash = load_le<uint64_t>(&data[8]);
+    movie.m_state_hash = load_le<uint64_t>(&data[16]);
+    movie.m_start_frame = load_le<uint64_t>(&data[24]);
+    movie.m_cycles = load_le<uint64_t>(&data[32]);
+    const uint64_t ticks = load_le<uint64_t>(&data[40]);
+    const uint32_t count = load_le<uint32_t>(&data[48]);
+
+    const uint8_t* src = &data[HEADER_SIZE];
+    const uint8_t* const end = &data[len - 4];
+    // every run is at least two bytes
+    if (count > size_t(end - src) / 2) throw MachineException("Input movie is damaged");
+    movie.m_runs.reserve(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (UNLIKELY(src >= end)) throw MachineException("Input movie is damaged");
+        const uint8_t mask = *src++;
+        const uint64_t run = load_varint(src, end);
+        if (UNLIKELY(run == 0 || run > ticks - movie.m_ticks))
+            throw MachineException("Input movie is damaged");
+        movie.append(mask, run);
+    }
+    if (src != end || movie.m_ticks != ticks) throw MachineException("Input movie is damaged");
+    movie.rewind();
+    return movie;
+}
+} // namespace gbc
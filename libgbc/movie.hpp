@@ -0,0 +1,80 @@
+#pragma once
+#include "io.hpp"
+#include <cstdint>
+#include <vector>
+
+namespace gbc
+{
+// Deterministic input recording and playback. Inputs are kept per tick, where a
+// tick is either a read of the dpad (which is what games poll once per frame) or
+// a frame, and are stored as runs of identical inputs. A movie remembers the ROM
+// and the state it started from, and plays back only from that same state.
+// The .gis file format:
+//   header: magic, version, clock, ROM hash, start state hash, start frame,
+//           length in cycles (0 if unknown), ticks, number of runs
+//   runs:   inputs mask, varint tick count
+//   footer: checksum of everything before it
+class InputMovie
+{
+public:
+    enum tick_t : uint8_t
+    {
+        JOYPAD_READS = 0,
+        FRAMES = 1,
+    };
+    static constexpr uint32_t MAGIC = 0x53494247; // GBIS
+    static constexpr uint16_t VERSION = 1;
+
+    // begin an empty movie at the current state of the machine
+    void start(Machine&, tick_t clock = JOYPAD_READS);
+    // add inputs (use keys_t to form the mask) for the next ticks
+    void append(uint8_t mask, uint64_t ticks = 1);
+
+    // start a movie, and record the inputs of the machine on every tick
+    // the source is called first on every joypad read, and can set the inputs
+    // NOTE: inputs only replay exactly when they change on dpad reads (or frames)
+    void record(Machine&, IO::joypad_read_handler_t source = nullptr, tick_t = JOYPAD_READS);
+    // play back from the start state, throws if it is not the state of the machine
+    // NOTE: the movie must outlive recording and playback
+    void play(Machine&);
+    // play back headlessly at full speed, until the recorded length or the last input
+    void play_turbo(Machine&);
+    // end recording or playback, and remove the joypad handler
+    void stop(Machine&);
+
+    bool finished() const noexcept { return m_tick >= m_ticks; }
+    uint64_t ticks() const noexcept { return m_ticks; }
+    uint64_t length_cycles() const noexcept { return m_cycles; }
+    tick_t clock() const noexcept { return m_clock; }
+
+    void serialize(std::vector<uint8_t>&) const;
+    // throws a MachineException when the movie is damaged
+    static InputMovie load(const uint8_t* data, size_t len);
+
+private:
+    struct run_t
+    {
+        uint8_t mask;
+        uint64_t count;
+    };
+    void verify_start(Machine&) const;
+    void rewind() noexcept;
+    uint8_t take() noexcept;
+    void on_read(Machine&, int mode);
+
+    tick_t m_clock = JOYPAD_READS;
+    uint64_t m_rom_hash = 0;
+    uint64_t m_state_hash = 0;
+    uint64_t m_start_frame = 0;
+    uint64_t m_start_cycles = 0;
+    uint64_t m_cycles = 0;
+    uint64_t m_ticks = 0;
+    std::vector<run_t> m_runs;
+    // playback position
+    size_t m_run = 0;
+    uint64_t m_run_left = 0;
+    uint64_t m_tick = 0;
+    uint8_t m_mask = 0;
+    bool m_recording = false;
+};
+} // namespace gbc
@@ -0,0 +1,93 @@
+#include "paged_ram.hpp"
+#include "savestate.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace gbc
+{
+static const std::shared_ptr<PagedRAM::page_t>& zero_page()
+{
+    static const auto page = std::make_shared<PagedRAM::page_t>();
+    return page;
+}
+
+PagedRAM::PagedRAM(size_t bytes)
+    : m_pages((bytes + PAGE_SIZE - 1) / PAGE_SIZE, zero_page()), m_dirty(m_pages.size(), false)
+{}
+
+uint8_t* PagedRAM::writable_page(size_t idx)
+{
+    auto& page = m_pages.at(idx);
+    // the zero page is always shared
+    if (page.use_count() != 1) page = std::make_shared<page_t>(*page);
+    m_dirty[idx] = true;
+    return page->data();
+}
+
+void PagedRAM::clear_dirty() noexcept { std::fill(m_dirty.begin(), m_dirty.end(), false); }
+
+void PagedRAM::serialize_pages(StateWriter& out, uint32_t tag, bool only_dirty,
+                               size_t limit) const
+{
+    const uint16_t end = std::min(m_pages.size(), (limit + PAGE_SIZE - 1) / PAGE_SIZE);
+    uint16_t count = 0;
+    for (uint16_t idx = 0; idx < end; idx++) count += !only_dirty || m_dirty[idx];
+
+    out.begin(tag, 1);
+    out.put(count);
+    for (uint16_t idx = 0; idx < end; idx++)
+    {
+        if (only_dirty && !m_dirty[idx]) continue;
+        out.put(idx);
+        out.put(m_pages[idx]->data(), PAGE_SIZE);
+    }
+    out.end();
+}
+void PagedRAM::validate_pages(const StateView& view, uint32_t tag) const
+{
+    auto in = view.chunk(tag);
+    const uint16_t count = in.get<uint16_t>();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        const uint16_t idx = in.get<uint16_t>();
+        if (idx >= m_pages.size()) throw MachineException("Save state page is out of range");
+        in.take(PAGE_SIZE);
+    }
+}
+void PagedRAM::restore_pages(const StateView& view, uint32_t tag)
+{
+    this->validate_pages(view, tag);
+    auto in = view.chunk(tag);
+    const uint16_t count = in.get<uint16_t>();
+    for (uint16_t i = 0; i < count; i++)
+    {
+        const uint16_t idx = in.get<uint16_t>();
+        in.get(this->writable_page(idx), PAGE_SIZE);
+    }
+}
+
+void PagedRAM::copy_out(size_t addr, size_t len, uint8_t* dst) const
+{
+    while (len > 0)
+    {
+        const size_t off = addr & (PAGE_SIZE - 1);
+        const size_t count = std::min(len, PAGE_SIZE - off);
+        std::memcpy(dst, this->page(addr >> PAGE_SHIFT) + off, count);
+        addr += count;
+        dst += count;
+        len -= count;
+    }
+}
+void PagedRAM::copy_in(size_t addr, size_t len, const uint8_t* src)
+{
+    while (len > 0)
+    {
+        const size_t off = addr & (PAGE_SIZE - 1);
+        const size_t count = std::min(len, PAGE_SIZE - off);
+        std::memcpy(this->writable_page(addr >> PAGE_SHIFT) + off, src, count);
+        addr += count;
+        src += count;
+        len -= count;
+    }
+}
+} // namespace gbc
@@ -0,0 +1,66 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace gbc
+{
+class StateView;
+class StateWriter;
+
+// RAM in 4kb pages that copies of it (machine forks) share until written to
+class PagedRAM
+{
+public:
+    static constexpr int PAGE_SHIFT = 12;
+    static constexpr size_t PAGE_SIZE = 1 << PAGE_SHIFT;
+    using page_t = std::array<uint8_t, PAGE_SIZE>;
+
+    // all pages start out as one shared zero page
+    explicit PagedRAM(size_t bytes);
+
+    size_t size() const noexcept { return m_pages.size() * PAGE_SIZE; }
+    size_t num_pages() const noexcept { return m_pages.size(); }
+
+    uint8_t read(size_t addr) const noexcept;
+    void write(size_t addr, uint8_t value);
+    void copy_out(size_t addr, size_t len, uint8_t* dst) const;
+    void copy_in(size_t addr, size_t len, const uint8_t* src);
+
+    const uint8_t* page(size_t idx) const noexcept { return m_pages[idx]->data(); }
+    // a private copy of a shared page is made before it can be written
+    uint8_t* writable_page(size_t idx);
+    // can the page be written to without copying it or marking it dirty
+    bool is_writable(size_t idx) const noexcept
+    {
+        return m_dirty[idx] && m_pages[idx].use_count() == 1;
+    }
+    // pages that have been written to since the last clear
+    bool is_dirty(size_t idx) const noexcept { return m_dirty[idx]; }
+    void clear_dirty() noexcept;
+
+    // a chunk with a count followed by (index, contents) records for the
+    // pages below limit, optionally only the dirty ones
+    void serialize_pages(StateWriter&, uint32_t tag, bool only_dirty, size_t limit) const;
+    void restore_pages(const StateView&, uint32_t tag);
+    // throws what restore_pages() would, without changing anything
+    void validate_pages(const StateView&, uint32_t tag) const;
+
+private:
+    std::vector<std::shared_ptr<page_t>> m_pages;
+    std::vector<bool> m_dirty;
+};
+
+inline uint8_t PagedRAM::read(size_t addr) const noexcept
+{
+    return (*m_pages[addr >> PAGE_SHIFT])[addr & (PAGE_SIZE - 1)];
+}
+inline void PagedRAM::write(size_t addr, uint8_t value)
+{
+    const size_t idx = addr >> PAGE_SHIFT;
+    uint8_t* page = this->is_writable(idx) ? m_pages[idx]->data() : this->writable_page(idx);
+    page[addr & (PAGE_SIZE - 1)] = value;
+}
+} // namespace gbc
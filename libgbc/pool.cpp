@@ -0,0 +1,161 @@
+#include "pool.hpp"
+#include "machine.hpp"
+#include <algorithm>
+
+namespace gbc
+{
+// undo whatever the previous job configured, so that every job starts
+// from the same machine no matter which thread it runs on
+static void reset_settings(Machine& machine)
+{
+    machine.io.on_joypad_read(nullptr);
+    for (auto i : {Machine::VBLANK, Machine::TIMER, Machine::JOYPAD, Machine::DEBUG})
+        machine.set_handler(i, nullptr);
+    machine.cpu.breakpoints().clear();
+    machine.cpu.break_on_steps(0);
+    machine.memory.clear_watchpoints();
+    if (!machine.cpu.block_cache_enabled()) machine.cpu.set_block_cache(true);
+    machine.cpu.set_idle_skip(true);
+    machine.gpu.on_palchange(nullptr);
+    machine.gpu.scanline_rendering(true);
+    machine.gpu.set_dmg_variant(LIGHTER_GREEN);
+    if (!machine.gpu.is_headless()) machine.gpu.set_headless(true);
+    machine.apu.on_audio_out(nullptr);
+    machine.apu.set_ring(nullptr);
+    if (machine.apu.sample_rate() != 48000) machine.apu.set_sample_rate(48000);
+    machine.verbose_instructions = false;
+    machine.verbose_interrupts = false;
+    machine.verbose_banking = false;
+    machine.stop_when_undefined = false;
+    machine.break_on_interrupts = false;
+    machine.break_on_io = false;
+}
+
+MachinePool::MachinePool(const std::vector<uint8_t>& rom, unsigned threads)
+    : MachinePool(std::make_shared<const ROM>(rom.data(), rom.size()), threads)
+{}
+MachinePool::MachinePool(std::shared_ptr<const ROM> rom, unsigned threads)
+{
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; i++)
+    {
+        auto w = std::make_unique<worker_t>();
+        w->machine = std::make_unique<Machine>(rom);
+        w->machine->gpu.set_headless(true);
+        m_workers.push_back(std::move(w));
+    }
+    // the threads start once every worker exists, as they steal from each other
+    for (unsigned i = 0; i < threads; i++)
+    {
+        m_workers[i]->thread = std::thread(&MachinePool::worker, this, i);
+    }
+}
+MachinePool::~MachinePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_done = true;
+    }
+    m_work_cv.notify_all();
+    for (auto& w : m_workers) w->thread.join();
+}
+
+uint64_t MachinePool::submit(state_t state, job_t job)
+{
+    if (state == nullptr) throw MachineException("Pool jobs must start from a state");
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        id = m_next_id++;
+        m_pending++;
+    }
+    auto& w = *m_workers[id % m_workers.size()];
+    {
+        std::lock_guard<std::mutex> lock(w.mtx);
+        w.queue.push_back({id, std::move(state), std::move(job)});
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_queued++;
+    }
+    m_work_cv.notify_one();
+    return id;
+}
+
+uint64_t MachinePool::wait_any()
+{
+    std::unique_lock<std::mutex> lock(m_mtx);
+    if (m_pending == 0) throw MachineException("No pool jobs are pending");
+    m_finished_cv.wait(lock, [this] { return !m_finished.empty(); });
+    const finished_t result = m_finished.front();
+    m_finished.pop_front();
+    m_pending--;
+    lock.unlock();
+    if (result.error) std::rethrow_exception(result.error);
+    return result.id;
+}
+
+size_t MachinePool::pending() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_pending;
+}
+
+bool MachinePool::take_task(const unsigned idx, task_t& task)
+{
+    // own jobs are taken from the front, stolen jobs from the back
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        auto& w = *m_workers[(idx + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(w.mtx);
+        if (w.queue.empty()) continue;
+        if (i == 0)
+        {
+            task = std::move(w.queue.front());
+            w.queue.pop_front();
+        }
+        else
+        {
+            task = std::move(w.queue.back());
+            w.queue.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void MachinePool::worker(const unsigned idx)
+{
+    Machine& machine = *m_workers[idx]->machine;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_work_cv.wait(lock, [this] { return m_queued > 0 || m_done; });
+            if (m_done) return;
+            // claim one of the queued tasks, which may be in any queue
+            m_queued--;
+        }
+        task_t task;
+        // the task is queued before it is counted, so this always ends
+        while (!this->take_task(idx, task)) std::this_thread::yield();
+
+        finished_t result{task.id, nullptr};
+        try
+        {
+            reset_settings(machine);
+            machine.restore_state(*task.state);
+            task.job(machine, idx);
+        }
+        catch (...)
+        {
+            result.error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_finished.push_back(result);
+        }
+        m_finished_cv.notify_all();
+    }
+}
+} // namespace gbc
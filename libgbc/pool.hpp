@@ -0,0 +1,85 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gbc
+{
+class Machine;
+class ROM;
+
+// Runs many independent jobs (eg. rollouts) on a fixed set of threads. Every thread
+// owns a headless machine that is reused from job to job by restoring the state the
+// job starts from, so there is no construction cost per job. Each thread has its own
+// queue, and a thread that runs out of jobs steals from the others, so that short
+// jobs never leave a core waiting for the long ones. Results are returned in the
+// order the jobs finish.
+class MachinePool
+{
+public:
+    // the worker index is stable, and can be used for per-thread data
+    using job_t = std::function<void(Machine&, unsigned worker)>;
+    using state_t = std::shared_ptr<const std::vector<uint8_t>>;
+
+    // NOTE: the machines use the ROM as a const reference
+    // zero threads means one for each core
+    MachinePool(const std::vector<uint8_t>& rom, unsigned threads = 0);
+    // every machine shares the same ROM image
+    MachinePool(std::shared_ptr<const ROM> rom, unsigned threads = 0);
+    // queued jobs are discarded, running jobs are waited for
+    ~MachinePool();
+
+    // queue a job that starts from a full save state, returns its id
+    // before every job the machine gets back its pool settings: headless, no
+    // handlers, callbacks, breakpoints or watchpoints, block cache and idle
+    // skipping on, and the default palette and sample rate
+    uint64_t submit(state_t state, job_t job);
+    // wait for the next job to finish, and return its id
+    // rethrows the exception if the job threw, and throws if nothing is pending
+    uint64_t wait_any();
+    // jobs submitted, but not yet returned from wait_any()
+    size_t pending() const;
+
+    unsigned threads() const noexcept { return m_workers.size(); }
+
+private:
+    struct task_t
+    {
+        uint64_t id;
+        state_t state;
+        job_t job;
+    };
+    struct finished_t
+    {
+        uint64_t id;
+        std::exception_ptr error;
+    };
+    struct worker_t
+    {
+        std::unique_ptr<Machine> machine;
+        std::mutex mtx;
+        std::deque<task_t> queue;
+        std::thread thread;
+    };
+    void worker(unsigned idx);
+    bool take_task(unsigned idx, task_t&);
+
+    std::vector<std::unique_ptr<worker_t>> m_workers;
+    uint64_t m_next_id = 0;
+    size_t m_pending = 0;
+
+    mutable std::mutex m_mtx;
+    // queued tasks that no worker has claimed yet
+    size_t m_queued = 0;
+    bool m_done = false;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_finished_cv;
+    std::deque<finished_t> m_finished;
+};
+} // namespace gbc
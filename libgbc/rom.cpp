@@ -0,0 +1,114 @@
+#include "rom.hpp"
+#include "common.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace gbc
+{
+ROM::ROM(const uint8_t* data, size_t size) : m_data(data), m_size(size) { this->parse_header(); }
+ROM::ROM(std::vector<uint8_t> data) : m_owned(std::move(data))
+{
+    this->m_data = m_owned.data();
+    this->m_size = m_owned.size();
+    this->parse_header();
+}
+ROM::~ROM()
+{
+    if (m_mapping != nullptr) munmap(m_mapping, m_size);
+}
+
+std::shared_ptr<const ROM> ROM::map_file(const std::string& filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw MachineException("Could not open ROM file");
+    struct stat st;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) throw MachineException("Could not map ROM file");
+#ifdef MADV_HUGEPAGE
+    // large ROMs can use fewer TLB entries, where the kernel supports it for files
+    madvise(ptr, st.st_size, MADV_HUGEPAGE);
+#endif
+    std::shared_ptr<ROM> rom{new ROM()};
+    rom->m_mapping = ptr;
+    rom->m_data = (const uint8_t*) ptr;
+    rom->m_size = st.st_size;
+    rom->parse_header();
+    return rom;
+}
+
+void ROM::parse_header()
+{
+    auto& hdr = this->m_header;
+    if (m_size < 0x150) return;
+    hdr.valid = true;
+    std::memcpy(hdr.title, &m_data[0x134], 16);
+    hdr.cgb_flag = m_data[0x143];
+    hdr.cartridge_type = m_data[0x147];
+    switch (hdr.cartridge_type)
+    {
+    case 0x0:
+    case 0x1: // MBC 1
+    case 0x2:
+    case 0x3:
+        hdr.mbc_version = 1;
+        break;
+    case 0x5:
+    case 0x6:
+        hdr.mbc_version = 2;
+        hdr.supported = false;
+        break;
+    case 0x0F:
+    case 0x10: // MBC 3
+    case 0x12:
+    case 0x13:
+        hdr.mbc_version = 3;
+        break;
+    case 0x19:
+    case 0x1A: // MBC 5
+    case 0x1B:
+    case 0x1C:
+        hdr.mbc_version = 5;
+        break;
+    case 0x1D:
+    case 0x1E:
+        hdr.mbc_version = 5;
+        hdr.rumble = true;
+        break;
+    default:
+        hdr.supported = false;
+    }
+    // 32kb << N, except for a few odd sizes that no cartridge uses
+    if (m_data[0x148] <= 0x8) hdr.rom_banks = 2 << m_data[0x148];
+    switch (m_data[0x149])
+    {
+    case 0x1: // 2kb
+        hdr.ram_banks = 1;
+        hdr.ram_bank_size = 2048;
+        break;
+    case 0x2: // 8kb
+        hdr.ram_banks = 1;
+        hdr.ram_bank_size = 8192;
+        break;
+    case 0x3: // 32kb
+        hdr.ram_banks = 4;
+        hdr.ram_bank_size = 32768;
+        break;
+    case 0x4: // 128kb
+        hdr.ram_banks = 16;
+        hdr.ram_bank_size = 0x20000;
+        break;
+    case 0x5: // 64kb
+        hdr.ram_banks = 8;
+        hdr.ram_bank_size = 0x10000;
+        break;
+    }
+}
+} // namespace gbc
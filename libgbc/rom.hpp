@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace gbc
+{
+// the cartridge header, parsed once per ROM image
+struct rom_header_t
+{
+    // test ROMs are just instruction arrays, without a header
+    bool valid = false;
+    char title[17] = {};
+    uint8_t cgb_flag = 0;
+    uint8_t cartridge_type = 0;
+    // false for cartridge types the MBC does not implement
+    bool supported = true;
+    uint8_t mbc_version = 1;
+    bool rumble = false;
+    uint16_t rom_banks = 0;
+    uint16_t ram_banks = 0;
+    uint32_t ram_bank_size = 0;
+};
+
+// An immutable ROM image that any number of machines, on any number of threads,
+// can share. It either refers to memory owned by the caller, owns a copy, or maps
+// a file read-only, in which case the pages are shared with every other process
+// that maps the same file.
+class ROM
+{
+public:
+    // refers to the data, which must outlive the image
+    ROM(const uint8_t* data, size_t size);
+    // owns the data
+    explicit ROM(std::vector<uint8_t> data);
+    // throws a MachineException when the file can not be mapped
+    static std::shared_ptr<const ROM> map_file(const std::string& filename);
+    ~ROM();
+    ROM(const ROM&) = delete;
+    ROM& operator=(const ROM&) = delete;
+
+    const uint8_t* data() const noexcept { return m_data; }
+    size_t size() const noexcept { return m_size; }
+    uint8_t operator[](size_t idx) const noexcept { return m_data[idx]; }
+    const rom_header_t& header() const noexcept { return m_header; }
+
+private:
+    ROM() = default;
+    void parse_header();
+
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    std::vector<uint8_t> m_owned;
+    void* m_mapping = nullptr;
+    rom_header_t m_header;
+};
+} // namespace gbc
@@ -0,0 +1,63 @@
+#pragma once
+#include "generators.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace gbc
+{
+// A lock-free ring of audio samples with a single producer (the machine) and a
+// single consumer (eg. an audio device or network thread). When the consumer
+// falls behind, new samples are dropped rather than blocking the emulator.
+class SampleRing
+{
+public:
+    // the capacity is rounded up to a power of two
+    explicit SampleRing(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        this->m_buffer.resize(size);
+        this->m_mask = size - 1;
+    }
+
+    // producer: returns how many samples were stored
+    size_t write(const sample_t* samples, size_t count)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        const size_t stored = std::min(count, m_buffer.size() - (head - tail));
+        for (size_t i = 0; i < stored; i++) m_buffer[(head + i) & m_mask] = samples[i];
+        m_head.store(head + stored, std::memory_order_release);
+        if (stored < count) m_dropped.fetch_add(count - stored, std::memory_order_relaxed);
+        return stored;
+    }
+    // consumer: returns how many samples were read
+    size_t read(sample_t* samples, size_t max)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        const size_t count = std::min(max, head - tail);
+        for (size_t i = 0; i < count; i++) samples[i] = m_buffer[(tail + i) & m_mask];
+        m_tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    size_t available() const noexcept
+    {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+    size_t capacity() const noexcept { return m_buffer.size(); }
+    // samples the producer could not store
+    uint64_t dropped() const noexcept { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<sample_t> m_buffer;
+    size_t m_mask = 0;
+    // the producer and the consumer each write one of them
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+    std::atomic<uint64_t> m_dropped{0};
+};
+} // namespace gbc
@@ -0,0 +1,161 @@
+#include "savestate.hpp"
+#include <cassert>
+
+namespace gbc
+{
+template <typename T> static void store_le(uint8_t* dst, T value)
+{
+    for (size_t i = 0; i < sizeof(T); i++) dst[i] = uint8_t(value >> (8 * i));
+}
+template <typename T> static T load_le(const uint8_t* src)
+{
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) value |= T(src[i]) << (8 * i);
+    return value;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static inline uint64_t read64_le(const uint8_t* src)
+{
+    uint64_t value;
+    std::memcpy(&value, src, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+uint64_t savestate_t::hash64(const uint8_t* data, size_t len) noexcept
+{
+    static constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+    static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+    const auto round = [](uint64_t acc, uint64_t word) {
+        return rotl64(acc + word * P2, 31) * P1;
+    };
+    // four independent lanes so that the multiplications can overlap
+    uint64_t lane0 = P1 + P2, lane1 = P2, lane2 = 0, lane3 = P1 ^ len;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        lane0 = round(lane0, read64_le(&data[i + 0]));
+        lane1 = round(lane1, read64_le(&data[i + 8]));
+        lane2 = round(lane2, read64_le(&data[i + 16]));
+        lane3 = round(lane3, read64_le(&data[i + 24]));
+    }
+    for (; i < len; i++) lane0 = round(lane0, data[i]);
+
+    uint64_t hash = rotl64(lane0, 1) + rotl64(lane1, 7) + rotl64(lane2, 12) + rotl64(lane3, 18);
+    hash ^= hash >> 33;
+    hash *= P2;
+    hash ^= hash >> 29;
+    return hash;
+}
+uint32_t savestate_t::checksum(const uint8_t* data, size_t len) noexcept
+{
+    const uint64_t hash = hash64(data, len);
+    return uint32_t(hash ^ (hash >> 32));
+}
+
+StateWriter::StateWriter(std::vector<uint8_t>& out, uint16_t flags)
+    : m_out(out), m_begin(out.size())
+{
+    this->put<uint32_t>(savestate_t::MAGIC);
+    this->put<uint16_t>(savestate_t::VERSION);
+    this->put<uint16_t>(flags);
+    this->put<uint16_t>(0); // chunk count
+    this->put<uint16_t>(0);
+    this->put<uint32_t>(savestate_t::HEADER_SIZE);
+}
+
+uint8_t* StateWriter::grow(size_t len)
+{
+    const size_t off = m_out.size();
+    m_out.resize(off + len);
+    return &m_out[off];
+}
+void StateWriter::put(const uint8_t* data, size_t len)
+{
+    if (len > 0) std::memcpy(this->grow(len), data, len);
+}
+
+void StateWriter::begin(uint32_t tag, uint16_t version)
+{
+    assert(m_chunk == 0 && "Chunks cannot be nested");
+    m_chunk = m_out.size();
+    this->put<uint32_t>(tag);
+    this->put<uint16_t>(version);
+    this->put<uint16_t>(0);
+    this->put<uint32_t>(0); // payload length
+    this->put<uint32_t>(0); // payload checksum
+}
+void StateWriter::end()
+{
+    assert(m_chunk != 0 && "No chunk has begun");
+    uint8_t* chunk = &m_out[m_chunk];
+    const size_t len = m_out.size() - m_chunk - savestate_t::CHUNK_HEADER_SIZE;
+    store_le<uint32_t>(&chunk[8], len);
+    store_le<uint32_t>(&chunk[12],
+                       savestate_t::checksum(&chunk[savestate_t::CHUNK_HEADER_SIZE], len));
+    m_chunk = 0;
+    // the header always describes every ended chunk
+    uint8_t* header = &m_out[m_begin];
+    store_le<uint16_t>(&header[8], ++m_count);
+    store_le<uint32_t>(&header[12], m_out.size() - m_begin);
+}
+
+const uint8_t* StateReader::take(size_t len)
+{
+    if (UNLIKELY(len > this->remaining())) throw MachineException("Save state chunk is too short");
+    const uint8_t* ptr = &m_data[m_pos];
+    m_pos += len;
+    return ptr;
+}
+
+StateView::StateView(const uint8_t* data, size_t len) : m_data(data)
+{
+    if (len < savestate_t::HEADER_SIZE || load_le<uint32_t>(&data[0]) != savestate_t::MAGIC)
+        throw MachineException("Not a save state");
+    if (load_le<uint16_t>(&data[4]) > savestate_t::VERSION)
+        throw MachineException("Save state is from a newer version");
+    m_flags = load_le<uint16_t>(&data[6]);
+    m_count = load_le<uint16_t>(&data[8]);
+    m_size = load_le<uint32_t>(&data[12]);
+    if (m_size < savestate_t::HEADER_SIZE || m_size > len)
+        throw MachineException("Save state is truncated");
+    // validate every chunk up front, so that restoring cannot fail half-way
+    size_t off = savestate_t::HEADER_SIZE;
+    for (uint16_t i = 0; i < m_count; i++)
+    {
+        if (m_size - off < savestate_t::CHUNK_HEADER_SIZE)
+            throw MachineException("Save state chunk header is truncated");
+        const uint32_t clen = load_le<uint32_t>(&data[off + 8]);
+        off += savestate_t::CHUNK_HEADER_SIZE;
+        if (m_size - off < clen) throw MachineException("Save state chunk is truncated");
+        if (savestate_t::checksum(&data[off], clen) != load_le<uint32_t>(&data[off - 4]))
+            throw MachineException("Save state chunk checksum mismatch");
+        off += clen;
+    }
+    if (off != m_size) throw MachineException("Save state has trailing bytes");
+}
+
+const uint8_t* StateView::find(uint32_t tag) const noexcept
+{
+    size_t off = savestate_t::HEADER_SIZE;
+    for (uint16_t i = 0; i < m_count; i++)
+    {
+        if (load_le<uint32_t>(&m_data[off]) == tag) return &m_data[off];
+        off += savestate_t::CHUNK_HEADER_SIZE + load_le<uint32_t>(&m_data[off + 8]);
+    }
+    return nullptr;
+}
+
+StateReader StateView::chunk(uint32_t tag, uint16_t max_version) const
+{
+    const uint8_t* chunk = this->find(tag);
+    if (chunk == nullptr) throw MachineException("Save state chunk is missing");
+    const uint16_t version = load_le<uint16_t>(&chunk[4]);
+    if (version > max_version) throw MachineException("Save state chunk is from a newer version");
+    return StateReader(&chunk[savestate_t::CHUNK_HEADER_SIZE], load_le<uint32_t>(&chunk[8]),
+                       version);
+}
+} // namespace gbc
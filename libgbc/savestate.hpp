@@ -0,0 +1,125 @@
+#pragma once
+#include "common.hpp"
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace gbc
+{
+// A save state is a header followed by tagged chunks, one or more per component:
+//   header: magic, format version, flags, chunk count, total size
+//   chunk:  tag, chunk version, payload length, payload checksum, payload
+// All integers are little-endian and every field is written separately, so the
+// layout does not depend on the compiler, and chunks that are not recognized are
+// skipped when restoring. Deltas have a BASE chunk with the hash of the full
+// state they were taken against.
+constexpr uint32_t make_tag(const char (&str)[5])
+{
+    return uint32_t(uint8_t(str[0])) | uint32_t(uint8_t(str[1])) << 8 |
+           uint32_t(uint8_t(str[2])) << 16 | uint32_t(uint8_t(str[3])) << 24;
+}
+
+struct savestate_t
+{
+    static constexpr uint32_t MAGIC = make_tag("GBCS");
+    static constexpr uint16_t VERSION = 1;
+    static constexpr size_t HEADER_SIZE = 16;
+    static constexpr size_t CHUNK_HEADER_SIZE = 16;
+    // the state only contains what changed since some base state
+    static constexpr uint16_t FLAG_DELTA = 0x1;
+
+    static uint32_t checksum(const uint8_t* data, size_t len) noexcept;
+    // also used to identify ROMs and states
+    static uint64_t hash64(const uint8_t* data, size_t len) noexcept;
+};
+
+class StateWriter
+{
+public:
+    // appends a header, which is kept up to date as chunks are ended
+    StateWriter(std::vector<uint8_t>& out, uint16_t flags = 0);
+
+    void begin(uint32_t tag, uint16_t version);
+    void end();
+
+    template <typename T> void put(T value);
+    void put(bool value) { this->put<uint8_t>(value); }
+    void put(const uint8_t* data, size_t len);
+
+private:
+    uint8_t* grow(size_t len);
+
+    std::vector<uint8_t>& m_out;
+    size_t m_begin;
+    size_t m_chunk = 0;
+    uint16_t m_count = 0;
+};
+
+// reads the payload of a single chunk
+class StateReader
+{
+public:
+    StateReader(const uint8_t* data, size_t len, uint16_t version)
+        : m_data(data), m_len(len), m_version(version)
+    {}
+
+    uint16_t version() const noexcept { return m_version; }
+    size_t remaining() const noexcept { return m_len - m_pos; }
+
+    template <typename T> T get();
+    void get(bool& value) { value = this->get<uint8_t>() != 0; }
+    template <typename T> void get(T& value) { value = this->get<T>(); }
+    void get(uint8_t* dst, size_t len) { std::memcpy(dst, this->take(len), len); }
+    // direct access to the next len bytes of the payload
+    const uint8_t* take(size_t len);
+
+private:
+    const uint8_t* m_data;
+    size_t m_len;
+    size_t m_pos = 0;
+    uint16_t m_version;
+};
+
+// validates a save state in place, nothing is copied
+// NOTE: the memory must outlive the view (eg. an mmap'd file)
+class StateView
+{
+public:
+    StateView(const uint8_t* data, size_t len);
+    StateView(const std::vector<uint8_t>& data) : StateView(data.data(), data.size()) {}
+
+    // the bytes used by the state, which can be followed by other data
+    size_t size() const noexcept { return m_size; }
+    bool is_delta() const noexcept { return m_flags & savestate_t::FLAG_DELTA; }
+
+    bool has(uint32_t tag) const noexcept { return this->find(tag) != nullptr; }
+    // throws when the chunk is missing, or newer than max_version
+    StateReader chunk(uint32_t tag, uint16_t max_version = 1) const;
+
+private:
+    const uint8_t* find(uint32_t tag) const noexcept;
+
+    const uint8_t* m_data;
+    size_t m_size;
+    uint16_t m_flags;
+    uint16_t m_count;
+};
+
+template <typename T> inline void StateWriter::put(T value)
+{
+    static_assert(std::is_integral_v<T>, "Use put(data, len)");
+    const auto bits = static_cast<std::make_unsigned_t<T>>(value);
+    uint8_t* dst = this->grow(sizeof(T));
+    for (size_t i = 0; i < sizeof(T); i++) dst[i] = uint8_t(bits >> (8 * i));
+}
+
+template <typename T> inline T StateReader::get()
+{
+    static_assert(std::is_integral_v<T>, "Use get(dst, len)");
+    const uint8_t* src = this->take(sizeof(T));
+    std::make_unsigned_t<T> bits = 0;
+    for (size_t i = 0; i < sizeof(T); i++) bits |= std::make_unsigned_t<T>(src[i]) << (8 * i);
+    return static_cast<T>(bits);
+}
+} // namespace gbc
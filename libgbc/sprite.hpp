@@ -1,11 +1,12 @@
 #pragma once
 #include "memory.hpp"
+#include "paged_ram.hpp"
 
 namespace gbc
 {
 struct sprite_config_t
 {
-    const uint8_t* patterns;
+    const PagedRAM* patterns;
     uint8_t palette[2];
     int scan_x;
     int scan_y;
@@ -48,6 +49,24 @@ private:
     uint8_t attr;
 };
 
+// the sprites on a scanline, in drawing order
+struct sprite_list_t
+{
+    // GB/GBC supports 10 sprites max per scanline
+    static const int MAX_SPRITES = 10;
+
+    void push_back(const Sprite* sprite) { sprites[count++] = sprite; }
+    bool full() const noexcept { return count == MAX_SPRITES; }
+    bool empty() const noexcept { return count == 0; }
+    size_t size() const noexcept { return count; }
+    const Sprite* const* begin() const noexcept { return sprites.data(); }
+    const Sprite* const* end() const noexcept { return sprites.data() + count; }
+
+private:
+    std::array<const Sprite*, MAX_SPRITES> sprites;
+    size_t count = 0;
+};
+
 inline uint8_t Sprite::pixel(const sprite_config_t& config) const
 {
     int tx = config.scan_x - start_x();
@@ -58,8 +77,8 @@ inline uint8_t Sprite::pixel(const sprite_config_t& config) const
 
     int offset = this->pattern * 16 + ty * 2;
     if (config.is_cgb) offset += cgb_bank() * 0x2000;
-    uint8_t c0 = config.patterns[offset];
-    uint8_t c1 = config.patterns[offset + 1];
+    uint8_t c0 = config.patterns->read(offset);
+    uint8_t c1 = config.patterns->read(offset + 1);
     // return combined 4-bits, right to left
     const int bit = 7 - tx;
     const int v0 = (c0 >> bit) & 0x1;
@@ -0,0 +1,80 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+// Counters for finding out which paths a game keeps hitting. They are only
+// compiled in when libgbc is built with STATS=ON, which defines GBC_STATS,
+// and otherwise GBC_STAT() expands to nothing.
+#ifdef GBC_STATS
+#define GBC_STAT(expr) expr
+#else
+#define GBC_STAT(expr)
+#endif
+
+namespace gbc
+{
+struct Stats
+{
+#ifdef GBC_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+    enum region_t
+    {
+        ROM,
+        VRAM,
+        CART_RAM,
+        WRAM, // including echo RAM
+        OAM,
+        IO, // including IE
+        HRAM,
+        NUM_REGIONS
+    };
+    static constexpr region_t region(const uint16_t addr) noexcept
+    {
+        if (addr < 0x8000) return ROM;
+        if (addr < 0xA000) return VRAM;
+        if (addr < 0xC000) return CART_RAM;
+        if (addr < 0xFE00) return WRAM;
+        if (addr < 0xFF00) return OAM;
+        if (addr < 0xFF80 || addr == 0xFFFF) return IO;
+        return HRAM;
+    }
+    static const char* region_name(int region) noexcept
+    {
+        static const char* const names[NUM_REGIONS] = {"ROM", "VRAM", "CartRAM", "WRAM",
+                                                       "OAM", "IO",   "HRAM"};
+        return names[region];
+    }
+
+    // executed instructions by opcode, where CB-prefixed ones are
+    // counted as 0xCB and again by their second byte
+    std::array<uint64_t, 256> opcodes = {};
+    std::array<uint64_t, 256> cb_opcodes = {};
+    // reads and writes through Memory::read8() and write8(), which is
+    // everything except operands of pre-decoded instructions and DMA
+    std::array<uint64_t, NUM_REGIONS> reads = {};
+    std::array<uint64_t, NUM_REGIONS> writes = {};
+    // I/O register accesses, by the low byte of the address
+    std::array<uint64_t, 256> io_reads = {};
+    std::array<uint64_t, 256> io_writes = {};
+    // by interrupt bit: V-blank, LCD STAT, timer, serial and joypad
+    std::array<uint64_t, 5> interrupts = {};
+    uint64_t oam_dma_bytes = 0;
+    uint64_t vram_dma_bytes = 0; // both general purpose and H-blank DMA
+    // every bank select, even of the bank that is already selected
+    uint64_t rom_bank_switches = 0;
+    uint64_t ram_bank_switches = 0;
+    uint64_t wram_bank_switches = 0;
+    uint64_t vram_bank_switches = 0;
+    uint64_t scanlines = 0;
+
+    uint64_t instructions() const noexcept
+    {
+        uint64_t total = 0;
+        for (const auto count : opcodes) total += count;
+        return total;
+    }
+};
+} // namespace gbc
@@ -1,5 +1,7 @@
 #pragma once
 #include "memory.hpp"
+#include "paged_ram.hpp"
+#include "tilerow.hpp"
 
 namespace gbc
 {
@@ -15,19 +17,23 @@ public:
     static const int TILE_W = 8;
     static const int TILE_H = 8;
 
-    TileData(const uint8_t* tile, const uint8_t* pattern, const uint8_t* attr, bool sign)
-        : m_tile_base(tile), m_patt_base(pattern), m_attr_base(attr), m_signed(sign)
+    // patterns are read from video RAM, starting at the given offset
+    TileData(const uint8_t* tile, const PagedRAM& vram, uint16_t pattern, const uint8_t* attr,
+             bool sign)
+        : m_tile_base(tile), m_vram(vram), m_patt_offset(pattern), m_attr_base(attr), m_signed(sign)
     {}
 
     int tile_attr(int tx, int ty);
     int tile_id(int tx, int ty);
     int pattern(int t, int tattr, int dx, int dy) const;
-    int pattern(const uint8_t* base, int tattr, int t, int dx, int dy) const;
+    // the two bitplanes of a tile row, X-flipped when the attribute says so
+    void pattern_planes(int t, int tattr, int dy, uint8_t* dst) const;
     void set_tilebase(const uint8_t* new_base) { m_tile_base = new_base; }
 
 private:
     const uint8_t* m_tile_base;
-    const uint8_t* m_patt_base;
+    const PagedRAM& m_vram;
+    const uint16_t m_patt_offset;
     const uint8_t* m_attr_base;
     const bool m_signed;
 };
@@ -43,23 +49,33 @@ inline int TileData::tile_attr(int x, int y)
     return m_attr_base[y * 32 + x];
 }
 
-inline int TileData::pattern(const uint8_t* base, int tid, int tattr, int tx, int ty) const
+inline int TileData::pattern(int tid, int tattr, int tx, int ty) const
 {
     if (tattr & 0x20) tx = 7 - tx;
     if (tattr & 0x40) ty = 7 - ty;
-    if (tattr & 0x08) base += 0x2000;
-    const int offset = 16 * tid + ty * 2;
+    int offset = m_patt_offset + 16 * tid + ty * 2;
+    if (tattr & 0x08) offset += 0x2000;
     // get 16-bit c0, c1
-    uint8_t c0 = base[offset];
-    uint8_t c1 = base[offset + 1];
+    uint8_t c0 = m_vram.read(offset);
+    uint8_t c1 = m_vram.read(offset + 1);
     // return combined 4-bits, right to left
     const int bit = 7 - tx;
     const int v0 = (c0 >> bit) & 0x1;
     const int v1 = (c1 >> bit) & 0x1;
     return v0 | (v1 << 1);
 } // pattern(...)
-inline int TileData::pattern(int tid, int tattr, int tx, int ty) const
+inline void TileData::pattern_planes(int tid, int tattr, int ty, uint8_t* dst) const
 {
-    return pattern(m_patt_base, tid, tattr, tx, ty);
+    if (tattr & 0x40) ty = 7 - ty;
+    int offset = m_patt_offset + 16 * tid + ty * 2;
+    if (tattr & 0x08) offset += 0x2000;
+    if (tattr & 0x20)
+    {
+        dst[0] = TILEROW_FLIP[m_vram.read(offset)];
+        dst[1] = TILEROW_FLIP[m_vram.read(offset + 1)];
+        return;
+    }
+    dst[0] = m_vram.read(offset);
+    dst[1] = m_vram.read(offset + 1);
 }
 } // namespace gbc
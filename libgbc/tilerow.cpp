@@ -0,0 +1,117 @@
+#include "tilerow.hpp"
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GBC_TILEROW_X86
+#endif
+
+namespace gbc
+{
+using expand_func_t = void (*)(const uint8_t*, int, uint8_t*);
+
+// each plane bit spread out into its own byte, leftmost pixel first
+static constexpr std::array<uint64_t, 256> make_spread()
+{
+    std::array<uint64_t, 256> table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t v = 0;
+        for (int px = 0; px < 8; px++) v |= uint64_t((i >> (7 - px)) & 0x1) << (8 * px);
+        table[i] = v;
+    }
+    return table;
+}
+static constexpr std::array<uint64_t, 256> SPREAD = make_spread();
+
+static inline void expand_row_scalar(const uint8_t* planes, uint8_t* dst)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint64_t row = SPREAD[planes[0]] | (SPREAD[planes[1]] << 1);
+    std::memcpy(dst, &row, 8);
+#else
+    for (int px = 0; px < 8; px++)
+    {
+        const int bit = 7 - px;
+        dst[px] = ((planes[0] >> bit) & 0x1) | (((planes[1] >> bit) & 0x1) << 1);
+    }
+#endif
+}
+
+static void expand_scalar(const uint8_t* planes, int rows, uint8_t* dst)
+{
+    for (int i = 0; i < rows; i++) expand_row_scalar(&planes[i * 2], &dst[i * 8]);
+}
+
+#ifdef GBC_TILEROW_X86
+// two rows per iteration: broadcast each plane byte across 8 lanes,
+// test one bit per lane and merge the two planes
+__attribute__((target("sse2"))) static void
+expand_sse2(const uint8_t* planes, int rows, uint8_t* dst)
+{
+    const __m128i mask = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char) 128, 1, 2, 4, 8, 16, 32, 64,
+                                      (char) 128);
+    const __m128i weight = _mm_set_epi8(2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1);
+    int i = 0;
+    for (; i + 2 <= rows; i += 2)
+    {
+        int32_t pair;
+        std::memcpy(&pair, &planes[i * 2], 4);
+        __m128i x = _mm_cvtsi32_si128(pair);
+        x = _mm_unpacklo_epi8(x, x);
+        x = _mm_unpacklo_epi16(x, x);
+        // [c0 x8 | c1 x8] for each of the two rows
+        const __m128i ra = _mm_unpacklo_epi32(x, x);
+        const __m128i rb = _mm_unpackhi_epi32(x, x);
+        __m128i a = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(ra, mask), mask), weight);
+        __m128i b = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(rb, mask), mask), weight);
+        a = _mm_or_si128(a, _mm_srli_si128(a, 8));
+        b = _mm_or_si128(b, _mm_srli_si128(b, 8));
+        _mm_storeu_si128((__m128i*) &dst[i * 8], _mm_unpacklo_epi64(a, b));
+    }
+    for (; i < rows; i++) expand_row_scalar(&planes[i * 2], &dst[i * 8]);
+}
+
+// four rows per iteration, one pair of rows in each 128-bit lane
+__attribute__((target("avx2"))) static void
+expand_avx2(const uint8_t* planes, int rows, uint8_t* dst)
+{
+    const __m256i mask = _mm256_set1_epi64x(0x0102040810204080ll);
+    const __m256i shuf_c0 = _mm256_set_epi64x(0x0606060606060606ll, 0x0404040404040404ll,
+                                              0x0202020202020202ll, 0x0000000000000000ll);
+    const __m256i shuf_c1 = _mm256_set_epi64x(0x0707070707070707ll, 0x0505050505050505ll,
+                                              0x0303030303030303ll, 0x0101010101010101ll);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+    int i = 0;
+    for (; i + 4 <= rows; i += 4)
+    {
+        int64_t quad;
+        std::memcpy(&quad, &planes[i * 2], 8);
+        const __m256i x = _mm256_set1_epi64x(quad);
+        const __m256i p0 = _mm256_shuffle_epi8(x, shuf_c0);
+        const __m256i p1 = _mm256_shuffle_epi8(x, shuf_c1);
+        const __m256i v0 = _mm256_cmpeq_epi8(_mm256_and_si256(p0, mask), mask);
+        const __m256i v1 = _mm256_cmpeq_epi8(_mm256_and_si256(p1, mask), mask);
+        const __m256i v = _mm256_or_si256(_mm256_and_si256(v0, one), _mm256_and_si256(v1, two));
+        _mm256_storeu_si256((__m256i*) &dst[i * 8], v);
+    }
+    if (i < rows) expand_sse2(&planes[i * 2], rows - i, &dst[i * 8]);
+}
+#endif
+
+static expand_func_t select_kernel()
+{
+#ifdef GBC_TILEROW_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return expand_avx2;
+    if (__builtin_cpu_supports("sse2")) return expand_sse2;
+#endif
+    return expand_scalar;
+}
+static const expand_func_t expand_kernel = select_kernel();
+
+void expand_tile_rows(const uint8_t* planes, int rows, uint8_t* dst)
+{
+    expand_kernel(planes, rows, dst);
+}
+} // namespace gbc
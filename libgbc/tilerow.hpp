@@ -0,0 +1,24 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+namespace gbc
+{
+// X-flipping a tile row is the same as reversing the bits of both bitplanes
+constexpr std::array<uint8_t, 256> make_tilerow_flip()
+{
+    std::array<uint8_t, 256> table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        uint8_t rev = 0;
+        for (int bit = 0; bit < 8; bit++) rev |= ((i >> bit) & 0x1) << (7 - bit);
+        table[i] = rev;
+    }
+    return table;
+}
+inline constexpr std::array<uint8_t, 256> TILEROW_FLIP = make_tilerow_flip();
+
+// expand rows of bitplane pairs (c0, c1) into 8 palette indices per row,
+// using the fastest kernel for this CPU (AVX2, SSE2 or scalar)
+void expand_tile_rows(const uint8_t* planes, int rows, uint8_t* dst);
+} // namespace gbc
@@ -7,8 +7,8 @@
 #include <timers>
 
 #include <machine.hpp>
+#include <movie.hpp>
 static int vblank_timer = -1;
-static bool vblanked = false;
 static std::chrono::milliseconds vblspeed;
 void set_gamespeed(gbc::Machine* machine, std::chrono::milliseconds vbl_delay)
 {
@@ -17,16 +17,14 @@ void set_gamespeed(gbc::Machine* machine, std::chrono::milliseconds vbl_delay)
     vblank_timer = Timers::oneshot(vblspeed, [machine](int) {
         if (!machine->is_running()) return;
         // create a new frame
-        while (vblanked == false) { machine->simulate(); }
-        vblanked = false;
+        machine->run_frames(1);
         set_gamespeed(machine, vblspeed);
     });
 }
 
 // use training data
 static constexpr bool USE_GIS = true;
-static fs::buffer_t keyboard_buffer = nullptr;
-static size_t gis_counter = 0;
+static gbc::InputMovie movie;
 
 #include "backbuffer.cpp"
 #include <hw/vga_gfx.hpp>
@@ -52,30 +50,18 @@ void Service::start()
     // let's keep this loaded, as the machine only takes a reference
     static auto romdata = std::move(*rombuffer.get());
 
-    // AI keyboard buffer
-    if constexpr (USE_GIS) { keyboard_buffer = filesys.read_file("/output.gis").get(); }
-
     // the gbz80 machine
     static gbc::Machine* machine = nullptr;
     machine = new gbc::Machine(romdata);
 
     if constexpr (USE_GIS)
     {
-        // trap on keyboard reads
-        machine->io.on_joypad_read([](gbc::Machine& machine, const int mode) {
-            if (mode == 1)
-            {
-                if (gis_counter < keyboard_buffer->size())
-                {
-                    machine.set_inputs(keyboard_buffer->at(gis_counter));
-                    gis_counter++;
-                }
-                else
-                {
-                    machine.stop();
-                }
-            }
-        });
+        // AI keyboard buffer, replayed on keyboard reads
+        auto buffer = filesys.read_file("/output.gis");
+        assert(buffer.is_valid());
+        const auto& gis = *buffer.get();
+        movie = gbc::InputMovie::load(gis.data(), gis.size());
+        movie.play(*machine);
     }
 
     // trap on V-blank
@@ -95,7 +81,7 @@ void Service::start()
             }
         // blit to front framebuffer here
         gbz80_limited_blit(backbuffer.data());
-        vblanked = true;
+        if (USE_GIS && movie.finished()) machine.stop();
         // restore state
         // machine.restore_state(vec);
     });
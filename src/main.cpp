@@ -53,27 +53,30 @@ int main(int argc, char** args)
     const char* romfile = "tests/bits_ram_en.gb";
     if (argc >= 2) romfile = args[1];
 
-    const auto romdata = load_file(romfile);
-    printf("Loaded %zu bytes ROM\n", romdata.size());
+    const auto rom = gbc::ROM::map_file(romfile);
+    printf("Loaded %zu bytes ROM\n", rom->size());
 
-    machine = new gbc::Machine(romdata);
+    machine = new gbc::Machine(rom);
     machine->gpu.scanline_rendering(false);
+    // optionally continue from a save state
+    if (argc >= 3)
+    {
+        const mapped_file_t state{args[2]};
+        machine->restore_state(gbc::StateView{state.data(), state.size()});
+        printf("Restored state from %s\n", args[2]);
+    }
     machine->break_now();
     /*
     //machine->cpu.default_pausepoint(0x453);
-    machine->memory.breakpoint(gbc::Memory::READ,
+    machine->memory.watchpoint(gbc::Memory::READ, {0xDF40, 0xDF40},
                     [] (gbc::Memory& mem, uint16_t addr, uint8_t) {
-                            if (addr == 0xDF40) {
-                                    printf("Something is reading from %04X\n", addr);
-                                    mem.machine().break_now();
-                            }
+                            printf("Something is reading from %04X\n", addr);
+                            mem.machine().break_now();
                     });
-    machine->memory.breakpoint(gbc::Memory::WRITE,
+    machine->memory.watchpoint(gbc::Memory::WRITE, {0xDF40, 0xDF40},
                     [] (gbc::Memory& mem, uint16_t addr, uint8_t value) {
-                            if (addr == 0xDF40) {
-                                    printf("Something is writing %02X to %04X\n", value, addr);
-                                    mem.machine().break_now();
-                            }
+                            printf("Something is writing %02X to %04X\n", value, addr);
+                            mem.machine().break_now();
                     });
     */
     // machine->cpu.default_pausepoint(0x3b89);
@@ -100,6 +103,11 @@ int main(int argc, char** args)
             const char* tilefile = "tiles1.bmp";
             save_screenshot(tilefile, machine.gpu.dump_tiles(1));
         }
+        // and the machine state, which can be given as the second argument
+        std::vector<uint8_t> state;
+        machine.serialize_state(state);
+        save_file("savestate.bin", state);
+        printf("*** Stored machine state in savestate.bin\n");
     });
     machine->gpu.on_palchange([](const uint8_t idx, const uint16_t color) {
         const uint32_t r = ((color >> 0) & 0x1f) << 3;
@@ -111,6 +119,6 @@ int main(int argc, char** args)
         palette.at(idx) = rgba;
     });
 
-    while (machine->is_running()) { machine->simulate(); }
+    while (machine->is_running()) { machine->run_frames(1); }
     return 0;
 }
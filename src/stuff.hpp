@@ -3,7 +3,10 @@
 #include <cstdint>
 #include <cstdio>
 #include <stdexcept>
+#include <fcntl.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
@@ -27,6 +30,36 @@ static inline std::vector<uint8_t> load_file(const std::string& filename)
     return result;
 }
 
+// read-only mapping of a whole file, eg. for restoring save states without copying them
+class mapped_file_t
+{
+public:
+    mapped_file_t(const std::string& filename)
+    {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Could not open file: " + filename);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            m_size = st.st_size;
+            void* ptr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) m_data = (const uint8_t*) ptr;
+        }
+        close(fd);
+        if (m_data == nullptr) throw std::runtime_error("Could not map file: " + filename);
+    }
+    ~mapped_file_t() { munmap((void*) m_data, m_size); }
+    mapped_file_t(const mapped_file_t&) = delete;
+    mapped_file_t& operator=(const mapped_file_t&) = delete;
+
+    const uint8_t* data() const noexcept { return m_data; }
+    size_t size() const noexcept { return m_size; }
+
+private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+};
+
 template <typename C>
 static inline void save_file(const std::string& filename, const C& data)
 {
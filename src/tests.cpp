@@ -1,4 +1,14 @@
 #include <libgbc/machine.hpp>
+#include <libgbc/archive.hpp>
+#include <libgbc/lz.hpp>
+#include <libgbc/movie.hpp>
+#include <libgbc/pool.hpp>
+#include <libgbc/savestate.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
 using namespace gbc;
 
 inline void execute_n(gbc::Machine& m, int n)
@@ -16,9 +26,674 @@ static void test_alu()
     assert(machine.cpu.registers().accum == 0xfe);
 }
 
+// counts up in work RAM, and copies the count to video RAM
+static std::shared_ptr<const ROM> counter_rom()
+{
+    std::vector<uint8_t> rom(0x8000);
+    const std::vector<uint8_t> program = {
+        0x21, 0x00, 0xC0, // LD HL, 0xC000
+        0x34,             // INC (HL)
+        0x7E,             // LD A, (HL)
+        0xEA, 0x00, 0x80, // LD (0x8000), A
+        0x18, 0xF9        // JR -7
+    };
+    std::copy(program.begin(), program.end(), rom.begin() + 0x100);
+    return std::make_shared<const ROM>(std::move(rom));
+}
+
+static std::vector<uint8_t> save(const Machine& machine)
+{
+    std::vector<uint8_t> state;
+    machine.serialize_state(state);
+    return state;
+}
+
+template <typename F> static bool throws(F func)
+{
+    try
+    {
+        func();
+    }
+    catch (const MachineException&)
+    {
+        return true;
+    }
+    return false;
+}
+
+// where the payload of a chunk starts
+static size_t find_chunk(const std::vector<uint8_t>& state, const char (&tag)[5])
+{
+    size_t off = savestate_t::HEADER_SIZE;
+    while (std::memcmp(&state[off], tag, 4) != 0)
+    {
+        const uint32_t len = state[off + 8] | state[off + 9] << 8 | state[off + 10] << 16 |
+                             state[off + 11] << 24;
+        off += savestate_t::CHUNK_HEADER_SIZE + len;
+    }
+    return off + savestate_t::CHUNK_HEADER_SIZE;
+}
+// the checksum has to match again after changing a payload
+static void fix_checksum(std::vector<uint8_t>& state, const size_t payload)
+{
+    uint8_t* header = &state[payload - savestate_t::CHUNK_HEADER_SIZE];
+    const uint32_t len = header[8] | header[9] << 8 | header[10] << 16 | header[11] << 24;
+    const uint32_t checksum = savestate_t::checksum(&state[payload], len);
+    for (int i = 0; i < 4; i++) header[12 + i] = checksum >> (8 * i);
+}
+
+// machines on threads share one mapped image, and run like one that owns a copy
+static void test_rom()
+{
+    const auto image = counter_rom();
+    char name[] = "/tmp/gbc-rom-XXXXXX";
+    const int fd = mkstemp(name);
+    assert(fd >= 0);
+    assert(write(fd, image->data(), image->size()) == (ssize_t) image->size());
+    close(fd);
+    const auto mapped = ROM::map_file(name);
+    // the mapping outlives the file
+    unlink(name);
+    assert(throws([&] { ROM::map_file(name); }));
+    assert(mapped->size() == image->size());
+    assert(std::equal(image->data(), image->data() + image->size(), mapped->data()));
+    assert(mapped->header().valid && mapped->header().rom_banks == 2);
+
+    Machine first(mapped);
+    Machine second(mapped);
+    std::thread thread([&] { first.run_frames(10); });
+    second.run_frames(10);
+    thread.join();
+    const std::vector<uint8_t> copy(image->data(), image->data() + image->size());
+    Machine owner(copy);
+    owner.run_frames(10);
+    assert(save(first) == save(owner));
+    assert(save(second) == save(owner));
+}
+
+// MBC1 with four banks: bank 0 calls a routine at 0x4000 in banks 1 to 3, and
+// one in bank 1 that switches to bank 2 half-way through, so that it carries
+// on with the code bank 2 has at the same address
+static std::shared_ptr<const ROM> banked_rom()
+{
+    std::vector<uint8_t> rom(0x10000);
+    rom[0x147] = 0x01; // MBC1
+    rom[0x148] = 0x01; // 64kb
+    // JP 0x150, past the header
+    rom[0x100] = 0xC3;
+    rom[0x101] = 0x50;
+    rom[0x102] = 0x01;
+    const std::vector<uint8_t> program = {
+        0x21, 0x00, 0xC0,                               // LD HL, 0xC000
+        0x3E, 0x01, 0xEA, 0x00, 0x20, 0xCD, 0x00, 0x40, // bank 1, CALL 0x4000
+        0x3E, 0x02, 0xEA, 0x00, 0x20, 0xCD, 0x00, 0x40, // bank 2, CALL 0x4000
+        0x3E, 0x03, 0xEA, 0x00, 0x20, 0xCD, 0x00, 0x40, // bank 3, CALL 0x4000
+        0x3E, 0x01, 0xEA, 0x00, 0x20, 0xCD, 0x10, 0x40, // bank 1, CALL 0x4010
+        0x18, 0xDE                                      // JR -34
+    };
+    std::copy(program.begin(), program.end(), rom.begin() + 0x150);
+    for (uint8_t bank = 1; bank < 4; bank++)
+    {
+        const std::vector<uint8_t> routine = {
+            0x7E,       // LD A, (HL)
+            0xC6, bank, // ADD A, bank
+            0x22,       // LD (HL+), A
+            0xCB, 0xA4, // RES 4, H
+            0xC9        // RET
+        };
+        std::copy(routine.begin(), routine.end(), rom.begin() + bank * 0x4000);
+    }
+    const std::vector<uint8_t> switching = {
+        0x3E, 0x02,       // LD A, 2
+        0xEA, 0x00, 0x20, // LD (0x2000), A
+        0x05, 0xC9        // DEC B, RET (never run)
+    };
+    std::copy(switching.begin(), switching.end(), rom.begin() + 0x4010);
+    const std::vector<uint8_t> landing = {0x04, 0x04, 0xC9}; // INC B, INC B, RET
+    std::copy(landing.begin(), landing.end(), rom.begin() + 0x8015);
+    return std::make_shared<const ROM>(std::move(rom));
+}
+
+// blocks are picked by the bank that is mapped in, also mid-block
+static void test_block_cache()
+{
+    const auto rom = banked_rom();
+    Machine cached(rom);
+    Machine plain(rom);
+    plain.cpu.set_block_cache(false);
+    cached.run_frames(10);
+    plain.run_frames(10);
+    assert(cached.cpu.registers().b != 0 && (cached.cpu.registers().b & 1) == 0);
+    assert(save(cached) == save(plain));
+}
+
+// halts until V-blank, then polls a flag in work RAM that the V-blank
+// handler sets, and counts the frames at 0xC000
+static std::shared_ptr<const ROM> idle_rom()
+{
+    std::vector<uint8_t> rom(0x8000);
+    const std::vector<uint8_t> handler = {
+        0xF5,             // PUSH AF
+        0x3E, 0x01,       // LD A, 1
+        0xEA, 0x00, 0xC1, // LD (0xC100), A
+        0xF1,             // POP AF
+        0xD9              // RETI
+    };
+    std::copy(handler.begin(), handler.end(), rom.begin() + 0x40);
+    const std::vector<uint8_t> program = {
+        0x3E, 0x01,       // LD A, 1
+        0xE0, 0xFF,       // LDH (IE), A
+        0xFB,             // EI
+        0x76,             // HALT
+        0x00,             // NOP
+        0xAF,             // XOR A
+        0xEA, 0x00, 0xC1, // LD (0xC100), A
+        0xFA, 0x00, 0xC1, // LD A, (0xC100)
+        0xB7,             // OR A
+        0x28, 0xFA,       // JR Z, -6
+        0x21, 0x00, 0xC0, // LD HL, 0xC000
+        0x34,             // INC (HL)
+        0x18, 0xEE        // JR -18
+    };
+    std::copy(program.begin(), program.end(), rom.begin() + 0x100);
+    return std::make_shared<const ROM>(std::move(rom));
+}
+
+// skipping ahead when halted or polling is only done when nothing can tell
+static void test_idle_skip()
+{
+    const auto rom = idle_rom();
+    Machine skipping(rom);
+    Machine stepping(rom);
+    stepping.cpu.set_idle_skip(false);
+    int reads[2] = {};
+    skipping.memory.watchpoint(Memory::READ, {0xC100, 0xC100},
+                               [&](Memory&, uint16_t, uint8_t) { reads[0]++; });
+    stepping.memory.watchpoint(Memory::READ, {0xC100, 0xC100},
+                               [&](Memory&, uint16_t, uint8_t) { reads[1]++; });
+    skipping.run_frames(10);
+    stepping.run_frames(10);
+    assert(skipping.memory.read8(0xC000) >= 4);
+    assert(reads[0] > 1000 && reads[0] == reads[1]);
+    assert(save(skipping) == save(stepping));
+
+    // and without the watchpoint, skipping gets to the same place
+    skipping.memory.clear_watchpoints();
+    stepping.memory.clear_watchpoints();
+    skipping.run_frames(10);
+    stepping.run_frames(10);
+    assert(save(skipping) == save(stepping));
+}
+
+// restarts the divider, starts the timer and halts until each overflow
+static std::shared_ptr<const ROM> timer_rom(const uint8_t tac, const uint8_t tma)
+{
+    std::vector<uint8_t> rom(0x8000);
+    rom[0x50] = 0xD9; // RETI
+    const std::vector<uint8_t> program = {
+        0xAF,       // XOR A
+        0xE0, 0x04, // LDH (DIV), A
+        0x3E, tma,  // LD A, tma
+        0xE0, 0x06, // LDH (TMA), A
+        0xE0, 0x05, // LDH (TIMA), A
+        0x3E, tac,  // LD A, tac
+        0xE0, 0x07, // LDH (TAC), A
+        0x3E, 0x04, // LD A, 4
+        0xE0, 0xFF, // LDH (IE), A
+        0xFB,       // EI
+        0x76,       // HALT
+        0x00,       // NOP
+        0x18, 0xFC  // JR -4
+    };
+    std::copy(program.begin(), program.end(), rom.begin() + 0x100);
+    return std::make_shared<const ROM>(std::move(rom));
+}
+
+// TIMA is counted in bulk, but overflows as often as when it was counted
+// tick by tick, whether the halts are skipped or stepped through
+static void test_timer()
+{
+    const struct
+    {
+        uint8_t tac;
+        uint8_t tma;
+        uint64_t interval;
+    } timers[] = {
+        // the reload waits out the increment that falls within its 4 ticks
+        {0x05, 0xF0, 16 * 17},
+        {0x06, 0x00, 64 * 256},
+        {0x04, 0xC0, 1024 * 64},
+    };
+    for (const auto& timer : timers)
+    {
+        const auto rom = timer_rom(timer.tac, timer.tma);
+        std::vector<uint64_t> times[2];
+        Machine skipping(rom);
+        Machine stepping(rom);
+        stepping.cpu.set_idle_skip(false);
+        stepping.cpu.set_block_cache(false);
+        skipping.set_handler(Machine::TIMER, [&](Machine& m, interrupt_t&) {
+            times[0].push_back(m.now());
+        });
+        stepping.set_handler(Machine::TIMER, [&](Machine& m, interrupt_t&) {
+            times[1].push_back(m.now());
+        });
+        skipping.run_frames(30);
+        stepping.run_frames(30);
+        assert(times[0].size() >= 30 && times[0] == times[1]);
+        for (size_t i = 1; i < times[0].size(); i++)
+            assert(times[0][i] - times[0][i - 1] == timer.interval);
+        assert(save(skipping) == save(stepping));
+    }
+}
+
+// block copies against copying byte by byte, from sources that cross pages
+// or banks, end where their region ends, or are not mapped at all
+static void test_dma()
+{
+    Machine fast(counter_rom());
+    Machine slow(counter_rom());
+    for (Machine* machine : {&fast, &slow})
+    {
+        // with the LCD off video RAM can always be written
+        machine->memory.write8(0xFF40, 0x00);
+        for (int i = 0; i < 0x2000; i++) machine->memory.write8(0xC000 + i, i * 7 + (i >> 8));
+    }
+    const struct
+    {
+        uint16_t src;
+        size_t offset;
+        size_t bytes;
+    } oam_copies[] = {
+        {0xCFA0, 0, 160}, {0xDF60, 0, 160}, {0xDFD0, 112, 48},
+        {0x3FB0, 0, 160}, {0xA000, 0, 160}, {0xFD60, 0, 160},
+    };
+    for (const auto& copy : oam_copies)
+    {
+        fast.memory.dma_to_oam(copy.src, copy.offset, copy.bytes);
+        for (size_t i = 0; i < copy.bytes; i++)
+        {
+            const uint8_t value = slow.memory.read8(copy.src + i);
+            slow.memory.write8(Memory::OAM_RAM.first + copy.offset + i, value);
+        }
+        assert(save(fast) == save(slow));
+    }
+    const struct
+    {
+        uint16_t src;
+        uint16_t dst;
+        size_t bytes;
+    } vram_copies[] = {
+        {0x3FF0, 0x8000, 32}, {0xCFF0, 0x8FF0, 32}, {0xDFE0, 0x9FE0, 32}, {0xC000, 0x9FF0, 32},
+        {0x8000, 0x8800, 64}, {0xA000, 0x9000, 16}, {0xFD00, 0x8100, 256},
+    };
+    for (const auto& copy : vram_copies)
+    {
+        fast.memory.dma_to_vram(copy.src, copy.dst, copy.bytes);
+        for (size_t i = 0; i < copy.bytes; i++)
+            slow.memory.write8(copy.dst + i, slow.memory.read8(copy.src + i));
+        assert(save(fast) == save(slow));
+    }
+
+    // a timed transfer hides OAM until it has copied everything
+    fast.memory.write8(0xFF46, 0xDF);
+    assert(fast.memory.read8(0xFE00) == 0xFF);
+    fast.run_for_cycles(4 * 170);
+    for (int i = 0; i < 160; i++)
+        assert(fast.memory.read8(0xFE00 + i) == fast.memory.read8(0xDF00 + i));
+}
+
+static void test_savestate_errors()
+{
+    Machine machine(counter_rom());
+    machine.run_frames(2);
+    const auto good = save(machine);
+    machine.run_frames(1);
+    const auto before = save(machine);
+
+    // damaged payload
+    auto bad = good;
+    bad[find_chunk(bad, "MEM ")] ^= 0x1;
+    assert(throws([&] { machine.restore_state(bad); }));
+    // truncated chunk
+    bad = good;
+    bad.resize(bad.size() - 16);
+    assert(throws([&] { machine.restore_state(bad); }));
+    // the video bank is either 0x0 or 0x2000
+    bad = good;
+    const size_t gpu = find_chunk(bad, "GPU ");
+    bad[gpu + 20] = 0x00;
+    bad[gpu + 21] = 0xF0;
+    fix_checksum(bad, gpu);
+    assert(throws([&] { machine.restore_state(bad); }));
+    // missing chunk, after the chunks that are restored first
+    bad = good;
+    bad[find_chunk(bad, "GPU ") - savestate_t::CHUNK_HEADER_SIZE] = 'X';
+    assert(throws([&] { machine.restore_state(bad); }));
+    // nothing was restored
+    assert(save(machine) == before);
+
+    machine.restore_state(good);
+    assert(save(machine) == good);
+
+    // states from before there was sound restore with the sound reset
+    bad = good;
+    const size_t apu = find_chunk(bad, "APU ");
+    bad[apu - savestate_t::CHUNK_HEADER_SIZE] = 'X';
+    machine.restore_state(bad);
+    const auto silent = save(machine);
+    const auto reset = save(Machine(counter_rom()));
+    assert(std::equal(&silent[apu], &silent[silent.size()], &reset[find_chunk(reset, "APU ")]));
+}
+
+static void test_delta_chain()
+{
+    Machine machine(counter_rom());
+    machine.run_frames(2);
+    const auto base = save(machine);
+    machine.set_delta_base();
+    // every delta is against the state before it
+    std::vector<std::vector<uint8_t>> deltas;
+    for (int i = 0; i < 3; i++)
+    {
+        machine.run_frames(1);
+        deltas.emplace_back();
+        machine.serialize_delta(deltas.back());
+        machine.set_delta_base();
+    }
+    // deltas only have the pages that were written
+    assert(deltas.back().size() < base.size());
+
+    Machine other(counter_rom());
+    other.restore_chain(base, deltas);
+    assert(save(other) == save(machine));
+    // and are not full states
+    assert(throws([&] { other.restore_state(deltas.back()); }));
+
+    // a delta only applies to the state it was taken against
+    Machine third(counter_rom());
+    third.restore_state(base);
+    assert(throws([&] { third.restore_delta(deltas[1]); }));
+    assert(save(third) == base);
+    third.restore_delta(deltas[0]);
+    third.restore_delta(deltas[1]);
+}
+
+static void test_fork()
+{
+    Machine parent(counter_rom());
+    parent.run_frames(2);
+    auto child = parent.fork();
+    // forking syncs the parent, so compare from here
+    const auto before = save(parent);
+    assert(save(*child) == before);
+
+    // diverge: the child runs on and writes over the shared pages
+    child->run_frames(3);
+    child->memory.write8(0xC100, 0x55);
+    assert(child->memory.read8(0xC100) == 0x55);
+    assert(save(parent) == before);
+    assert(parent.memory.read8(0xC100) == 0x00);
+
+    // and the parent gets to the same state on its own
+    parent.run_frames(3);
+    child->memory.write8(0xC100, 0x00);
+    assert(save(parent) == save(*child));
+}
+
+static void test_lz()
+{
+    Machine machine(counter_rom());
+    machine.run_frames(2);
+    // machine state, nothing but zeroes, noise and nothing at all
+    std::vector<std::vector<uint8_t>> inputs = {save(machine), std::vector<uint8_t>(10000), {}};
+    std::vector<uint8_t> noise(5000);
+    uint32_t seed = 1;
+    for (auto& byte : noise) byte = (seed = seed * 1103515245 + 12345) >> 24;
+    inputs.push_back(noise);
+
+    for (const auto& input : inputs)
+    {
+        std::vector<uint8_t> packed = {0xAA};
+        const size_t clen = lz_compress(input.data(), input.size(), packed);
+        // appended after what was there
+        assert(packed.size() == clen + 1 && packed[0] == 0xAA);
+        std::vector<uint8_t> output(input.size());
+        lz_decompress(&packed[1], clen, output.data(), output.size());
+        assert(output == input);
+        if (input.empty()) continue;
+        // the wrong length is an error, not a partial copy
+        output.resize(input.size() + 1);
+        assert(throws([&] { lz_decompress(&packed[1], clen, output.data(), output.size()); }));
+        assert(throws([&] { lz_decompress(&packed[1], clen - 1, output.data(), input.size()); }));
+    }
+    std::vector<uint8_t> zeroes;
+    assert(inputs[1].size() > 10 * lz_compress(inputs[1].data(), inputs[1].size(), zeroes));
+}
+
+static void test_archive()
+{
+    Machine machine(counter_rom());
+    FILE* file = tmpfile();
+    assert(file != nullptr);
+    std::vector<std::vector<uint8_t>> states;
+    {
+        ArchiveWriter writer(file, 4);
+        for (int frame = 0; frame < 10; frame++)
+        {
+            machine.run_frames(1);
+            states.push_back(save(machine));
+            writer.record(machine);
+        }
+    }
+    std::vector<uint8_t> data(ftell(file));
+    rewind(file);
+    assert(fread(data.data(), 1, data.size(), file) == data.size());
+    fclose(file);
+
+    ArchiveReader reader(data.data(), data.size());
+    assert(reader.frames() == 10 && reader.keyframe_interval() == 4);
+    std::vector<uint8_t> state;
+    assert(reader.state(4, state) == archive_t::KEYFRAME && state == states[4]);
+    assert(reader.state(6, state) == archive_t::DELTA && state.size() < states[6].size());
+    // seeking back and forth, across keyframes and within them
+    Machine other(counter_rom());
+    for (const size_t frame : {9, 0, 4, 6, 5, 3, 8})
+    {
+        reader.restore(other, frame);
+        assert(save(other) == states[frame]);
+    }
+    assert(throws([&] { reader.restore(other, 10); }));
+
+    // a full disk is an error, and leaves no index behind
+    if (FILE* full = fopen("/dev/full", "wb"))
+    {
+        ArchiveWriter writer(full, 4);
+        bool failed = false;
+        for (int frame = 0; frame < 100 && !failed; frame++)
+            failed = throws([&] { writer.record(machine); });
+        failed |= throws([&] { writer.finish(); });
+        assert(failed);
+        fclose(full);
+    }
+}
+
+// polls the joypad once per frame, and keeps every mask it read in work RAM
+static std::shared_ptr<const ROM> joypad_rom()
+{
+    std::vector<uint8_t> rom(0x8000);
+    rom[0x40] = 0xD9; // RETI
+    const std::vector<uint8_t> program = {
+        0x3E, 0x01,       // LD A, 0x01
+        0xE0, 0xFF,       // LDH (IE), A: V-blank
+        0x21, 0x00, 0xC0, // LD HL, 0xC000
+        0xFB,             // EI
+        0x76,             // HALT
+        0x00,             // NOP
+        0x3E, 0x20,       // LD A, 0x20
+        0xE0, 0x00,       // LDH (P1), A: select the dpad
+        0xF0, 0x00,       // LDH A, (P1)
+        0xE6, 0x0F,       // AND 0x0F
+        0x47,             // LD B, A
+        0x3E, 0x10,       // LD A, 0x10
+        0xE0, 0x00,       // LDH (P1), A: select the buttons
+        0xF0, 0x00,       // LDH A, (P1)
+        0xE6, 0x0F,       // AND 0x0F
+        0xCB, 0x37,       // SWAP A
+        0xB0,             // OR B
+        0x2F,             // CPL
+        0x22,             // LD (HL+), A
+        0xCB, 0xA4,       // RES 4, H: stay below 0xD000
+        0x18, 0xE4        // JR -28 (HALT)
+    };
+    std::copy(program.begin(), program.end(), rom.begin() + 0x100);
+    return std::make_shared<const ROM>(std::move(rom));
+}
+
+// the state without when the next event is, which depends on video settings,
+// and without the checksum that covers it
+static std::vector<uint8_t> emulated_state(Machine& machine)
+{
+    machine.cpu.hardware_sync();
+    machine.apu.catch_up();
+    auto state = save(machine);
+    const size_t cpu = find_chunk(state, "CPU ");
+    std::fill(&state[cpu - 4], &state[cpu], 0);
+    std::fill(&state[cpu + 28], &state[cpu + 36], 0);
+    return state;
+}
+
+static void test_movie()
+{
+    const auto rom = joypad_rom();
+    Machine recorder(rom);
+    recorder.gpu.set_headless(true);
+    recorder.run_frames(2);
+    const auto start = save(recorder);
+
+    InputMovie movie;
+    movie.record(recorder, [](Machine& machine, int) {
+        static const uint8_t masks[] = {0x0, DPAD_RIGHT, DPAD_RIGHT | BUTTON_A, BUTTON_B,
+                                        DPAD_UP | DPAD_LEFT | BUTTON_START};
+        machine.set_inputs(masks[(machine.gpu.frame_count() / 7) % 5]);
+    });
+    recorder.run_frames(120);
+    movie.stop(recorder);
+    const auto end = emulated_state(recorder);
+    // every frame polled once, and the masks reached the game
+    assert(movie.ticks() >= 119 && movie.ticks() <= 121);
+    assert(recorder.memory.read8(0xC000 + 30) != recorder.memory.read8(0xC000 + 10));
+
+    std::vector<uint8_t> file;
+    movie.serialize(file);
+    InputMovie loaded = InputMovie::load(file.data(), file.size());
+    assert(loaded.ticks() == movie.ticks() && loaded.length_cycles() == movie.length_cycles());
+    std::vector<uint8_t> again;
+    loaded.serialize(again);
+    assert(again == file);
+
+    // any damage is caught by the checksum, or before it
+    for (size_t i = 0; i < file.size(); i += 7)
+    {
+        auto bad = file;
+        bad[i] ^= 0x10;
+        assert(throws([&] { InputMovie::load(bad.data(), bad.size()); }));
+    }
+    assert(throws([&] { InputMovie::load(file.data(), file.size() - 1); }));
+    assert(throws([&] { InputMovie::load(file.data(), 8); }));
+
+    // replays on a machine that renders, and at full speed
+    Machine player(rom);
+    player.restore_state(start);
+    loaded.play(player);
+    player.run_for_cycles(loaded.length_cycles());
+    loaded.stop(player);
+    assert(loaded.finished());
+    assert(emulated_state(player) == end);
+
+    Machine turbo(rom);
+    turbo.restore_state(start);
+    loaded.play_turbo(turbo);
+    assert(!turbo.gpu.is_headless());
+    assert(emulated_state(turbo) == end);
+
+    // but only from the state it was recorded from
+    assert(throws([&] { loaded.play(player); }));
+}
+
+static void test_pool()
+{
+    Machine machine(counter_rom());
+    machine.run_frames(2);
+    const auto start = std::make_shared<const std::vector<uint8_t>>(save(machine));
+    const uint64_t started = machine.now();
+
+    // more jobs than threads, of uneven lengths, and one that throws
+    MachinePool pool(counter_rom(), 3);
+    const int JOBS = 20;
+    for (int i = 0; i < JOBS; i++)
+    {
+        pool.submit(start, [=](Machine& m, unsigned) {
+            assert(m.now() == started);
+            m.run_frames(1 + (i * 7) % 5);
+            if (i == 13) throw MachineException("Job failed");
+        });
+    }
+    std::vector<int> returned(JOBS);
+    int errors = 0;
+    while (pool.pending() > 0)
+    {
+        try
+        {
+            returned.at(pool.wait_any())++;
+        }
+        catch (const MachineException&)
+        {
+            errors++;
+        }
+    }
+    assert(errors == 1);
+    for (int i = 0; i < JOBS; i++) assert(returned[i] == (i == 13 ? 0 : 1));
+    assert(throws([&] { pool.wait_any(); }));
+
+    // a job gets the pool settings back, whatever the previous job changed,
+    // and the callbacks left behind would fail the next job
+    MachinePool single(counter_rom(), 1);
+    single.submit(start, [](Machine& m, unsigned) {
+        m.gpu.set_headless(false);
+        m.cpu.set_block_cache(false);
+        m.cpu.set_idle_skip(false);
+        m.cpu.breakpoint(0x103, breakpoint_t{[](CPU&, uint8_t) {
+                             throw MachineException("Breakpoint");
+                         }});
+        m.memory.watchpoint(Memory::WRITE, {0xC000, 0xC000}, [](Memory&, uint16_t, uint8_t) {
+            throw MachineException("Watchpoint");
+        });
+    });
+    single.submit(start, [](Machine& m, unsigned) {
+        assert(m.gpu.is_headless());
+        assert(m.cpu.block_cache_enabled() && m.cpu.idle_skip_enabled());
+        m.run_frames(2);
+    });
+    single.wait_any();
+    single.wait_any();
+}
+
 void do_test_machine()
 {
     test_alu();
+    test_rom();
+    test_block_cache();
+    test_idle_skip();
+    test_timer();
+    test_dma();
+    test_savestate_errors();
+    test_delta_chain();
+    test_fork();
+    test_lz();
+    test_archive();
+    test_movie();
+    test_pool();
 
     printf("Tests SUCCESS!\n");
     exit(0);
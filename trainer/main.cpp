@@ -4,6 +4,9 @@
 #include "../src/stuff.hpp"
 #include <chrono>
 #include <libgbc/machine.hpp>
+#include <libgbc/movie.hpp>
+#include <libgbc/pool.hpp>
+#include <map>
 using buffer_t = std::vector<uint8_t>;
 
 static const int SNAPSHOT_INTERVAL = 512;
@@ -33,10 +36,10 @@ struct snapshot_t
         this->frame = other.frame;
         // overwrite machine state
         this->state = other.state;
-        // for improvements go back to old size
+        // improvements replace the inputs of the last snapshot
         if (improvement) { inputs.resize(this->improve_size); }
         // to be able to improve this snapshot we must remember the old size
-        this->improve_size = other.inputs.size();
+        else { this->improve_size = inputs.size(); }
         // append new snapshot inputs to current
         inputs.insert(inputs.end(), other.inputs.begin(), other.inputs.end());
     }
@@ -73,6 +76,9 @@ struct Worker
 
     const int tidx;
     bool started = false;
+    // stuck detection, per rollout
+    uint16_t last_scroll = 0;
+    size_t stuck_detect = 0;
     training_results_t result;
 };
 
@@ -106,8 +112,9 @@ void Worker::setup_callbacks(gbc::Machine& machine)
             auto& snapshot = this->result.snapshot;
             snapshot.progress = progress;
             snapshot.frame = machine.gpu.frame_count();
+            // only the pages written since the session was forked from the base
             snapshot.state.clear();
-            machine.serialize_state(snapshot.state);
+            machine.serialize_delta(snapshot.state);
             snapshot.inputs = result.inputs;
         }
     });
@@ -127,8 +134,6 @@ void Worker::simulate_running(gbc::Machine& machine)
     {
         const uint8_t SCX = machine.memory.read8(gbc::IO::REG_SCX);
         // stuck detection using SCX register
-        thread_local uint16_t last_scroll = 0;
-        thread_local size_t stuck_detect = 0;
         if (last_scroll == SCX)
         {
             if (stuck_detect++ >= 500)
@@ -196,85 +201,129 @@ void Worker::simulate_running(gbc::Machine& machine)
     result.progress = SCROLL_X;
 }
 
-// record gameboy input state
-static void write_recorded_state(const buffer_t& inputs)
+// record gameboy input state as a movie that starts at power-on
+static void write_recorded_state(std::shared_ptr<const gbc::ROM> rom, const buffer_t& inputs)
 {
+    gbc::Machine machine{std::move(rom)};
+    gbc::InputMovie movie;
+    movie.start(machine);
+    for (const uint8_t jpad : inputs) movie.append(jpad);
+    std::vector<uint8_t> data;
+    movie.serialize(data);
+
     FILE* outf = fopen("output.gis", "wb");
     assert(outf != nullptr);
-    fwrite(inputs.data(), inputs.size(), 1, outf);
+    fwrite(data.data(), data.size(), 1, outf);
     fclose(outf);
-    printf("\n* Recorded %zu bytes of inputs\n", inputs.size());
+    printf("\n* Recorded %zu inputs (%zu bytes)\n", inputs.size(), data.size());
 }
 
-#include <future>
-#include <thread>
-static training_results_t training_session(const int tidx, const buffer_t& romdata,
-                                           const buffer_t machine_state)
+// a rollout starts from the base of a generation, and its snapshot is a delta
+// against that base
+struct rollout_t
+{
+    uint32_t generation;
+    training_results_t result;
+};
+struct base_t
 {
-    gbc::Machine machine{romdata};
-    machine.gpu.scanline_rendering(false);
-    if (!machine_state.empty()) { machine.restore_state(machine_state); }
+    gbc::MachinePool::state_t state;
+    uint32_t generation = UINT32_MAX;
+};
 
-    Worker thread_ctx{.tidx = tidx};
+static void training_session(gbc::Machine& machine, const unsigned worker, rollout_t& rollout)
+{
+    Worker thread_ctx{.tidx = int(worker + 1)};
     thread_ctx.setup_callbacks(machine);
 
-    while (machine.is_running()) { machine.simulate(); }
+    while (machine.is_running()) { machine.run_frames(60); }
 
-    return std::move(thread_ctx.result);
+    rollout.result = std::move(thread_ctx.result);
 }
 
 int main(int argc, char** args)
 {
     const char* romfile = "../smbland2_dx.gbc";
     if (argc >= 2) romfile = args[1];
+    // zero means one thread per core
+    const unsigned num_threads = (argc >= 3) ? atoi(args[2]) : 0;
 
-    const auto romdata = load_file(romfile);
-    printf("Loaded %zu bytes ROM\n", romdata.size());
+    // every machine shares the same read-only mapping of the ROM
+    const auto rom = gbc::ROM::map_file(romfile);
+    printf("Loaded %zu bytes ROM\n", rom->size());
 
     srand(time(0));
 
-    static const int NUM_THREADS = 4;
-    std::array<std::future<training_results_t>, NUM_THREADS> futures;
-    std::array<training_results_t, NUM_THREADS> results;
+    gbc::MachinePool pool{rom, num_threads};
+    printf("Training on %u threads\n", pool.threads());
     snapshot_t best_snapshot;
+    // the bases are kept up to date on this machine
+    gbc::Machine base{rom};
+    base.gpu.set_headless(true);
+    uint32_t generations = 0;
+    auto make_base = [&] {
+        auto state = std::make_shared<std::vector<uint8_t>>();
+        base.serialize_state(*state);
+        return base_t{std::move(state), generations++};
+    };
+    // rollouts start from the current base, and the best snapshot was reached
+    // from the parent base, where improvements to it must start from
+    base_t current = make_base();
+    base_t parent;
+
+    std::map<uint64_t, std::shared_ptr<rollout_t>> rollouts;
+    auto launch = [&] {
+        auto rollout = std::make_shared<rollout_t>();
+        rollout->generation = current.generation;
+        rollouts[pool.submit(current.state, [rollout](gbc::Machine& machine, unsigned worker) {
+            training_session(machine, worker, *rollout);
+        })] = rollout;
+    };
+    // more rollouts than threads, so that no thread waits for the next one
+    for (unsigned i = 0; i < 2 * pool.threads(); i++) launch();
 
     while (true)
     {
-        for (size_t i = 0; i < NUM_THREADS; i++)
+        const uint64_t id = pool.wait_any();
+        const auto rollout = rollouts.at(id);
+        rollouts.erase(id);
+        const auto& result = rollout->result;
+        // rollouts from older bases no longer connect to the best snapshot
+        const bool is_current = rollout->generation == current.generation;
+        const bool is_parent = rollout->generation == parent.generation;
+
+        if (result.verdict == training_results_t::FINISH && (is_current || is_parent))
         {
-            futures.at(i) = std::async(std::launch::async, training_session, i + 1, romdata,
-                                       best_snapshot.state);
+            printf("*** Final result frame %zu\n", result.frame);
+            if (is_parent) best_snapshot.inputs.resize(best_snapshot.improve_size);
+            best_snapshot.append_inputs(result.inputs);
+            best_snapshot.inputs.push_back(0); // disable inputs
+            write_recorded_state(rom, best_snapshot.inputs);
+            return 0;
         }
-        for (size_t i = 0; i < NUM_THREADS; i++)
+        // check if there is a decent snapshot
+        if (result.snapshot.validate(result.progress))
         {
-            results.at(i) = futures.at(i).get();
-            const auto& result = results.at(i);
-            if (result.verdict == training_results_t::FINISH)
+            if (is_current && result.snapshot.better(best_snapshot))
             {
-                printf("*** Final result frame %zu\n", result.frame);
-                best_snapshot.append_inputs(result.inputs);
-                best_snapshot.inputs.push_back(0); // disable inputs
-                write_recorded_state(best_snapshot.inputs);
-                return 0;
+                best_snapshot.append(result.snapshot, false);
+                printf("*** New best snapshot at progress %u\n", best_snapshot.progress);
+                parent = current;
+                base.restore_state(*parent.state);
+                base.restore_delta(best_snapshot.state);
+                current = make_base();
             }
-            // check if there is a decent snapshot
-            if (result.snapshot.validate(result.progress))
+            else if (is_parent && (result.snapshot.better(best_snapshot) ||
+                                   result.snapshot.improvement(best_snapshot)))
             {
-                if (result.snapshot.better(best_snapshot))
-                {
-                    best_snapshot.append(result.snapshot, false);
-                    printf("*** New best snapshot at progress %u\n", best_snapshot.progress);
-                }
-                else if (result.snapshot.improvement(best_snapshot))
-                {
-                    best_snapshot.append(result.snapshot, true);
-                    printf("*** New improved snapshot at progress %u\n", best_snapshot.progress);
-                }
-                // write_recorded_state(best_snapshot.inputs);
+                best_snapshot.append(result.snapshot, true);
+                printf("*** New improved snapshot at progress %u\n", best_snapshot.progress);
+                base.restore_state(*parent.state);
+                base.restore_delta(best_snapshot.state);
+                current = make_base();
             }
         }
+        launch();
     }
-    // auto best = std::min_element(std::begin(results), std::end(results));
-    // printf("Final result frame %zu\n", best->frame);
     return 0;
 }
@@ -1,5 +1,6 @@
 #include "varnish.h"
 #include <cstdio>
+#include <libgbc/audio_chunk.hpp>
 #include <libgbc/machine.hpp>
 #include <spng.h>
 
@@ -9,9 +10,16 @@ static std::vector<uint8_t> romdata { rom, rom + rom_size };
 
 using PaletteArray = std::array<uint32_t, 64>;
 using PixelArray = std::array<uint16_t, 160 * 144>;
+// Audio of the last frame, sent along with it in the PNG
+static constexpr unsigned AUDIO_RATE = 32000;
+struct AudioChunk {
+	uint32_t size = 0;
+	std::array<uint8_t, 4096> data;
+};
 struct PixelState {
 	PixelArray pixels;
 	PaletteArray palette;
+	AudioChunk audio;
 };
 struct InputState {
 	bool a = false;
@@ -22,9 +30,12 @@ struct InputState {
 };
 static gbc::Machine* machine = nullptr;
 static PixelState storage_state;
+static std::vector<gbc::sample_t> audio_samples;
+static gbc::AudioEncoder audio_encoder { AUDIO_RATE };
+static std::vector<uint8_t> audio_buffer;
 
 static std::pair<void*, size_t>
-generate_png(const PixelArray& pixels, const PaletteArray& palette)
+generate_png(const PixelArray& pixels, const PaletteArray& palette, const AudioChunk& audio)
 {
     const int size_x = 160;
     const int size_y = 144;
@@ -49,6 +60,13 @@ generate_png(const PixelArray& pixels, const PaletteArray& palette)
 
 	spng_set_ihdr(enc, &ihdr);
 
+	// Audio goes into a private ancillary chunk, which the page decodes
+	spng_unknown_chunk audio_chunk {
+		{'g', 'b', 'A', 'u'}, audio.size, (void*)audio.data.data(), SPNG_AFTER_IHDR
+	};
+	if (audio.size > 0)
+		spng_set_unknown_chunks(enc, &audio_chunk, 1);
+
 	int ret =
 		spng_encode_image(enc,
 			rgba_pixels.data(), rgba_pixels.size() * 4,
@@ -89,6 +107,8 @@ static void get_state(size_t n, struct virtbuffer vb[n], size_t res)
 	current_state.inputs.direction |= inputs.direction;
 
 	auto t1 = time_now();
+	// Audio is only sent once, with the frame it belongs to
+	storage_state.audio.size = 0;
 
 	if (time_diff(current_state.ts, t1) > 0.016)
 	{
@@ -107,11 +127,20 @@ static void get_state(size_t n, struct virtbuffer vb[n], size_t res)
 		gbc::setflag(current_state.inputs.direction & 8, keys, gbc::DPAD_LEFT);
 		machine->set_inputs(keys);
 
-		machine->simulate_one_frame();
+		machine->run_frames(1);
 		current_state.frame_number = machine->gpu.frame_count();
 		current_state.ts = t1;
 		std::copy(machine->gpu.pixels().begin(), machine->gpu.pixels().end(), storage_state.pixels.begin());
 		current_state.inputs = {};
+
+		// Samples that do not fit are sent with the next frame
+		const size_t max_samples = storage_state.audio.data.size() - gbc::AudioEncoder::HEADER_SIZE;
+		const size_t count = std::min(audio_samples.size(), max_samples);
+		audio_buffer.clear();
+		audio_encoder.encode(audio_samples.data(), count, audio_buffer);
+		audio_samples.erase(audio_samples.begin(), audio_samples.begin() + count);
+		std::copy(audio_buffer.begin(), audio_buffer.end(), storage_state.audio.data.begin());
+		storage_state.audio.size = audio_buffer.size();
 	}
 
 	storage_return(&storage_state, sizeof(storage_state));
@@ -146,7 +175,7 @@ static void on_get(const char* c_url, int, int)
 	PixelState state;
 	storage_call(get_state, &inputs, sizeof(inputs), &state, sizeof(state));
 
-	auto png = generate_png(state.pixels, state.palette);
+	auto png = generate_png(state.pixels, state.palette, state.audio);
 	const char* ctype = "image/png";
 	backend_response(200, ctype, strlen(ctype),
 		png.first, png.second);
@@ -189,6 +218,10 @@ int main(int argc, char** argv)
 		machine->gpu.on_palchange([](const uint8_t idx, const uint16_t color) {
 	        storage_state.palette.at(idx) = gbc::GPU::color15_to_rgba32(color);
 	    });
+		machine->apu.set_sample_rate(AUDIO_RATE);
+		machine->apu.on_audio_out([](const gbc::sample_t* samples, size_t count) {
+			audio_samples.insert(audio_samples.end(), samples, samples + count);
+		});
 
 		current_state.frame_number = 0;
 		current_state.ts = time_now();